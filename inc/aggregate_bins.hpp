@@ -1,6 +1,15 @@
 #ifndef H_AGGREGATE_BINS
 #define H_AGGREGATE_BINS
 
+#include <vector>
+
+#include "bin.hpp"
+#include "process.hpp"
+#include "cut.hpp"
+
 void GetOptions(int argc, char *argv[]);
+void WriteWeightSystematics(const std::vector<Bin> &bins,
+                            const std::vector<Process> &processes,
+                            const Cut &baseline);
 
 #endif
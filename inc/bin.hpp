@@ -5,9 +5,11 @@
 #include <string>
 #include <set>
 #include <tuple>
+#include <cstddef>
 
 #include "systematic.hpp"
 #include "cut.hpp"
+#include "interner.hpp"
 
 class Bin{
   typedef std::set<Systematic> SystCollection;
@@ -37,11 +39,14 @@ public:
   bool operator<(const Bin &b) const;
   bool operator==(const Bin &b) const;
 
+  std::size_t Id() const;
+
 private:
   class Cut cut_;
   std::string name_;
   SystCollection systematics_;
   bool is_blind_;
+  InternedId id_;
 };
 
 std::ostream & operator<<(std::ostream &stream, const Bin &bin);
@@ -17,7 +17,8 @@ public:
   BlockYields(const Block &block,
 	      const std::set<Process> &processes,
 	      const Cut &cut,
-	      const YieldManager &yields);
+	      const YieldManager &yields,
+	      double lumi);
 
   std::vector<GammaParams> RowSums() const;
   std::vector<GammaParams> ColSums() const;
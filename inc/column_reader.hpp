@@ -0,0 +1,41 @@
+#ifndef H_COLUMN_READER
+#define H_COLUMN_READER
+
+#include <string>
+#include <vector>
+
+#include "TTree.h"
+#include "TLeaf.h"
+
+class ColumnReader{
+public:
+  ColumnReader(TTree &tree,
+               const std::vector<std::string> &branches,
+               std::size_t chunk_size = 4096);
+
+  bool Next();
+
+  std::size_t Size() const;
+  Long64_t FirstEntry() const;
+  int TreeNumber() const;
+  Long64_t BytesRead() const;
+
+  const std::vector<std::string> & Branches() const;
+  const std::vector<std::vector<double> > & Columns() const;
+
+private:
+  TTree &tree_;
+  std::vector<std::string> branches_;
+  std::vector<TLeaf*> leaves_;
+  std::vector<std::vector<double> > columns_;
+  std::size_t chunk_size_, size_;
+  Long64_t num_entries_, first_entry_, next_entry_, bytes_read_;
+  int tree_number_;
+
+  ColumnReader(const ColumnReader &) = delete;
+  ColumnReader& operator=(const ColumnReader &) = delete;
+
+  void UpdateLeaves();
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef H_COMPILED_CUT
+#define H_COMPILED_CUT
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "cut.hpp"
+
+class CompiledCut{
+public:
+  explicit CompiledCut(const Cut &cut);
+
+  bool IsValid() const;
+  const std::string & Error() const;
+
+  const std::vector<std::string> & Variables() const;
+  void MapVariables(const std::vector<std::string> &variables);
+
+  double Evaluate(const double *values) const;
+  void Evaluate(const std::vector<std::vector<double> > &columns,
+                std::size_t size,
+                std::vector<double> &results) const;
+
+  enum class Op{constant, variable,
+      negate, logical_not,
+      add, subtract, multiply, divide, modulo, power,
+      less, less_equal, greater, greater_equal, equal, not_equal,
+      logical_and, logical_or, bit_and, bit_or, shift_left, shift_right,
+      abs, sqrt, exp, log, log10, sin, cos, min, max};
+
+  struct Node{
+    Op op;
+    double value;
+    std::string name;
+    std::vector<std::unique_ptr<Node> > args;
+  };
+
+  explicit CompiledCut(const Node &node);
+
+  static std::unique_ptr<Node> Parse(const Cut &cut, std::string &error);
+  static bool IsBoolean(const Node &node);
+  static std::string Describe(const Node &node);
+  static void Decompose(const Node &node,
+                        std::vector<const Node*> &predicates,
+                        std::vector<const Node*> &factors);
+
+private:
+  struct Instruction{
+    Op op;
+    double value;
+    std::size_t index;
+  };
+
+  static const std::size_t max_stack_size_ = 64;
+
+  std::vector<Instruction> code_;
+  std::vector<std::string> variables_;
+  std::string error_;
+  std::size_t max_depth_;
+  bool is_valid_;
+
+  void Build(const Node &node);
+  void Compile(const Node &node, std::size_t depth, std::size_t &max_depth);
+};
+
+#endif
@@ -4,6 +4,9 @@
 #include <string>
 #include <ostream>
 #include <tuple>
+#include <cstddef>
+
+#include "interner.hpp"
 
 class Cut{
 public:
@@ -12,6 +15,7 @@ public:
 
   Cut & Replace(const Cut &orig, const Cut &rep);
   Cut & RmCutOn(const Cut &to_rm, const Cut &rep = Cut());
+  Cut & Substitute(const std::string &variable, const std::string &replacement);
 
   Cut & operator &= (const Cut &cut);
   Cut & operator |= (const Cut &cut);
@@ -32,9 +36,12 @@ public:
 
   std::string GetCut();
   void SetCut(std::string &cut);
+
+  std::size_t Id() const;
     
 private:
   std::string cut_;
+  InternedId id_;
 
   void Clean();
 };
@@ -0,0 +1,54 @@
+#ifndef H_CUT_CLASSIFIER
+#define H_CUT_CLASSIFIER
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cut.hpp"
+#include "compiled_cut.hpp"
+
+class CutClassifier{
+public:
+  explicit CutClassifier(const std::vector<Cut> &cuts);
+
+  bool IsValid() const;
+  const std::string & Error() const;
+
+  const std::vector<std::string> & Variables() const;
+  void MapVariables(const std::vector<std::string> &variables);
+
+  std::size_t NumCuts() const;
+  std::size_t NumPredicates() const;
+  std::size_t NumFactors() const;
+
+  void Fill(const std::vector<std::vector<double> > &columns,
+            std::size_t size,
+            std::vector<double> &sumw,
+            std::vector<double> &sumw2) const;
+  void Fill(const std::vector<std::vector<double> > &columns,
+            std::size_t size,
+            const std::vector<std::size_t> &rows,
+            std::vector<double> &sumw,
+            std::vector<double> &sumw2) const;
+
+private:
+  std::vector<CompiledCut> predicates_;
+  std::vector<CompiledCut> factors_;
+  std::vector<std::vector<std::size_t> > weight_sets_;
+  std::vector<std::vector<std::uint64_t> > cut_masks_;
+  std::vector<std::size_t> cut_weight_sets_;
+  std::vector<std::string> variables_;
+  std::string error_;
+  bool is_valid_;
+  mutable std::vector<std::uint64_t> memo_masks_;
+  mutable std::vector<std::vector<std::size_t> > memo_passing_;
+  mutable std::vector<std::size_t> memo_slots_;
+
+  std::size_t NumWords() const;
+  const std::vector<std::size_t> & PassingCuts(const std::uint64_t *mask) const;
+  std::size_t FindSlot(const std::uint64_t *mask) const;
+  void ResizeMemo(std::size_t num_slots) const;
+};
+
+#endif
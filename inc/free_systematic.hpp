@@ -2,8 +2,9 @@
 #define H_FREE_SYSTEMATIC
 
 #include <string>
-#include <map>
-#include <utility>
+#include <vector>
+#include <unordered_map>
+#include <memory>
 #include <ostream>
 
 #include "bin.hpp"
@@ -11,7 +12,25 @@
 
 class FreeSystematic{
 public:
-  FreeSystematic(const std::string &name);
+  class Index{
+  public:
+    Index(const std::vector<std::string> &bin_names,
+          const std::vector<std::string> &process_names);
+
+    std::size_t NumBins() const;
+    std::size_t NumProcesses() const;
+
+    bool FindBin(const std::string &name, std::size_t &ibin) const;
+    bool FindProcess(const std::string &name, std::size_t &iprc) const;
+
+    std::string Description() const;
+
+  private:
+    std::vector<std::string> bin_names_, process_names_;
+    std::unordered_map<std::string, std::size_t> bins_, processes_;
+  };
+
+  FreeSystematic(const std::string &name, const std::shared_ptr<const Index> &index);
 
   const std::string & Name() const;
   std::string & Name();
@@ -20,13 +39,27 @@ public:
 
   double Strength(const Bin &bin, const Process &process) const;
   double & Strength(const Bin &bin, const Process &process);
+  double & Strength(std::size_t ibin, std::size_t iprc);
 
   bool operator<(const FreeSystematic &syst) const;
   bool operator==(const FreeSystematic &syst) const;
 
+  static bool ReadCache(const std::string &path,
+                        const std::string &contents,
+                        const std::shared_ptr<const Index> &index,
+                        std::vector<FreeSystematic> &systs);
+  static void WriteCache(const std::string &path,
+                         const std::string &contents,
+                         const Index &index,
+                         const std::vector<FreeSystematic> &systs);
+
 private:
   std::string name_;
-  std::map<std::pair<Bin, Process>, double> strengths_;
+  std::shared_ptr<const Index> index_;
+  std::vector<double> strengths_;
+
+  bool FindCell(const Bin &bin, const Process &process, std::size_t &icell) const;
+  static std::string CacheDescription(const std::string &contents, const Index &index);
 };
 
 std::ostream & operator<<(std::ostream &stream, const FreeSystematic &syst);
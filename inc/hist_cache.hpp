@@ -0,0 +1,6 @@
+#ifndef H_HIST_CACHE
+#define H_HIST_CACHE
+
+void GetOptions(int argc, char *argv[]);
+
+#endif
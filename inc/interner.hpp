@@ -0,0 +1,111 @@
+#ifndef H_INTERNER
+#define H_INTERNER
+
+#include <cstddef>
+#include <map>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <functional>
+#include <stdexcept>
+
+//Maps each distinct value (as ordered by Less) to a small integer ID, starting at 1,
+//and back. Values are stored once for the lifetime of the program. Interning a new
+//value takes a lock; looking a value up by ID does not.
+template<typename T, typename Less = std::less<T> >
+class Interner{
+public:
+  static std::size_t Id(const T &value){
+    Storage &storage = GetStorage();
+    std::lock_guard<std::mutex> lock(storage.mutex);
+    auto found = storage.ids.find(value);
+    if(found != storage.ids.end()) return found->second;
+    std::size_t index = storage.size.load(std::memory_order_relaxed);
+    std::size_t ichunk = index/chunk_size_;
+    if(ichunk >= max_chunks_) throw std::length_error("Too many interned values");
+    T *chunk = storage.chunks.at(ichunk).load(std::memory_order_relaxed);
+    if(chunk == nullptr){
+      chunk = static_cast<T*>(::operator new(chunk_size_*sizeof(T)));
+      storage.chunks.at(ichunk).store(chunk, std::memory_order_release);
+    }
+    new(chunk+index%chunk_size_) T(value);
+    //Published only once the value is in place, so readers never see it half built
+    storage.size.store(index+1, std::memory_order_release);
+    storage.ids.emplace(value, index+1);
+    return index+1;
+  }
+
+  static const T & Get(std::size_t id){
+    Storage &storage = GetStorage();
+    if(id == 0 || id > storage.size.load(std::memory_order_acquire)){
+      throw std::out_of_range("Unknown interned ID");
+    }
+    std::size_t index = id-1;
+    return storage.chunks.at(index/chunk_size_).load(std::memory_order_acquire)[index%chunk_size_];
+  }
+
+private:
+  //Chunks never move once allocated, unlike the blocks of a growing container
+  static const std::size_t chunk_size_ = 1024;
+  static const std::size_t max_chunks_ = 4096;
+
+  struct Storage{
+    std::mutex mutex;
+    std::map<T, std::size_t, Less> ids;
+    std::array<std::atomic<T*>, max_chunks_> chunks;
+    std::atomic<std::size_t> size;
+
+    Storage():
+      mutex(),
+      ids(),
+      chunks(),
+      size(0){
+      for(auto &chunk: chunks){
+        chunk.store(nullptr, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  static Storage & GetStorage(){
+    //Never destroyed, since other threads may still read values during shutdown
+    static Storage *storage = new Storage();
+    return *storage;
+  }
+};
+
+//ID cached by an interned object. Safe to read and fill from several threads sharing a
+//const object, and copied along with the object.
+class InternedId{
+public:
+  InternedId():
+    id_(0){
+  }
+
+  InternedId(const InternedId &other):
+    id_(other.id_.load(std::memory_order_acquire)){
+  }
+
+  InternedId & operator=(const InternedId &other){
+    id_.store(other.id_.load(std::memory_order_acquire), std::memory_order_release);
+    return *this;
+  }
+
+  InternedId & operator=(std::size_t id){
+    id_.store(id, std::memory_order_release);
+    return *this;
+  }
+
+  operator std::size_t() const{
+    return id_.load(std::memory_order_acquire);
+  }
+
+  void Set(std::size_t id) const{
+    id_.store(id, std::memory_order_release);
+  }
+
+private:
+  mutable std::atomic<std::size_t> id_;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef H_PARTIAL_SUM_CACHE
+#define H_PARTIAL_SUM_CACHE
+
+#include <string>
+#include <vector>
+
+#include "cut.hpp"
+
+class PartialSumCache{
+public:
+  explicit PartialSumCache(const std::string &directory = "");
+
+  const std::string & Directory() const;
+  PartialSumCache & Directory(const std::string &directory);
+
+  bool Enabled() const;
+
+  std::vector<std::size_t> Load(const std::string &file,
+                                const std::vector<std::string> &point_branches,
+                                const std::vector<Cut> &cuts,
+                                std::vector<std::vector<double> > &points,
+                                std::vector<std::vector<double> > &sumw,
+                                std::vector<std::vector<double> > &sumw2) const;
+  void Store(const std::string &file,
+             const std::vector<std::string> &point_branches,
+             const std::vector<Cut> &cuts,
+             const std::vector<std::vector<double> > &points,
+             const std::vector<std::vector<double> > &sumw,
+             const std::vector<std::vector<double> > &sumw2) const;
+
+  bool LoadEntries(const std::string &file, long &entries) const;
+  void StoreEntries(const std::string &file, long entries) const;
+
+private:
+  struct Record{
+    std::vector<std::vector<double> > points;
+    std::vector<std::string> cuts;
+    std::vector<std::vector<double> > sumw, sumw2;
+  };
+
+  std::string directory_;
+
+  bool Read(const std::string &path, const std::string &description, Record &record) const;
+  std::string Description(const std::string &file,
+                          const std::vector<std::string> &point_branches) const;
+  std::string Path(const std::string &file,
+                   const std::vector<std::string> &point_branches) const;
+  std::string EntriesDescription(const std::string &file) const;
+  std::string EntriesPath(const std::string &file) const;
+};
+
+#endif
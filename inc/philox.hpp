@@ -0,0 +1,27 @@
+#ifndef H_PHILOX
+#define H_PHILOX
+
+#include <cstdint>
+#include <array>
+
+class Philox{
+public:
+  using result_type = std::uint32_t;
+
+  Philox(std::uint64_t seed, std::uint64_t stream, std::uint32_t substream = 0);
+
+  static constexpr result_type min(){return 0u;}
+  static constexpr result_type max(){return 0xFFFFFFFFu;}
+  result_type operator()();
+
+  static std::uint64_t RandomSeed();
+
+private:
+  std::array<std::uint32_t, 2> key_;
+  std::array<std::uint32_t, 4> counter_, block_;
+  std::size_t index_;
+
+  void NextBlock();
+};
+
+#endif
@@ -3,9 +3,13 @@
 
 #include <string>
 #include <set>
+#include <map>
+#include <array>
+#include <vector>
 #include <initializer_list>
 #include <tuple>
 #include <memory>
+#include <mutex>
 #include <ostream>
 
 #include "TChain.h"
@@ -13,6 +17,7 @@
 #include "cut.hpp"
 #include "gamma_params.hpp"
 #include "systematic.hpp"
+#include "interner.hpp"
 
 class Process{
   typedef std::set<Systematic> SystCollection;
@@ -49,9 +54,17 @@ public:
   bool & CountZeros();
 
   const std::set<std::string> & FileNames() const;
+  std::vector<std::string> Files() const;
+  std::string FileSetHash() const;
 
   long GetEntries() const;
   GammaParams GetYield(const class Cut &cut = ::Cut("1")) const;
+  std::vector<GammaParams> GetYields(const std::vector<class Cut> &cuts) const;
+  std::vector<std::vector<GammaParams> > GetYields(const std::vector<class Cut> &cuts,
+                                                   const std::vector<class Cut> &weights) const;
+  std::map<std::vector<double>, std::vector<GammaParams> >
+  GetYieldsByPoint(const std::vector<class Cut> &cuts,
+                   const std::vector<std::string> &point_branches) const;
 
   const SystCollection & Systematics() const;
   Process & Systematics(const SystCollection &systematics);
@@ -65,18 +78,60 @@ public:
   bool operator<(const Process &p) const;
   bool operator==(const Process &p) const;
 
+  //Also orders on the name and the data and signal flags, which operator< ignores, so
+  //processes interned for yield keys keep their own metadata
+  struct IdentityLess{
+    bool operator()(const Process &a, const Process &b) const;
+  };
+
+  std::size_t Id() const;
+
+  static std::size_t NumThreads();
+  static void NumThreads(std::size_t num_threads);
+  static void EnableThreadSafety();
+
+  static const std::string & PartialSumDirectory();
+  static void PartialSumDirectory(const std::string &directory);
+
 private:
+  //Wildcard expansion, the chain and the entry count are only set up when first
+  //needed, and are shared by all copies of a process
+  struct FileState{
+    std::mutex mutex;
+    bool expanded = false;
+    std::vector<std::string> files;
+    std::shared_ptr<TChain> chain;
+    long entries = -1;
+  };
+
   std::set<std::string> file_names_;
-  mutable std::shared_ptr<TChain> chain_;
+  mutable std::shared_ptr<FileState> file_state_ = std::make_shared<FileState>();
   class Cut cut_;
   std::string name_;
   bool is_data_;
   bool is_signal_;
   bool count_zeros_;
   SystCollection systematics_;
+  InternedId id_;
+
+  static std::size_t num_threads_;
+
+  typedef std::array<std::vector<std::vector<double> >, 3> FileSums;
+
+  static std::mutex & ChainMutex();
+  static class ThreadPool & FilePool();
+  static class PartialSumCache & PartialSums();
+  static FileSums SumFile(const std::string &file,
+                          const std::vector<class Cut> &cuts,
+                          const std::vector<std::string> &point_branches);
 
+  void SumWeights(const std::vector<class Cut> &cuts,
+                  const std::vector<std::string> &point_branches,
+                  std::vector<std::vector<double> > &points,
+                  std::vector<std::vector<double> > &sumw,
+                  std::vector<std::vector<double> > &sumw2) const;
+  TChain & Chain() const;
   void CleanName();
-  void AddFiles();
 };
 
 std::ostream & operator<<(std::ostream &stream, const Process &proc);
@@ -0,0 +1,6 @@
+#ifndef H_SKIM_CACHE
+#define H_SKIM_CACHE
+
+void GetOptions(int argc, char *argv[]);
+
+#endif
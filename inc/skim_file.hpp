@@ -0,0 +1,54 @@
+#ifndef H_SKIM_FILE
+#define H_SKIM_FILE
+
+#include <string>
+#include <vector>
+
+#include "cut.hpp"
+#include "process.hpp"
+#include "gamma_params.hpp"
+
+class SkimFile{
+public:
+  explicit SkimFile(const std::string &path);
+  ~SkimFile();
+
+  bool IsValid() const;
+  const std::string & Path() const;
+  const std::string & Description() const;
+  const std::vector<std::string> & Branches() const;
+  std::size_t Size() const;
+
+  const double * Column(const std::string &branch) const;
+
+  bool GetYields(const Process &process,
+                 const std::vector<Cut> &cuts,
+                 std::vector<GammaParams> &gps) const;
+
+  static std::string Description(const Process &process, const Cut &baseline);
+  static std::string PathFor(const std::string &directory,
+                             const Process &process,
+                             const Cut &baseline);
+  static Cut Selection(const Process &process, const Cut &baseline);
+
+  static void Build(const Process &process,
+                    const Cut &baseline,
+                    const std::vector<std::string> &branches,
+                    const std::string &directory);
+
+private:
+  std::string path_;
+  std::string description_;
+  std::vector<std::string> branches_;
+  std::vector<const double *> columns_;
+  std::size_t size_;
+  void *data_;
+  std::size_t length_;
+
+  SkimFile(const SkimFile &) = delete;
+  SkimFile& operator=(const SkimFile &) = delete;
+
+  bool Map();
+};
+
+#endif
@@ -2,9 +2,9 @@
 #define H_TEST_ABCD
 
 #include <ios>
+#include <cstdint>
 #include <string>
 #include <vector>
-#include <random>
 
 #include "TH1D.h"
 
@@ -12,7 +12,7 @@ std::string GetParamString(int argc, char *argv[]);
 
 double GetTestStatistic(double a, double b, double c, double d);
 
-std::vector<double> SampleTestStatistic(std::mt19937 &prng, size_t n, double a, double b, double c, double d);
+std::vector<double> SampleTestStatistic(std::uint64_t seed, std::uint64_t stream, size_t n, double a, double b, double c, double d);
 
 double QToP(double q);
 double QToZ(double q);
@@ -35,8 +35,6 @@ double BinLogLikelihood(double obs, double pred);
 void PrintRates(std::ostream &out, const std::string &name,
                 double a, double b, double c, double d);
 
-void InitializePRNG(std::mt19937 &prng);
-
 void PlotQDistributions(const std::string &params,
                         const std::vector<double> &b_qs,
                         const std::vector<double> &sb_qs);
@@ -5,6 +5,7 @@
 #include <vector>
 #include <stdexcept>
 #include <iostream>
+#include <cstdint>
 
 #include "TTree.h"
 
@@ -33,6 +34,23 @@ void GetCountAndUncertainty(TTree &tree,
                             double &count,
                             double &uncertainty);
 
+void GetCountsAndUncertainties(TTree &tree,
+                               const std::vector<Cut> &cuts,
+                               std::vector<double> &counts,
+                               std::vector<double> &uncertainties);
+
+void GetSumsOfWeights(TTree &tree,
+                      const std::vector<Cut> &cuts,
+                      std::vector<double> &sumw,
+                      std::vector<double> &sumw2);
+
+void GetSumsOfWeights(TTree &tree,
+                      const std::vector<Cut> &cuts,
+                      const std::vector<std::string> &point_branches,
+                      std::vector<std::vector<double> > &points,
+                      std::vector<std::vector<double> > &sumw,
+                      std::vector<std::vector<double> > &sumw2);
+
 std::string execute(const std::string &cmd);
 
 std::vector<std::string> Tokenize(const std::string& input,
@@ -40,6 +58,16 @@ std::vector<std::string> Tokenize(const std::string& input,
 
 std::string ChangeExtension(std::string path, const std::string &new_ext);
 
+std::vector<std::string> Glob(const std::string &pattern);
+
+bool GetFileStats(const std::string &path, long &size, long &mod_time);
+
+std::uint64_t HashString(const std::string &str);
+
+std::string HexString(std::uint64_t value);
+
+void WriteFileAtomically(const std::string &path, const std::string &contents);
+
 std::string MakeDir(std::string prefix);
 
 void parseMasses(const std::string &str, int &mglu, int &mlsp);
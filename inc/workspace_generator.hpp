@@ -5,9 +5,16 @@
 #include <set>
 #include <string>
 #include <utility>
-#include <random>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <unordered_map>
 
 #include "RooWorkspace.h"
+#include "RooAbsReal.h"
+#include "RooAbsPdf.h"
+#include "RooRealVar.h"
+#include "RooArgList.h"
 
 #include "cut.hpp"
 #include "block.hpp"
@@ -43,6 +50,12 @@ public:
   bool GetDoDilepton() const;
   WorkspaceGenerator & SetDoDilepton(bool do_systematics);
 
+  bool GetDoLumiScale() const;
+  WorkspaceGenerator & SetDoLumiScale(bool do_lumi_scale);
+
+  bool GetCacheSystematics() const;
+  WorkspaceGenerator & SetCacheSystematics(bool cache_systematics);
+
   PrintLevel GetPrintLevel() const;
   WorkspaceGenerator & SetPrintLevel(PrintLevel print_level);
 
@@ -52,9 +65,16 @@ public:
   double GetRMax() const;
   WorkspaceGenerator & SetRMax(double rmax);
 
+  double GetSignalXsecFactor() const;
+  WorkspaceGenerator & SetSignalXsecFactor(double sig_xsec_f);
+
   bool UseGausApprox() const;
   WorkspaceGenerator & UseGausApprox(bool use_gaus_approx);
 
+  const std::shared_ptr<YieldManager> & GetYieldManager() const;
+  WorkspaceGenerator & SetYieldManager(const std::shared_ptr<YieldManager> &yields);
+  void PrefetchYields() const;
+
   GammaParams GetYield(const YieldKey &key) const;
   GammaParams GetYield(const Bin &bin,
                        const Process &process,
@@ -63,6 +83,12 @@ public:
                        const Process &process) const;
 
   size_t AddToys(size_t num_toys = 0);
+  bool GetBatchToys() const;
+  WorkspaceGenerator & SetBatchToys(bool batch_toys);
+  std::uint64_t GetToySeed() const;
+  WorkspaceGenerator & SetToySeed(std::uint64_t toy_seed);
+  std::uint64_t GetToyStream() const;
+  WorkspaceGenerator & SetToyStream(std::uint64_t toy_stream);
 
   const Process & GetInjectionModel() const;
   WorkspaceGenerator & SetInjectionModel(const Process &injection);
@@ -77,50 +103,71 @@ private:
   Process signal_, data_;
   Process injection_;
   bool inject_other_signal_;
-  std::set<Block> blocks_;
-  std::map<std::string, double> obs_vals_;
-  std::map<std::string, std::poisson_distribution<> > obs_gens_;
+  std::set<Block> original_blocks_, blocks_;
   std::string systematics_file_;
   bool use_r4_;
   double sig_strength_, sig_xsec_f_;
   double rmax_;
   RooWorkspace w_;
+  std::vector<std::unique_ptr<RooAbsReal> > staged_;
+  std::unordered_map<std::string, RooAbsReal*> staged_index_;
   std::set<std::string>  poi_, observables_, glob_observables_, nuisances_, systematics_;
   std::set<FreeSystematic> free_systematics_;
+  bool cache_systematics_;
   double luminosity_;
   PrintLevel print_level_;
   bool do_systematics_;
   bool do_dilepton_;
+  bool do_lumi_scale_;
   bool do_mc_kappa_correction_;
   size_t num_toys_;
+  bool batch_toys_;
+  std::uint64_t toy_seed_, toy_stream_;
   bool gaus_approx_;
   mutable bool w_is_valid_;
-
-  static YieldManager yields_;
-  static std::mt19937_64 prng_;
-  static std::poisson_distribution<> dist_;
-
-  static std::mt19937_64 InitializePRNG();
-  static int GetPoisson(double rate);
-
-  void SetupToys(const RooArgSet &obs);
-  void GenerateToys(RooArgSet &obs);
-  void ResetToys(RooArgSet &obs);
+  bool poi_is_valid_, mc_weights_are_valid_, observables_are_valid_, abcd_is_valid_;
+  std::shared_ptr<YieldManager> yields_;
+
+  void SetupToys(const RooArgSet &obs,
+                 std::vector<RooRealVar*> &vars,
+                 std::vector<double> &means) const;
+  std::vector<int> GenerateToys(const std::vector<double> &means, std::size_t num_toys) const;
+  void ImportBatchedToys(const RooArgSet &obs,
+                         const std::vector<RooRealVar*> &vars,
+                         const std::vector<int> &counts,
+                         std::size_t num_toys);
+  void ResetToys(const std::vector<RooRealVar*> &vars,
+                 const std::vector<double> &means) const;
   void UpdateWorkspace();
+  void RefreshWorkspace();
+  void UpdatePOI();
+  void UpdateMCWeights();
+  void UpdateABCDParameters();
+  void UpdateObservables();
+  RooRealVar & WorkspaceVar(const std::string &name);
   void AddPOI();
+  void AddLumiScale();
   void ReadSystematicsFile();
+  std::vector<FreeSystematic> ParseSystematics(const std::string &contents,
+                                               const std::shared_ptr<const FreeSystematic::Index> &index,
+                                               const std::set<Process> &all_prc) const;
   static void CleanLine(std::string &line);
   void AddDileptonSystematic();
   bool NeedsDileptonBin(const Bin &bin) const;
   void MakeDileptonBin(const Bin &bin, Bin &dilep_bin, Cut &dilep_cut) const;
   void AddSystematicsGenerators();
   void AddSystematicGenerator(const std::string &name);
+  void AddSystematicFactor(const std::string &full_name,
+                           const std::string &name,
+                           double strength);
   void AddData(const Block &block);
+  GammaParams ObservedYield(const Bin &bin) const;
   void AddBackgroundFractions(const Block &block);
   void AddABCDParameters(const Block &block);
   void AddRawBackgroundPredictions(const Block &block);
   void AddKappas(const Block &block);
   void AddMCYields(const Block &block);
+  GammaParams MCYield(const Bin &bin, const Process &process) const;
   void AddMCPdfs(const Block &block);
   void AddMCProcessSums(const Block &block);
   void AddMCRowSums(const Block &block);
@@ -138,10 +185,22 @@ private:
   void DefineParameterSet(const std::string &cat_name,
                           const std::set<std::string> &var_names);
   void AddModels();
-  void AddPoisson(const std::string &pdf_name,
-		  const std::string &n_name,
-		  const std::string &mu_name,
-		  bool allow_approx);
+  RooAbsPdf & AddPoisson(const std::string &pdf_name,
+                         const std::string &n_name,
+                         const std::string &mu_name,
+                         bool allow_approx);
+
+  template<typename T> T & Stage(T *node);
+  RooAbsReal & Staged(const std::string &name) const;
+  RooRealVar & MakeVar(const std::string &name, double value);
+  RooRealVar & MakeVar(const std::string &name, double value, double low, double high);
+  RooAbsReal & MakeProduct(const std::string &name, const RooArgList &factors);
+  RooAbsReal & MakeSum(const std::string &name, const RooArgList &terms);
+  RooAbsReal & MakeFormula(const std::string &name, const std::string &formula,
+                           const RooArgList &args);
+  RooAbsPdf & MakeProdPdf(const std::string &name, const RooArgList &pdfs);
+  void ImportStaged();
+  void ClearStaged();
   void PrintComparison(std::ostream &stream, const Bin &bin,
                        const Process &process, const Block &block) const;
 };
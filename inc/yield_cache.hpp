@@ -0,0 +1,28 @@
+#ifndef H_YIELD_CACHE
+#define H_YIELD_CACHE
+
+#include <string>
+
+#include "yield_key.hpp"
+#include "gamma_params.hpp"
+
+class YieldCache{
+public:
+  explicit YieldCache(const std::string &directory = "");
+
+  const std::string & Directory() const;
+  YieldCache & Directory(const std::string &directory);
+
+  bool Enabled() const;
+
+  bool Load(const YieldKey &key, GammaParams &gps) const;
+  void Store(const YieldKey &key, const GammaParams &gps) const;
+
+private:
+  std::string directory_;
+
+  std::string Description(const YieldKey &key) const;
+  std::string Path(const std::string &description) const;
+};
+
+#endif
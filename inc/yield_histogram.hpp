@@ -0,0 +1,66 @@
+#ifndef H_YIELD_HISTOGRAM
+#define H_YIELD_HISTOGRAM
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cut.hpp"
+#include "process.hpp"
+#include "gamma_params.hpp"
+
+class YieldHistogram{
+public:
+  struct Axis{
+    std::string variable;
+    std::vector<double> edges;
+    bool is_integer;
+  };
+
+  explicit YieldHistogram(const std::string &path);
+
+  bool IsValid() const;
+  const std::string & Path() const;
+  const std::string & Description() const;
+  const std::vector<Axis> & Axes() const;
+  std::size_t NumCells() const;
+
+  bool GetYields(const Process &process,
+                 const std::vector<Cut> &cuts,
+                 std::vector<GammaParams> &gps) const;
+
+  static std::string Description(const Process &process, const Cut &baseline);
+  static std::string PathFor(const std::string &directory,
+                             const Process &process,
+                             const Cut &baseline);
+
+  static Axis MakeAxis(const std::string &spec);
+  static std::vector<Axis> DefaultAxes();
+
+  static void Build(const Process &process,
+                    const Cut &baseline,
+                    const std::vector<Axis> &axes,
+                    const std::string &directory);
+
+private:
+  struct Cells{
+    std::vector<std::uint16_t> bins;
+    std::vector<double> sumw, sumw2;
+  };
+
+  std::string path_;
+  std::string description_;
+  std::string baseline_;
+  std::vector<Axis> axes_;
+  std::vector<Cells> variants_;
+  bool is_valid_;
+
+  bool Load();
+
+  static std::size_t NumVariants(const Process &process);
+  static Cut Variant(const Cut &cut, std::size_t variant);
+  static Cut Selection(const Process &process, const Cut &baseline, std::size_t variant);
+  static Cut Weight(const Process &process, std::size_t variant);
+};
+
+#endif
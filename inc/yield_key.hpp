@@ -1,14 +1,29 @@
 #ifndef H_YIELD_KEY
 #define H_YIELD_KEY
 
-#include <tuple>
+#include <cstddef>
 #include <ostream>
 
 #include "bin.hpp"
 #include "process.hpp"
 #include "cut.hpp"
 
-using YieldKey = std::tuple<Bin, Process, Cut>;
+//Interned IDs of the bin, process and cut. Comparing and hashing keys never touches
+//the underlying objects, which are looked up with GetBin, GetProcess and GetCut.
+struct YieldKey{
+  YieldKey(const Bin &bin, const Process &process, const Cut &cut);
+
+  std::size_t bin_id;
+  std::size_t process_id;
+  std::size_t cut_id;
+
+  bool operator<(const YieldKey &key) const;
+  bool operator==(const YieldKey &key) const;
+};
+
+struct YieldKeyHash{
+  std::size_t operator()(const YieldKey &key) const;
+};
 
 const Bin & GetBin(const YieldKey &yk);
 const Process & GetProcess(const YieldKey &yk);
@@ -2,8 +2,18 @@
 #define H_YIELD_MANAGER
 
 #include <map>
+#include <unordered_map>
+#include <set>
+#include <vector>
+#include <string>
+#include <utility>
+#include <array>
+#include <mutex>
+#include <future>
+#include <memory>
 
 #include "yield_key.hpp"
+#include "yield_cache.hpp"
 #include "gamma_params.hpp"
 #include "bin.hpp"
 #include "process.hpp"
@@ -11,24 +21,120 @@
 
 class YieldManager{
 public:
+  typedef std::vector<std::pair<std::string, std::string> > Substitutions;
+
   explicit YieldManager(double lumi = 4.);
 
   GammaParams GetYield(const YieldKey &key) const;
+  GammaParams GetYield(const YieldKey &key, double lumi) const;
   GammaParams GetYield(const Bin &bin,
 		       const Process &process,
 		       const Cut &cut) const;
 
+  std::vector<std::vector<GammaParams> > GetYields(const std::vector<YieldKey> &keys,
+                                                   const std::vector<Cut> &weights) const;
+  std::vector<std::vector<GammaParams> > GetYields(const std::vector<YieldKey> &keys,
+                                                   const std::vector<Cut> &weights,
+                                                   double lumi) const;
+
+  std::map<std::vector<double>, std::vector<GammaParams> >
+  GetScanYields(const std::vector<YieldKey> &keys,
+                const std::vector<std::string> &point_branches) const;
+  std::map<std::vector<double>, std::vector<GammaParams> >
+  GetScanYields(const std::vector<YieldKey> &keys,
+                const std::vector<std::string> &point_branches,
+                double lumi) const;
+
+  std::vector<std::vector<double> > PrefetchScanYields(const std::vector<YieldKey> &keys,
+                                                       const std::vector<std::string> &point_branches) const;
+
+  void PrefetchYields(const std::vector<YieldKey> &keys) const;
+
   const double & Luminosity() const;
   double & Luminosity();
 
+  static const std::shared_ptr<YieldManager> & Shared();
+
+  static const std::string & CacheDirectory();
+  static void CacheDirectory(const std::string &directory);
+
+  static const std::string & SkimDirectory();
+  static void SkimDirectory(const std::string &directory);
+
+  static const std::string & HistogramDirectory();
+  static void HistogramDirectory(const std::string &directory);
+
+  static const std::vector<Substitutions> & SignalVariants();
+  static void SignalVariants(const std::vector<Substitutions> &variants);
+  static std::string SignalVariantsDescription(const Process &process);
+
+  static Process ScanPointProcess(const Process &scan,
+                                  const std::vector<std::string> &point_branches,
+                                  const std::vector<double> &point);
+
+  static const Cut & NominalWeight();
+  static Cut LumiWeight(const Process &process, const Cut &weight = NominalWeight());
+
 private:
-  static std::map<YieldKey, GammaParams> yields_;
+  typedef std::array<std::size_t, 4> Fallbacks;
+
+  struct Shard{
+    std::mutex mutex;
+    std::unordered_map<YieldKey, std::shared_future<GammaParams>, YieldKeyHash> yields;
+  };
+
+  static const std::size_t num_shards_ = 16;
+  mutable std::array<Shard, num_shards_> shards_;
+  static YieldCache cache_;
+  static std::string skim_directory_;
+  static std::string histogram_directory_;
+  static std::vector<Substitutions> signal_variants_;
   static const double store_lumi_;
   double local_lumi_;
   bool verbose_;
 
-  bool HaveYield(const YieldKey &key) const;
-  void ComputeYield(const YieldKey &key) const;
+  YieldManager(const YieldManager &) = delete;
+  YieldManager& operator=(const YieldManager &) = delete;
+
+  Shard & GetShard(const YieldKey &key) const;
+  std::shared_future<GammaParams> FindYield(const YieldKey &key) const;
+  std::vector<GammaParams> ComputeYields(const Process &process, const std::vector<YieldKey> &keys) const;
+  void BuildCuts(const Process &process,
+                 const std::vector<YieldKey> &keys,
+                 std::vector<Cut> &cuts,
+                 std::vector<std::size_t> &primary,
+                 std::vector<Fallbacks> &fallbacks,
+                 std::map<Cut, std::set<std::size_t> > &cuts_by_baseline) const;
+  GammaParams PickYield(const Process &process,
+                        const std::vector<Cut> &cuts,
+                        const std::vector<GammaParams> &all_gps,
+                        std::size_t primary,
+                        const Fallbacks &fallbacks) const;
+  bool FillFromHistograms(const Process &process,
+                          const std::map<Cut, std::set<std::size_t> > &cuts_by_baseline,
+                          const std::vector<Cut> &cuts,
+                          std::vector<GammaParams> &gps,
+                          std::vector<bool> &filled) const;
+  bool FillFromSkims(const Process &process,
+                     const std::map<Cut, std::set<std::size_t> > &cuts_by_baseline,
+                     const std::vector<Cut> &cuts,
+                     std::vector<GammaParams> &gps,
+                     std::vector<bool> &filled) const;
+  void FillFromChain(const Process &process,
+                     const std::vector<Cut> &cuts,
+                     const std::vector<std::size_t> &indices,
+                     std::vector<GammaParams> &gps,
+                     std::vector<bool> &filled) const;
+  bool ProjectYields(const Process &process,
+                     const std::vector<Cut> &cuts,
+                     std::vector<GammaParams> &gps,
+                     const class SkimFile *skim = nullptr,
+                     const class YieldHistogram *histogram = nullptr) const;
+  std::vector<GammaParams> AverageSignalVariants(const Process &process,
+                                                 const std::vector<Cut> &cuts,
+                                                 const std::vector<GammaParams> &all_gps) const;
+  static std::vector<Cut> SignalVariantCuts(const Process &process,
+                                            const std::vector<Cut> &cuts);
 };
 
 #endif
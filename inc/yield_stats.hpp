@@ -0,0 +1,72 @@
+#ifndef H_YIELD_STATS
+#define H_YIELD_STATS
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <ostream>
+
+class YieldStats{
+public:
+  enum class Counter{chain_passes, skim_passes, histogram_passes,
+      events_scanned, bytes_read,
+      yield_cache_hits, yield_cache_misses,
+      partial_sum_hits, partial_sum_misses,
+      num_counters};
+
+  class Stopwatch{
+  public:
+    Stopwatch();
+    double Seconds() const;
+  private:
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  static YieldStats & Get();
+
+  void Add(Counter counter, std::uint64_t amount = 1);
+  std::uint64_t Count(Counter counter) const;
+
+  void AddProcessTime(const std::string &process, double seconds, std::size_t num_keys);
+  void AddKeyTime(const std::string &bin, const std::string &process, const std::string &cut,
+                  const std::string &source, double seconds, bool amortized);
+
+  const std::string & ReportPath() const;
+  void ReportPath(const std::string &path);
+  void WriteReport(std::ostream &stream) const;
+
+  ~YieldStats();
+
+private:
+  struct ProcessTime{
+    double seconds;
+    std::size_t num_keys, num_batches;
+  };
+  struct KeyTime{
+    std::string bin, process;
+    std::size_t cut;
+    std::string source;
+    double seconds;
+    bool amortized;
+  };
+
+  static const std::size_t num_counters_ = static_cast<std::size_t>(Counter::num_counters);
+  std::array<std::atomic<std::uint64_t>, num_counters_> counters_;
+  mutable std::mutex mutex_;
+  std::map<std::string, ProcessTime> process_times_;
+  std::vector<KeyTime> key_times_;
+  std::vector<std::string> cuts_;
+  std::map<std::string, std::size_t> cut_indices_;
+  std::string report_path_;
+
+  YieldStats();
+  YieldStats(const YieldStats &) = delete;
+  YieldStats& operator=(const YieldStats &) = delete;
+};
+
+#endif
@@ -21,7 +21,7 @@ def ensureDir(path):
 def fullPath(path):
   return os.path.realpath(os.path.abspath(os.path.expanduser(path)))
 
-def SendSignalWorkspaces(input_dir, output_dir, num_jobs, injection_strength, injection_model):
+def SendSignalWorkspaces(input_dir, output_dir, num_jobs, injection_strength, injection_model, yield_cache):
   input_dir = fullPath(input_dir)
   output_dir = fullPath(output_dir)
 
@@ -54,16 +54,20 @@ def SendSignalWorkspaces(input_dir, output_dir, num_jobs, injection_strength, in
       run_file.write("eval `scramv1 runtime -sh`\n")
       run_file.write("cd $DIRECTORY\n\n")
 
-      for ifile in range(len(job_files)):
-        f = job_files[ifile]
-        cmd = "./run/wspace_sig.exe -f {} -o {} --sig_strength {} -u all -l 35.9 -p".format(
-          f, output_dir, (injection_strength if injection_strength >= 0. else 0.))
-        if injection_strength >= 0.:
-          cmd += " --unblind none"
-          if injection_model != "":
-            cmd += " --inject "+injection_model
-        run_file.write("echo Starting to process file {} of {}\n".format(ifile+1, len(job_files)))
-        run_file.write(cmd+"\n\n")
+      # All of the job's mass points run in one process so background and data yields are
+      # only computed once per job
+      cmd = "./run/wspace_sig.exe -o {} --sig_strength {} -u all -l 35.9 -p".format(
+        output_dir, (injection_strength if injection_strength >= 0. else 0.))
+      for f in job_files:
+        cmd += " -f "+f
+      if injection_strength >= 0.:
+        cmd += " --unblind none"
+        if injection_model != "":
+          cmd += " --inject "+injection_model
+      if yield_cache != "":
+        cmd += " --yield_cache "+fullPath(yield_cache)
+      run_file.write("echo Processing {} files\n".format(len(job_files)))
+      run_file.write(cmd+"\n\n")
 
     subprocess.check_call(["JobSubmit.csh",run_path])
     num_submitted += 1
@@ -79,11 +83,13 @@ if __name__ == "__main__":
   parser.add_argument("input_dir", nargs="?", default = "/net/cms29/cms29r0/babymaker/babies/2016_08_10/T1tttt/skim_abcd",
                       help="Directory containing input ntuples.")
   parser.add_argument("--num_jobs","-n", type=int, default=50,
-                      help="Maximum number of jobs into which to split the mass points")
+                      help="Maximum number of jobs into which to split the mass points. Use 1 to process the full plane in a single job.")
   parser.add_argument("--injection_strength", type=float, default=-1.,
                       help="Amount of signal to inject. Negative values turn off signal injection. Note that signal injection replaces the data with MC yields, even at injection strength of 0.")
   parser.add_argument("--injection_model", default="",
                       help="Path to signal ntuple to use for signal injection. If unspecified, uses the same signal model as used to construct the likelihood function")
+  parser.add_argument("--yield_cache", default="",
+                      help="Directory in which to store yields shared between jobs. Background and data yields are then only computed once. If unspecified, yields are not stored.")
   args = parser.parse_args()
 
-  SendSignalWorkspaces(args.input_dir, args.output_dir, args.num_jobs, args.injection_strength, args.injection_model)
+  SendSignalWorkspaces(args.input_dir, args.output_dir, args.num_jobs, args.injection_strength, args.injection_model, args.yield_cache)
@@ -5,6 +5,9 @@
 #include <limits>
 #include <sstream>
 #include <iomanip>
+#include <fstream>
+#include <iostream>
+#include <cmath>
 
 #include <unistd.h>
 #include <getopt.h>
@@ -17,6 +20,9 @@
 #include "cross_sections.hpp"
 
 #include "workspace_generator.hpp"
+#include "yield_manager.hpp"
+#include "yield_key.hpp"
+#include "yield_stats.hpp"
 
 using namespace std;
 
@@ -34,10 +40,22 @@ namespace{
   int mglu = 1800.;
   int mlsp = 100.;
   bool use_r4 = true;
+  string yield_cache = "";
+  string skim_cache = "";
+  string hist_cache = "";
+  string yield_stats = "";
+  string syst_weights = "";
+  string syst_out = "";
+  int num_threads = -1;
 }
 
 int main(int argc, char *argv[]){
   GetOptions(argc, argv);
+  YieldManager::CacheDirectory(yield_cache);
+  YieldManager::SkimDirectory(skim_cache);
+  YieldManager::HistogramDirectory(hist_cache);
+  YieldStats::Get().ReportPath(yield_stats);
+  if(num_threads >= 0) Process::NumThreads(num_threads);
 
   string hostname = execute("echo $HOSTNAME");
   string basefolder("/net/cms2/cms2r0/babymaker/");
@@ -122,6 +140,60 @@ int main(int argc, char *argv[]){
   string outname = oss.str();
   if(!use_r4) ReplaceAll(outname, "wspace_aggbin_", "wspace_aggbin_nor4_");
   wg.WriteToFile(outname);
+
+  if(syst_weights != ""){
+    if(syst_out == "") syst_out = ChangeExtension(outname, "_weight_systs.txt");
+    WriteWeightSystematics({r1, r2, r3, r4}, {ttbar, other, signal}, baseline);
+  }
+}
+
+void WriteWeightSystematics(const vector<Bin> &bins,
+                            const vector<Process> &processes,
+                            const Cut &baseline){
+  //Each line of syst_weights is "name up_weight down_weight". All variations are filled
+  //in one pass per process, and the relative shifts are written in the format of
+  //txt/systematics
+  ifstream file(syst_weights);
+  if(!file) ERROR("Could not open "+syst_weights);
+  vector<string> names;
+  vector<Cut> weights = {YieldManager::NominalWeight()};
+  string line;
+  while(getline(file, line)){
+    vector<string> words = Tokenize(line, " \t");
+    if(words.size() == 0 || words.at(0).at(0) == '#') continue;
+    if(words.size() != 3) ERROR("Bad weight variation line: "+line);
+    names.push_back(words.at(0));
+    weights.push_back(Cut(words.at(1)));
+    weights.push_back(Cut(words.at(2)));
+  }
+
+  vector<YieldKey> keys;
+  for(const auto &process: processes){
+    for(const auto &bin: bins){
+      keys.push_back(YieldKey(bin, process, baseline));
+    }
+  }
+  vector<vector<GammaParams> > gps = YieldManager::Shared()->GetYields(keys, weights, lumi);
+
+  ostringstream oss;
+  for(size_t isyst = 0; isyst < names.size(); ++isyst){
+    oss << "SYSTEMATIC " << names.at(isyst) << '\n';
+    for(size_t iprc = 0; iprc < processes.size(); ++iprc){
+      oss << " PROCESSES " << processes.at(iprc).Name() << '\n';
+      for(size_t ibin = 0; ibin < bins.size(); ++ibin){
+        size_t ikey = iprc*bins.size()+ibin;
+        double nominal = gps.at(0).at(ikey).Yield();
+        double up = gps.at(1+2*isyst).at(ikey).Yield();
+        double down = gps.at(2+2*isyst).at(ikey).Yield();
+        //Half the up-down spread, signed by the up variation
+        double shift = nominal > 0. ? 0.5*(up-down)/nominal : 0.;
+        oss << "  " << bins.at(ibin).Name() << ' ' << shift << '\n';
+      }
+    }
+    oss << '\n';
+  }
+  WriteFileAtomically(syst_out, oss.str());
+  cout << "Wrote weight systematics to " << syst_out << endl;
 }
 
 void GetOptions(int argc, char *argv[]){
@@ -140,6 +212,13 @@ void GetOptions(int argc, char *argv[]){
       {"nbm_low", required_argument, 0, 0},
       {"nbm_high", required_argument, 0, 0},
       {"no_r4", no_argument, 0, 0},
+      {"yield_cache", required_argument, 0, 0},
+      {"skim_cache", required_argument, 0, 0},
+      {"hist_cache", required_argument, 0, 0},
+      {"yield_stats", required_argument, 0, 0},
+      {"threads", required_argument, 0, 0},
+      {"syst_weights", required_argument, 0, 0},
+      {"syst_out", required_argument, 0, 0},
       {0, 0, 0, 0}
     };
 
@@ -178,6 +257,20 @@ void GetOptions(int argc, char *argv[]){
         mlsp = atoi(optarg);
       }else if(optname == "no_r4"){
 	use_r4 = false;
+      }else if(optname == "yield_cache"){
+        yield_cache = optarg;
+      }else if(optname == "skim_cache"){
+        skim_cache = optarg;
+      }else if(optname == "hist_cache"){
+        hist_cache = optarg;
+      }else if(optname == "yield_stats"){
+        yield_stats = optarg;
+      }else if(optname == "threads"){
+        num_threads = atoi(optarg);
+      }else if(optname == "syst_weights"){
+        syst_weights = optarg;
+      }else if(optname == "syst_out"){
+        syst_out = optarg;
       }else{
         printf("Bad option! Found option name %s\n", optname.c_str());
       }
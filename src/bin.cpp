@@ -4,6 +4,7 @@
 
 #include "systematic.hpp"
 #include "utilities.hpp"
+#include "interner.hpp"
 
 using namespace std;
 
@@ -12,7 +13,8 @@ Bin::Bin(const string &name, const class Cut &cut,
   cut_(cut),
   name_(name),
   systematics_(systematics),
-  is_blind_(is_blind){
+  is_blind_(is_blind),
+  id_(){
   ReplaceAll(name_, " ", "");
   }
 
@@ -21,6 +23,7 @@ const string & Bin::Name() const{
 }
 
 Bin & Bin::Name(const string &name){
+  id_ = 0;
   name_ = name;
   return *this;
 }
@@ -30,6 +33,7 @@ const class Cut & Bin::Cut() const{
 }
 
 class Cut & Bin::Cut(){
+  id_ = 0;
   return cut_;
 }
 
@@ -38,6 +42,7 @@ bool Bin::Blind() const{
 }
 
 bool & Bin::Blind(){
+  id_ = 0;
   return is_blind_;
 }
 
@@ -46,11 +51,13 @@ const Bin::SystCollection & Bin::Systematics() const{
 }
 
 Bin & Bin::Systematics(const SystCollection &systematics){
+  id_ = 0;
   systematics_ = systematics;
   return *this;
 }
 
 Bin & Bin::AddSystematic(const Systematic &systematic){
+  id_ = 0;
   if(!HasSystematic(systematic)){
     systematics_.insert(systematics_.end(), systematic);
   }
@@ -58,6 +65,7 @@ Bin & Bin::AddSystematic(const Systematic &systematic){
 }
 
 Bin & Bin::AddSystematics(const SystCollection &systematics){
+  id_ = 0;
   for(const auto& systematic: systematics){
     AddSystematic(systematic);
   }
@@ -69,6 +77,7 @@ bool Bin::HasSystematic(const Systematic &systematic) const{
 }
 
 Bin & Bin::RemoveSystematic(const Systematic &systematic){
+  id_ = 0;
   try{
     systematics_.erase(find(systematics_.begin(), systematics_.end(), systematic));
   }catch(const out_of_range &e){
@@ -78,11 +87,13 @@ Bin & Bin::RemoveSystematic(const Systematic &systematic){
 }
 
 Bin & Bin::RemoveSystematics(){
+  id_ = 0;
   systematics_.clear();
   return *this;
 }
 
 Bin & Bin::SetSystematicStrength(const std::string &name, double strength){
+  id_ = 0;
   bool found_it = false;
   for(auto systematic = systematics_.cbegin(); systematic != systematics_.cend(); ++systematic){
     if(systematic->Name() == name){
@@ -99,6 +110,16 @@ Bin & Bin::SetSystematicStrength(const std::string &name, double strength){
   return *this;
 }
 
+size_t Bin::Id() const{
+  //Interned on first use; every non-const member resets it
+  size_t id = id_;
+  if(id == 0){
+    id = Interner<Bin>::Id(*this);
+    id_.Set(id);
+  }
+  return id;
+}
+
 bool Bin::operator<(const Bin &b) const{
   return tie(cut_, systematics_, is_blind_) < tie(b.cut_, b.systematics_, b.is_blind_);
 }
@@ -9,7 +9,8 @@ using namespace std;
 BlockYields::BlockYields(const Block &block,
 			 const set<Process> &processes,
 			 const Cut &cut,
-			 const YieldManager &yields):
+			 const YieldManager &yields,
+			 double lumi):
   gps_(block.Bins().size(), 
        block.Bins().size()
        ? vector<GammaParams>(block.Bins().at(0).size())
@@ -22,7 +23,7 @@ BlockYields::BlockYields(const Block &block,
       gps = GammaParams(0., 0.);
       for(const auto &process: processes){
 	YieldKey key(bin, process, cut);
-	gps += yields.GetYield(key);
+	gps += yields.GetYield(key, lumi);
       }
       ++icol;
     }
@@ -0,0 +1,98 @@
+#include "column_reader.hpp"
+
+#include <algorithm>
+
+#include "TBranch.h"
+
+#include "utilities.hpp"
+
+using namespace std;
+
+namespace{
+  const Long64_t cache_size = 30000000;
+}
+
+ColumnReader::ColumnReader(TTree &tree,
+                           const vector<string> &branches,
+                           size_t chunk_size):
+  tree_(tree),
+  branches_(branches),
+  leaves_(branches.size(), nullptr),
+  columns_(branches.size(), vector<double>(max(chunk_size, static_cast<size_t>(1)), 0.)),
+  chunk_size_(max(chunk_size, static_cast<size_t>(1))),
+  size_(0),
+  num_entries_(tree.GetEntries()),
+  first_entry_(0),
+  next_entry_(0),
+  bytes_read_(0),
+  tree_number_(-1){
+  //Only the requested branches are prefetched and decompressed
+  tree_.SetCacheSize(cache_size);
+  for(const auto &branch: branches_){
+    tree_.AddBranchToCache(branch.c_str(), true);
+  }
+}
+
+bool ColumnReader::Next(){
+  size_ = 0;
+  if(next_entry_ >= num_entries_) return false;
+  Long64_t local_entry = tree_.LoadTree(next_entry_);
+  if(local_entry < 0) return false;
+  if(tree_.GetTreeNumber() != tree_number_){
+    tree_number_ = tree_.GetTreeNumber();
+    UpdateLeaves();
+  }
+
+  //Chunks never straddle two files of a chain
+  Long64_t left_in_tree = tree_.GetTree()->GetEntries() - local_entry;
+  Long64_t left_in_chain = num_entries_ - next_entry_;
+  size_ = static_cast<size_t>(min(static_cast<Long64_t>(chunk_size_),
+                                  min(left_in_tree, left_in_chain)));
+  if(size_ == 0) return false;
+
+  for(size_t ibranch = 0; ibranch < leaves_.size(); ++ibranch){
+    TLeaf &leaf = *leaves_.at(ibranch);
+    TBranch &branch = *leaf.GetBranch();
+    vector<double> &column = columns_.at(ibranch);
+    for(size_t i = 0; i < size_; ++i){
+      bytes_read_ += branch.GetEntry(local_entry+i);
+      column[i] = leaf.GetValue();
+    }
+  }
+
+  first_entry_ = next_entry_;
+  next_entry_ += size_;
+  return true;
+}
+
+size_t ColumnReader::Size() const{
+  return size_;
+}
+
+Long64_t ColumnReader::FirstEntry() const{
+  return first_entry_;
+}
+
+int ColumnReader::TreeNumber() const{
+  return tree_number_;
+}
+
+Long64_t ColumnReader::BytesRead() const{
+  //Uncompressed bytes of the requested branches
+  return bytes_read_;
+}
+
+const vector<string> & ColumnReader::Branches() const{
+  return branches_;
+}
+
+const vector<vector<double> > & ColumnReader::Columns() const{
+  return columns_;
+}
+
+void ColumnReader::UpdateLeaves(){
+  for(size_t ibranch = 0; ibranch < branches_.size(); ++ibranch){
+    leaves_.at(ibranch) = tree_.GetTree()->GetLeaf(branches_.at(ibranch).c_str());
+    if(leaves_.at(ibranch) == nullptr) ERROR("Could not find leaf "+branches_.at(ibranch));
+  }
+}
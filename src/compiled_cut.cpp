@@ -0,0 +1,559 @@
+#include "compiled_cut.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cctype>
+#include <stdexcept>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+
+#include "utilities.hpp"
+
+using namespace std;
+
+namespace{
+  using Node = CompiledCut::Node;
+  using Op = CompiledCut::Op;
+  using NodePtr = unique_ptr<Node>;
+
+  //Recursive descent parser for the TTreeFormula subset used in our cuts. Operator
+  //precedence follows C, except that '^' is a power as in TFormula.
+  class CutParser{
+  public:
+    explicit CutParser(const string &text):
+      text_(text),
+      pos_(0){
+    }
+
+    NodePtr Parse(){
+      NodePtr node = ParseBinary(0);
+      SkipSpace();
+      if(pos_ != text_.size()) Fail("unexpected \""+text_.substr(pos_)+"\"");
+      return node;
+    }
+
+  private:
+    struct BinaryOp{
+      const char *token;
+      Op op;
+      int precedence;
+    };
+
+    const string &text_;
+    size_t pos_;
+
+    static const vector<BinaryOp> & BinaryOps(){
+      //Longer tokens first so "<=" is not read as "<"
+      static const vector<BinaryOp> ops = {
+        {"||", Op::logical_or, 0},
+        {"&&", Op::logical_and, 1},
+        {"==", Op::equal, 5}, {"!=", Op::not_equal, 5},
+        {"<=", Op::less_equal, 6}, {">=", Op::greater_equal, 6},
+        {"<<", Op::shift_left, 7}, {">>", Op::shift_right, 7},
+        {"|", Op::bit_or, 2},
+        {"&", Op::bit_and, 4},
+        {"<", Op::less, 6}, {">", Op::greater, 6},
+        {"+", Op::add, 8}, {"-", Op::subtract, 8},
+        {"*", Op::multiply, 9}, {"/", Op::divide, 9}, {"%", Op::modulo, 9},
+        {"^", Op::power, 10}
+      };
+      return ops;
+    }
+
+    [[noreturn]] void Fail(const string &message) const{
+      throw runtime_error("Could not compile \""+text_+"\": "+message);
+    }
+
+    void SkipSpace(){
+      while(pos_ < text_.size() && isspace(static_cast<unsigned char>(text_.at(pos_)))) ++pos_;
+    }
+
+    bool Accept(const string &token){
+      SkipSpace();
+      if(text_.compare(pos_, token.size(), token) != 0) return false;
+      pos_ += token.size();
+      return true;
+    }
+
+    void Expect(const string &token){
+      if(!Accept(token)) Fail("expected \""+token+"\"");
+    }
+
+    static NodePtr MakeNode(Op op, double value = 0., const string &name = ""){
+      NodePtr node(new Node);
+      node->op = op;
+      node->value = value;
+      node->name = name;
+      return node;
+    }
+
+    bool PeekBinary(int min_precedence, const BinaryOp *&found){
+      SkipSpace();
+      for(const auto &op: BinaryOps()){
+        string token(op.token);
+        if(text_.compare(pos_, token.size(), token) != 0) continue;
+        //"&" and "|" must not be the start of "&&" and "||"
+        if(token.size() == 1 && pos_+1 < text_.size() && text_.at(pos_+1) == token.at(0)
+           && (token == "&" || token == "|")) continue;
+        if(op.precedence < min_precedence) return false;
+        found = &op;
+        return true;
+      }
+      return false;
+    }
+
+    NodePtr ParseBinary(int min_precedence){
+      NodePtr lhs = ParseUnary();
+      const BinaryOp *op = nullptr;
+      while(PeekBinary(min_precedence, op)){
+        pos_ += string(op->token).size();
+        //'^' is right associative, everything else left associative
+        NodePtr rhs = ParseBinary(op->op == Op::power ? op->precedence : op->precedence+1);
+        NodePtr node = MakeNode(op->op);
+        node->args.push_back(move(lhs));
+        node->args.push_back(move(rhs));
+        lhs = move(node);
+      }
+      return lhs;
+    }
+
+    NodePtr ParseUnary(){
+      if(Accept("!")){
+        NodePtr node = MakeNode(Op::logical_not);
+        node->args.push_back(ParseUnary());
+        return node;
+      }else if(Accept("-")){
+        NodePtr node = MakeNode(Op::negate);
+        node->args.push_back(ParseUnary());
+        return node;
+      }else if(Accept("+")){
+        return ParseUnary();
+      }
+      return ParsePrimary();
+    }
+
+    NodePtr ParsePrimary(){
+      SkipSpace();
+      if(pos_ >= text_.size()) Fail("unexpected end of expression");
+      char c = text_.at(pos_);
+      if(Accept("(")){
+        NodePtr node = ParseBinary(0);
+        Expect(")");
+        return node;
+      }else if(isdigit(static_cast<unsigned char>(c)) || c == '.'){
+        const char *begin = text_.c_str()+pos_;
+        char *end = nullptr;
+        double value = strtod(begin, &end);
+        if(end == begin) Fail("bad number");
+        pos_ += end-begin;
+        return MakeNode(Op::constant, value);
+      }else if(isalpha(static_cast<unsigned char>(c)) || c == '_'){
+        size_t begin = pos_;
+        while(pos_ < text_.size()
+              && (isalnum(static_cast<unsigned char>(text_.at(pos_))) || text_.at(pos_) == '_')){
+          ++pos_;
+        }
+        string name = text_.substr(begin, pos_-begin);
+        if(pos_ < text_.size()
+           && (text_.at(pos_) == '$' || text_.at(pos_) == '[' || text_.at(pos_) == '.'
+               || text_.at(pos_) == ':')){
+          Fail("unsupported construct after \""+name+"\"");
+        }
+        if(Accept("(")) return ParseFunction(name);
+        if(name == "true") return MakeNode(Op::constant, 1.);
+        if(name == "false") return MakeNode(Op::constant, 0.);
+        return MakeNode(Op::variable, 0., name);
+      }
+      Fail(string("unexpected character '")+c+"'");
+    }
+
+    NodePtr ParseFunction(const string &name){
+      Op op;
+      size_t num_args = 1;
+      if(name == "abs" || name == "fabs") op = Op::abs;
+      else if(name == "sqrt") op = Op::sqrt;
+      else if(name == "exp") op = Op::exp;
+      else if(name == "log") op = Op::log;
+      else if(name == "log10") op = Op::log10;
+      else if(name == "sin") op = Op::sin;
+      else if(name == "cos") op = Op::cos;
+      else if(name == "pow"){op = Op::power; num_args = 2;}
+      else if(name == "min"){op = Op::min; num_args = 2;}
+      else if(name == "max"){op = Op::max; num_args = 2;}
+      else Fail("unsupported function "+name);
+
+      NodePtr node = MakeNode(op);
+      for(size_t iarg = 0; iarg < num_args; ++iarg){
+        if(iarg > 0) Expect(",");
+        node->args.push_back(ParseBinary(0));
+      }
+      Expect(")");
+      return node;
+    }
+  };
+
+  inline double Truth(bool b){
+    return b ? 1. : 0.;
+  }
+
+  inline long Int(double x){
+    return static_cast<long>(x);
+  }
+
+  template<typename Func>
+  void ApplyUnary(vector<double> &x, size_t size, Func func){
+    for(size_t i = 0; i < size; ++i) x[i] = func(x[i]);
+  }
+
+  template<typename Func>
+  void ApplyBinary(vector<double> &a, const vector<double> &b, size_t size, Func func){
+    for(size_t i = 0; i < size; ++i) a[i] = func(a[i], b[i]);
+  }
+
+  void CollectTerms(const CompiledCut::Node &node, bool in_and,
+                    vector<const CompiledCut::Node*> &predicates,
+                    vector<const CompiledCut::Node*> &factors){
+    if(node.op == Op::logical_and){
+      CollectTerms(*node.args.at(0), true, predicates, factors);
+      CollectTerms(*node.args.at(1), true, predicates, factors);
+    }else if(node.op == Op::multiply && !in_and){
+      CollectTerms(*node.args.at(0), false, predicates, factors);
+      CollectTerms(*node.args.at(1), false, predicates, factors);
+    }else if(in_and || CompiledCut::IsBoolean(node)){
+      predicates.push_back(&node);
+    }else{
+      factors.push_back(&node);
+    }
+  }
+}
+
+CompiledCut::CompiledCut(const Cut &cut):
+  code_(),
+  variables_(),
+  error_(),
+  max_depth_(0),
+  is_valid_(false){
+  unique_ptr<Node> root = Parse(cut, error_);
+  if(root) Build(*root);
+}
+
+CompiledCut::CompiledCut(const Node &node):
+  code_(),
+  variables_(),
+  error_(),
+  max_depth_(0),
+  is_valid_(false){
+  Build(node);
+}
+
+unique_ptr<CompiledCut::Node> CompiledCut::Parse(const Cut &cut, string &error){
+  try{
+    string text = static_cast<string>(cut);
+    CutParser parser(text);
+    return parser.Parse();
+  }catch(const runtime_error &e){
+    error = e.what();
+    return unique_ptr<Node>();
+  }
+}
+
+bool CompiledCut::IsBoolean(const Node &node){
+  switch(node.op){
+  case Op::logical_not:
+  case Op::less:
+  case Op::less_equal:
+  case Op::greater:
+  case Op::greater_equal:
+  case Op::equal:
+  case Op::not_equal:
+  case Op::logical_and:
+  case Op::logical_or:
+    return true;
+  case Op::constant:
+  case Op::variable:
+  case Op::negate:
+  case Op::add:
+  case Op::subtract:
+  case Op::multiply:
+  case Op::divide:
+  case Op::modulo:
+  case Op::power:
+  case Op::bit_and:
+  case Op::bit_or:
+  case Op::shift_left:
+  case Op::shift_right:
+  case Op::abs:
+  case Op::sqrt:
+  case Op::exp:
+  case Op::log:
+  case Op::log10:
+  case Op::sin:
+  case Op::cos:
+  case Op::min:
+  case Op::max:
+  default:
+    return false;
+  }
+}
+
+string CompiledCut::Describe(const Node &node){
+  //Canonical text of a parsed expression, used to recognize identical subexpressions
+  ostringstream oss;
+  oss << setprecision(numeric_limits<double>::max_digits10)
+      << static_cast<int>(node.op);
+  if(node.op == Op::constant) oss << ':' << node.value;
+  if(node.op == Op::variable) oss << ':' << node.name;
+  if(node.args.size() > 0){
+    oss << '(';
+    for(size_t iarg = 0; iarg < node.args.size(); ++iarg){
+      if(iarg > 0) oss << ',';
+      oss << Describe(*node.args.at(iarg));
+    }
+    oss << ')';
+  }
+  oss << flush;
+  return oss.str();
+}
+
+void CompiledCut::Decompose(const Node &node,
+                            vector<const Node*> &predicates,
+                            vector<const Node*> &factors){
+  //Splits an expression into the predicates that must all hold (tested for being
+  //nonzero) and the numeric factors whose product is its value when they do
+  CollectTerms(node, false, predicates, factors);
+}
+
+bool CompiledCut::IsValid() const{
+  return is_valid_;
+}
+
+const string & CompiledCut::Error() const{
+  return error_;
+}
+
+const vector<string> & CompiledCut::Variables() const{
+  return variables_;
+}
+
+void CompiledCut::MapVariables(const vector<string> &variables){
+  //Rebinds the variable slots so Evaluate reads values in the order of the given list
+  vector<size_t> new_index(variables_.size());
+  for(size_t ivar = 0; ivar < variables_.size(); ++ivar){
+    auto found = find(variables.cbegin(), variables.cend(), variables_.at(ivar));
+    if(found == variables.cend()) ERROR("Variable "+variables_.at(ivar)+" missing from list");
+    new_index.at(ivar) = found - variables.cbegin();
+  }
+  for(auto &instruction: code_){
+    if(instruction.op == Op::variable){
+      instruction.index = new_index.at(instruction.index);
+    }
+  }
+  variables_ = variables;
+}
+
+double CompiledCut::Evaluate(const double *values) const{
+  double stack[max_stack_size_];
+  size_t top = 0;
+  for(const auto &ins: code_){
+    switch(ins.op){
+    case Op::constant: stack[top++] = ins.value; break;
+    case Op::variable: stack[top++] = values[ins.index]; break;
+    case Op::negate: stack[top-1] = -stack[top-1]; break;
+    case Op::logical_not: stack[top-1] = Truth(stack[top-1] == 0.); break;
+    case Op::abs: stack[top-1] = fabs(stack[top-1]); break;
+    case Op::sqrt: stack[top-1] = sqrt(stack[top-1]); break;
+    case Op::exp: stack[top-1] = exp(stack[top-1]); break;
+    case Op::log: stack[top-1] = log(stack[top-1]); break;
+    case Op::log10: stack[top-1] = log10(stack[top-1]); break;
+    case Op::sin: stack[top-1] = sin(stack[top-1]); break;
+    case Op::cos: stack[top-1] = cos(stack[top-1]); break;
+    case Op::add:
+    case Op::subtract:
+    case Op::multiply:
+    case Op::divide:
+    case Op::modulo:
+    case Op::power:
+    case Op::less:
+    case Op::less_equal:
+    case Op::greater:
+    case Op::greater_equal:
+    case Op::equal:
+    case Op::not_equal:
+    case Op::logical_and:
+    case Op::logical_or:
+    case Op::bit_and:
+    case Op::bit_or:
+    case Op::shift_left:
+    case Op::shift_right:
+    case Op::min:
+    case Op::max:{
+      --top;
+      double &a = stack[top-1];
+      const double b = stack[top];
+      switch(ins.op){
+      case Op::add: a += b; break;
+      case Op::subtract: a -= b; break;
+      case Op::multiply: a *= b; break;
+        //TFormula returns 0 rather than inf/nan on division by zero
+      case Op::divide: a = (b == 0.) ? 0. : a/b; break;
+      case Op::modulo: a = (Int(b) == 0) ? 0. : static_cast<double>(Int(a)%Int(b)); break;
+      case Op::power: a = pow(a, b); break;
+      case Op::less: a = Truth(a < b); break;
+      case Op::less_equal: a = Truth(a <= b); break;
+      case Op::greater: a = Truth(a > b); break;
+      case Op::greater_equal: a = Truth(a >= b); break;
+      case Op::equal: a = Truth(a == b); break;
+      case Op::not_equal: a = Truth(a != b); break;
+      case Op::logical_and: a = Truth(a != 0. && b != 0.); break;
+      case Op::logical_or: a = Truth(a != 0. || b != 0.); break;
+      case Op::bit_and: a = static_cast<double>(Int(a) & Int(b)); break;
+      case Op::bit_or: a = static_cast<double>(Int(a) | Int(b)); break;
+      case Op::shift_left: a = static_cast<double>(Int(a) << Int(b)); break;
+      case Op::shift_right: a = static_cast<double>(Int(a) >> Int(b)); break;
+      case Op::min: a = min(a, b); break;
+      case Op::max: a = max(a, b); break;
+      case Op::constant:
+      case Op::variable:
+      case Op::negate:
+      case Op::logical_not:
+      case Op::abs:
+      case Op::sqrt:
+      case Op::exp:
+      case Op::log:
+      case Op::log10:
+      case Op::sin:
+      case Op::cos:
+      default:
+        break;
+      }
+    }
+      break;
+    default:
+      break;
+    }
+  }
+  return top > 0 ? stack[top-1] : 0.;
+}
+
+void CompiledCut::Evaluate(const vector<vector<double> > &columns,
+                           size_t size,
+                           vector<double> &results) const{
+  //Same program as the scalar version, but each instruction runs over a whole
+  //chunk of entries stored column by column. The stack rows are kept per thread and
+  //only ever grow, so evaluating chunk after chunk does not allocate.
+  thread_local vector<vector<double> > stack;
+  if(stack.size() < max(max_depth_, static_cast<size_t>(1))) stack.resize(max(max_depth_, static_cast<size_t>(1)));
+  for(auto &row: stack){
+    if(row.size() < size) row.resize(size);
+  }
+  size_t top = 0;
+  for(const auto &ins: code_){
+    switch(ins.op){
+    case Op::constant: fill_n(stack[top++].begin(), size, ins.value); break;
+    case Op::variable: copy(columns[ins.index].cbegin(), columns[ins.index].cbegin()+size, stack[top++].begin()); break;
+    case Op::negate: ApplyUnary(stack[top-1], size, [](double x){return -x;}); break;
+    case Op::logical_not: ApplyUnary(stack[top-1], size, [](double x){return Truth(x == 0.);}); break;
+    case Op::abs: ApplyUnary(stack[top-1], size, [](double x){return fabs(x);}); break;
+    case Op::sqrt: ApplyUnary(stack[top-1], size, [](double x){return sqrt(x);}); break;
+    case Op::exp: ApplyUnary(stack[top-1], size, [](double x){return exp(x);}); break;
+    case Op::log: ApplyUnary(stack[top-1], size, [](double x){return log(x);}); break;
+    case Op::log10: ApplyUnary(stack[top-1], size, [](double x){return log10(x);}); break;
+    case Op::sin: ApplyUnary(stack[top-1], size, [](double x){return sin(x);}); break;
+    case Op::cos: ApplyUnary(stack[top-1], size, [](double x){return cos(x);}); break;
+    case Op::add:
+    case Op::subtract:
+    case Op::multiply:
+    case Op::divide:
+    case Op::modulo:
+    case Op::power:
+    case Op::less:
+    case Op::less_equal:
+    case Op::greater:
+    case Op::greater_equal:
+    case Op::equal:
+    case Op::not_equal:
+    case Op::logical_and:
+    case Op::logical_or:
+    case Op::bit_and:
+    case Op::bit_or:
+    case Op::shift_left:
+    case Op::shift_right:
+    case Op::min:
+    case Op::max:{
+      --top;
+      vector<double> &a = stack[top-1];
+      const vector<double> &b = stack[top];
+      switch(ins.op){
+      case Op::add: ApplyBinary(a, b, size, [](double x, double y){return x+y;}); break;
+      case Op::subtract: ApplyBinary(a, b, size, [](double x, double y){return x-y;}); break;
+      case Op::multiply: ApplyBinary(a, b, size, [](double x, double y){return x*y;}); break;
+      case Op::divide: ApplyBinary(a, b, size, [](double x, double y){return y == 0. ? 0. : x/y;}); break;
+      case Op::modulo: ApplyBinary(a, b, size, [](double x, double y){return Int(y) == 0 ? 0. : static_cast<double>(Int(x)%Int(y));}); break;
+      case Op::power: ApplyBinary(a, b, size, [](double x, double y){return pow(x, y);}); break;
+      case Op::less: ApplyBinary(a, b, size, [](double x, double y){return Truth(x < y);}); break;
+      case Op::less_equal: ApplyBinary(a, b, size, [](double x, double y){return Truth(x <= y);}); break;
+      case Op::greater: ApplyBinary(a, b, size, [](double x, double y){return Truth(x > y);}); break;
+      case Op::greater_equal: ApplyBinary(a, b, size, [](double x, double y){return Truth(x >= y);}); break;
+      case Op::equal: ApplyBinary(a, b, size, [](double x, double y){return Truth(x == y);}); break;
+      case Op::not_equal: ApplyBinary(a, b, size, [](double x, double y){return Truth(x != y);}); break;
+      case Op::logical_and: ApplyBinary(a, b, size, [](double x, double y){return Truth(x != 0. && y != 0.);}); break;
+      case Op::logical_or: ApplyBinary(a, b, size, [](double x, double y){return Truth(x != 0. || y != 0.);}); break;
+      case Op::bit_and: ApplyBinary(a, b, size, [](double x, double y){return static_cast<double>(Int(x) & Int(y));}); break;
+      case Op::bit_or: ApplyBinary(a, b, size, [](double x, double y){return static_cast<double>(Int(x) | Int(y));}); break;
+      case Op::shift_left: ApplyBinary(a, b, size, [](double x, double y){return static_cast<double>(Int(x) << Int(y));}); break;
+      case Op::shift_right: ApplyBinary(a, b, size, [](double x, double y){return static_cast<double>(Int(x) >> Int(y));}); break;
+      case Op::min: ApplyBinary(a, b, size, [](double x, double y){return min(x, y);}); break;
+      case Op::max: ApplyBinary(a, b, size, [](double x, double y){return max(x, y);}); break;
+      case Op::constant:
+      case Op::variable:
+      case Op::negate:
+      case Op::logical_not:
+      case Op::abs:
+      case Op::sqrt:
+      case Op::exp:
+      case Op::log:
+      case Op::log10:
+      case Op::sin:
+      case Op::cos:
+      default:
+        break;
+      }
+    }
+      break;
+    default:
+      break;
+    }
+  }
+  if(top > 0){
+    results.assign(stack[top-1].cbegin(), stack[top-1].cbegin()+size);
+  }else{
+    results.assign(size, 0.);
+  }
+}
+
+void CompiledCut::Build(const Node &node){
+  Compile(node, 0, max_depth_);
+  if(max_depth_ > max_stack_size_){
+    code_.clear();
+    variables_.clear();
+    error_ = "Expression too deeply nested";
+    return;
+  }
+  is_valid_ = true;
+}
+
+void CompiledCut::Compile(const Node &node, size_t depth, size_t &max_depth){
+  for(size_t iarg = 0; iarg < node.args.size(); ++iarg){
+    Compile(*node.args.at(iarg), depth+iarg, max_depth);
+  }
+  Instruction instruction{node.op, node.value, 0};
+  if(node.op == Op::variable){
+    auto found = find(variables_.cbegin(), variables_.cend(), node.name);
+    instruction.index = found - variables_.cbegin();
+    if(found == variables_.cend()) variables_.push_back(node.name);
+  }
+  code_.push_back(instruction);
+  max_depth = max(max_depth, depth+1);
+}
@@ -1,21 +1,27 @@
 #include "cut.hpp"
 
+#include <cctype>
+
 #include "utilities.hpp"
+#include "interner.hpp"
 
 using namespace std;
 
 Cut::Cut(const string &cut):
-  cut_(cut){
+  cut_(cut),
+  id_(){
   Clean();
 }
 
 Cut::Cut(const char *cut):
-  cut_(cut){
+  cut_(cut),
+  id_(){
   Clean();
 }
 
 Cut & Cut::Replace(const Cut &orig, const Cut &rep){
   ReplaceAll(cut_, orig.cut_, rep.cut_);
+  id_ = 0;
   return *this;
 }
 
@@ -30,6 +36,41 @@ void Cut::SetCut(string &cut){
 
 Cut & Cut::RmCutOn(const Cut &to_rm, const Cut &rep){
   ::RmCutOn(cut_, to_rm.cut_, rep.cut_);
+  id_ = 0;
+  return *this;
+}
+
+Cut & Cut::Substitute(const string &variable, const string &replacement){
+  //Only whole identifiers are replaced, so substituting met leaves met_calo alone
+  string result;
+  size_t pos = 0;
+  while(pos < cut_.size()){
+    char c = cut_.at(pos);
+    if(isalpha(static_cast<unsigned char>(c)) || c == '_'){
+      size_t end = pos;
+      while(end < cut_.size()
+            && (isalnum(static_cast<unsigned char>(cut_.at(end))) || cut_.at(end) == '_')){
+        ++end;
+      }
+      string identifier = cut_.substr(pos, end-pos);
+      result += identifier == variable ? replacement : identifier;
+      pos = end;
+    }else if(isdigit(static_cast<unsigned char>(c)) || c == '.'){
+      //Keep numbers like 1e3 from being read as identifiers
+      size_t end = pos;
+      while(end < cut_.size()
+            && (isalnum(static_cast<unsigned char>(cut_.at(end))) || cut_.at(end) == '.')){
+        ++end;
+      }
+      result += cut_.substr(pos, end-pos);
+      pos = end;
+    }else{
+      result += c;
+      ++pos;
+    }
+  }
+  cut_ = result;
+  Clean();
   return *this;
 }
 
@@ -109,7 +150,17 @@ bool Cut::operator==(const Cut &cut) const{
   return cut_ == cut.cut_;
 }
 
+size_t Cut::Id() const{
+  size_t id = id_;
+  if(id == 0){
+    id = Interner<Cut>::Id(*this);
+    id_.Set(id);
+  }
+  return id;
+}
+
 void Cut::Clean(){
+  id_ = 0;
   ReplaceAll(cut_, " ", "");
 }
 
@@ -0,0 +1,244 @@
+#include "cut_classifier.hpp"
+
+#include <map>
+#include <memory>
+#include <algorithm>
+
+#include "utilities.hpp"
+
+using namespace std;
+
+namespace{
+  using Node = CompiledCut::Node;
+
+  //Distinct predicate masks remembered before the memo starts over
+  const size_t max_memo_size = 1 << 16;
+}
+
+CutClassifier::CutClassifier(const vector<Cut> &cuts):
+  predicates_(),
+  factors_(),
+  weight_sets_(),
+  cut_masks_(),
+  cut_weight_sets_(),
+  variables_(),
+  error_(),
+  is_valid_(false),
+  memo_masks_(),
+  memo_passing_(),
+  memo_slots_(){
+  vector<unique_ptr<Node> > roots;
+  for(const auto &cut: cuts){
+    roots.push_back(CompiledCut::Parse(cut, error_));
+    if(!roots.back()) return;
+  }
+
+  //Identical predicates and factors are shared by all the cuts using them
+  map<string, size_t> predicate_ids, factor_ids;
+  map<vector<size_t>, size_t> weight_set_ids;
+  vector<vector<size_t> > cut_predicates;
+  for(const auto &root: roots){
+    vector<const Node*> predicates, factors;
+    CompiledCut::Decompose(*root, predicates, factors);
+
+    vector<size_t> these_predicates;
+    for(const auto &predicate: predicates){
+      string description = CompiledCut::Describe(*predicate);
+      if(predicate_ids.find(description) == predicate_ids.end()){
+        predicate_ids[description] = predicates_.size();
+        predicates_.emplace_back(*predicate);
+      }
+      these_predicates.push_back(predicate_ids.at(description));
+    }
+    cut_predicates.push_back(these_predicates);
+
+    vector<size_t> weight_set;
+    for(const auto &factor: factors){
+      string description = CompiledCut::Describe(*factor);
+      if(factor_ids.find(description) == factor_ids.end()){
+        factor_ids[description] = factors_.size();
+        factors_.emplace_back(*factor);
+      }
+      weight_set.push_back(factor_ids.at(description));
+    }
+    if(weight_set_ids.find(weight_set) == weight_set_ids.end()){
+      weight_set_ids[weight_set] = weight_sets_.size();
+      weight_sets_.push_back(weight_set);
+    }
+    cut_weight_sets_.push_back(weight_set_ids.at(weight_set));
+  }
+
+  for(const auto &these_predicates: cut_predicates){
+    vector<uint64_t> mask(NumWords(), 0);
+    for(const auto &ipred: these_predicates){
+      mask.at(ipred/64) |= UINT64_C(1) << (ipred%64);
+    }
+    cut_masks_.push_back(mask);
+  }
+
+  for(const auto &compiled: {&predicates_, &factors_}){
+    for(const auto &expression: *compiled){
+      if(!expression.IsValid()){
+        error_ = expression.Error();
+        return;
+      }
+      for(const auto &variable: expression.Variables()){
+        if(find(variables_.cbegin(), variables_.cend(), variable) == variables_.cend()){
+          variables_.push_back(variable);
+        }
+      }
+    }
+  }
+  is_valid_ = true;
+}
+
+bool CutClassifier::IsValid() const{
+  return is_valid_;
+}
+
+const string & CutClassifier::Error() const{
+  return error_;
+}
+
+const vector<string> & CutClassifier::Variables() const{
+  return variables_;
+}
+
+void CutClassifier::MapVariables(const vector<string> &variables){
+  for(auto &predicate: predicates_){
+    predicate.MapVariables(variables);
+  }
+  for(auto &factor: factors_){
+    factor.MapVariables(variables);
+  }
+  variables_ = variables;
+}
+
+size_t CutClassifier::NumCuts() const{
+  return cut_masks_.size();
+}
+
+size_t CutClassifier::NumPredicates() const{
+  return predicates_.size();
+}
+
+size_t CutClassifier::NumFactors() const{
+  return factors_.size();
+}
+
+void CutClassifier::Fill(const vector<vector<double> > &columns,
+                         size_t size,
+                         vector<double> &sumw,
+                         vector<double> &sumw2) const{
+  Fill(columns, size, vector<size_t>(size, 0), sumw, sumw2);
+}
+
+void CutClassifier::Fill(const vector<vector<double> > &columns,
+                         size_t size,
+                         const vector<size_t> &rows,
+                         vector<double> &sumw,
+                         vector<double> &sumw2) const{
+  //Entry i is added to row rows[i] of sumw and sumw2, each row holding one sum per cut.
+  //Each distinct predicate and factor is evaluated once per event. The predicates set
+  //bits in a per-event mask, and the cuts an event passes are looked up from its mask.
+  size_t num_words = NumWords();
+  vector<uint64_t> masks(size*num_words, 0);
+  vector<double> values;
+  for(size_t ipred = 0; ipred < predicates_.size(); ++ipred){
+    predicates_.at(ipred).Evaluate(columns, size, values);
+    uint64_t bit = UINT64_C(1) << (ipred%64);
+    size_t word = ipred/64;
+    for(size_t i = 0; i < size; ++i){
+      if(values[i] != 0.) masks[i*num_words+word] |= bit;
+    }
+  }
+
+  vector<vector<double> > factor_values(factors_.size());
+  for(size_t ifactor = 0; ifactor < factors_.size(); ++ifactor){
+    factors_.at(ifactor).Evaluate(columns, size, factor_values.at(ifactor));
+  }
+  vector<vector<double> > weights(weight_sets_.size(), vector<double>(size, 1.));
+  for(size_t iset = 0; iset < weight_sets_.size(); ++iset){
+    vector<double> &weight = weights.at(iset);
+    for(const auto &ifactor: weight_sets_.at(iset)){
+      const vector<double> &factor = factor_values.at(ifactor);
+      for(size_t i = 0; i < size; ++i){
+        weight[i] *= factor[i];
+      }
+    }
+  }
+
+  for(size_t i = 0; i < size; ++i){
+    size_t offset = rows[i]*cut_masks_.size();
+    for(const auto &icut: PassingCuts(&masks[i*num_words])){
+      double weight = weights[cut_weight_sets_[icut]][i];
+      if(weight == 0.) continue;
+      sumw[offset+icut] += weight;
+      sumw2[offset+icut] += weight*weight;
+    }
+  }
+}
+
+size_t CutClassifier::NumWords() const{
+  return max(static_cast<size_t>(1), (predicates_.size()+63)/64);
+}
+
+const vector<size_t> & CutClassifier::PassingCuts(const uint64_t *mask) const{
+  //Memoized in an open-addressing table keyed directly on the mask words, so the lookup
+  //done for every event does not allocate. The reference is valid until the next call.
+  size_t num_words = NumWords();
+  if(memo_slots_.size() == 0) ResizeMemo(1024);
+  size_t slot = FindSlot(mask);
+  if(memo_slots_[slot] != 0) return memo_passing_[memo_slots_[slot]-1];
+
+  if(memo_passing_.size() >= max_memo_size){
+    //Only reached with many distinct masks, where starting over is cheaper than growing
+    memo_masks_.clear();
+    memo_passing_.clear();
+    ResizeMemo(memo_slots_.size());
+    slot = FindSlot(mask);
+  }else if(2*(memo_passing_.size()+1) > memo_slots_.size()){
+    ResizeMemo(2*memo_slots_.size());
+    slot = FindSlot(mask);
+  }
+
+  memo_masks_.insert(memo_masks_.end(), mask, mask+num_words);
+  memo_passing_.push_back(vector<size_t>());
+  memo_slots_[slot] = memo_passing_.size();
+  vector<size_t> &passing = memo_passing_.back();
+  for(size_t icut = 0; icut < cut_masks_.size(); ++icut){
+    const vector<uint64_t> &cut_mask = cut_masks_.at(icut);
+    bool pass = true;
+    for(size_t word = 0; word < cut_mask.size() && pass; ++word){
+      pass = (mask[word] & cut_mask.at(word)) == cut_mask.at(word);
+    }
+    if(pass) passing.push_back(icut);
+  }
+  return passing;
+}
+
+size_t CutClassifier::FindSlot(const uint64_t *mask) const{
+  //Slot holding the mask, or the empty slot where it belongs. memo_slots_ has a power
+  //of two size and is never more than half full.
+  size_t num_words = NumWords();
+  uint64_t hash = UINT64_C(14695981039346656037);
+  for(size_t word = 0; word < num_words; ++word){
+    hash = (hash ^ mask[word])*UINT64_C(0x9E3779B97F4A7C15);
+    hash ^= hash >> 29;
+  }
+  size_t slot_mask = memo_slots_.size()-1;
+  for(size_t slot = hash & slot_mask; ; slot = (slot+1) & slot_mask){
+    size_t entry = memo_slots_[slot];
+    if(entry == 0 || equal(mask, mask+num_words, memo_masks_.cbegin()+(entry-1)*num_words)){
+      return slot;
+    }
+  }
+}
+
+void CutClassifier::ResizeMemo(size_t num_slots) const{
+  memo_slots_.assign(num_slots, 0);
+  size_t num_words = NumWords();
+  for(size_t entry = 0; entry < memo_passing_.size(); ++entry){
+    memo_slots_[FindSlot(&memo_masks_[entry*num_words])] = entry+1;
+  }
+}
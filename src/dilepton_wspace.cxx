@@ -38,6 +38,7 @@ namespace{
   string himet("400");
   string mjthresh("400");
   unsigned n_toys = 0;
+  string toy_seed = "";
   string identifier = "";
 }
 
@@ -233,6 +234,7 @@ int main(int argc, char *argv[]){
   wgc.SetLuminosity(lumi);
   wgc.SetDoDilepton(false); // Applying dilep syst in text file
   wgc.SetDoSystematics(do_syst);
+  if(toy_seed != "") wgc.SetToySeed(stoull(toy_seed));
   wgc.AddToys(n_toys);
   ReplaceAll(outname, "_nc_", "_c_");
   wgc.WriteToFile(outname);
@@ -245,6 +247,7 @@ int main(int argc, char *argv[]){
   wgnc.SetLuminosity(lumi);
   wgnc.SetDoDilepton(false); // Applying dilep syst in text file
   wgnc.SetDoSystematics(do_syst);
+  if(toy_seed != "") wgnc.SetToySeed(stoull(toy_seed));
   wgnc.AddToys(n_toys);
   ReplaceAll(outname, "_c_", "_nc_");
   wgnc.WriteToFile(outname);
@@ -267,6 +270,7 @@ void GetOptions(int argc, char *argv[]){
       {"method", required_argument, 0, 't'},
       {"use_r4", no_argument, 0, '4'},
       {"toys", required_argument, 0, 0},
+      {"seed", required_argument, 0, 0},
       {"sig_strength", required_argument, 0, 'g'},
       {"identifier", required_argument, 0, 'i'},
       {0, 0, 0, 0}
@@ -326,6 +330,8 @@ void GetOptions(int argc, char *argv[]){
         do_syst = true;
       }else if(optname == "toys"){
         n_toys = atoi(optarg);
+      }else if(optname == "seed"){
+        toy_seed = optarg;
       }else{
         printf("Bad option! Found option name %s\n", optname.c_str());
       }
@@ -1,10 +1,90 @@
 #include "free_systematic.hpp"
 
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <tuple>
+
+#include "utilities.hpp"
+
 using namespace std;
 
-FreeSystematic::FreeSystematic(const string &name):
+namespace{
+  //Cache file: magic, description, then in native binary the number of systematics and
+  //for each its name and dense table of strengths. Bump the version when the parsing changes.
+  const string magic = "ra4syst1";
+  const string cache_version = "systematics_v1";
+
+  void WriteBinary(ostream &stream, uint64_t value){
+    stream.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  bool ReadBinary(istream &stream, uint64_t &value){
+    return static_cast<bool>(stream.read(reinterpret_cast<char*>(&value), sizeof(value)));
+  }
+}
+
+FreeSystematic::Index::Index(const vector<string> &bin_names,
+                             const vector<string> &process_names):
+  bin_names_(),
+  process_names_(),
+  bins_(),
+  processes_(){
+  //Bins with the same name in several blocks share a row, and processes with the same name
+  //a column, since the file names bins and processes only
+  for(const auto &name: bin_names){
+    if(bins_.find(name) != bins_.end()) continue;
+    bins_[name] = bin_names_.size();
+    bin_names_.push_back(name);
+  }
+  for(const auto &name: process_names){
+    if(processes_.find(name) != processes_.end()) continue;
+    processes_[name] = process_names_.size();
+    process_names_.push_back(name);
+  }
+}
+
+size_t FreeSystematic::Index::NumBins() const{
+  return bin_names_.size();
+}
+
+size_t FreeSystematic::Index::NumProcesses() const{
+  return process_names_.size();
+}
+
+bool FreeSystematic::Index::FindBin(const string &name, size_t &ibin) const{
+  auto found = bins_.find(name);
+  if(found == bins_.end()) return false;
+  ibin = found->second;
+  return true;
+}
+
+bool FreeSystematic::Index::FindProcess(const string &name, size_t &iprc) const{
+  auto found = processes_.find(name);
+  if(found == processes_.end()) return false;
+  iprc = found->second;
+  return true;
+}
+
+string FreeSystematic::Index::Description() const{
+  ostringstream oss;
+  oss << "bins=";
+  for(const auto &name: bin_names_){
+    oss << name << ';';
+  }
+  oss << "\nprocesses=";
+  for(const auto &name: process_names_){
+    oss << name << ';';
+  }
+  oss << '\n' << flush;
+  return oss.str();
+}
+
+FreeSystematic::FreeSystematic(const string &name, const shared_ptr<const Index> &index):
   name_(name),
-  strengths_(){
+  index_(index),
+  strengths_(index == nullptr ? 0 : index->NumBins()*index->NumProcesses(), 0.){
+  if(index_ == nullptr) ERROR("No bin and process index for systematic "+name);
 }
 
 const string & FreeSystematic::Name() const{
@@ -16,23 +96,25 @@ string & FreeSystematic::Name(){
 }
 
 bool FreeSystematic::HasEntry(const Bin &bin, const Process &process) const{
-  pair<Bin, Process> bp(bin, process);
-  return strengths_.find(bp) != strengths_.end()
-    && strengths_.at(bp) != 0.;
+  size_t icell;
+  return FindCell(bin, process, icell) && strengths_.at(icell) != 0.;
 }
 
 double FreeSystematic::Strength(const Bin &bin, const Process &process) const{
-  if(HasEntry(bin, process)){
-    pair<Bin, Process> bp(bin, process);
-    return strengths_.at(bp);
-  }else{
-    return 0.;
-  }
+  size_t icell;
+  return FindCell(bin, process, icell) ? strengths_.at(icell) : 0.;
 }
 
 double & FreeSystematic::Strength(const Bin &bin, const Process &process){
-  pair<Bin, Process> bp(bin, process);
-  return strengths_[bp];
+  size_t icell;
+  if(!FindCell(bin, process, icell)){
+    ERROR("Systematic "+name_+" has no entry for bin "+bin.Name()+", process "+process.Name());
+  }
+  return strengths_.at(icell);
+}
+
+double & FreeSystematic::Strength(size_t ibin, size_t iprc){
+  return strengths_.at(ibin*index_->NumProcesses()+iprc);
 }
 
 bool FreeSystematic::operator<(const FreeSystematic &syst) const{
@@ -43,6 +125,70 @@ bool FreeSystematic::operator==(const FreeSystematic &syst) const{
   return tie(name_, strengths_) == tie(syst.name_, syst.strengths_);
 }
 
+bool FreeSystematic::ReadCache(const string &path,
+                               const string &contents,
+                               const shared_ptr<const Index> &index,
+                               vector<FreeSystematic> &systs){
+  //Only used if it was made from the same file contents with the same bins and processes
+  ifstream file(path, ios::binary);
+  if(!file.is_open()) return false;
+  string line;
+  if(!getline(file, line) || line != magic) return false;
+  size_t description_size;
+  if(!(file >> description_size) || !getline(file, line)) return false;
+  string description(description_size, '\0');
+  if(!file.read(&description[0], description_size)
+     || description != CacheDescription(contents, *index)) return false;
+
+  uint64_t num_systs;
+  if(!ReadBinary(file, num_systs)) return false;
+  vector<FreeSystematic> cached;
+  for(uint64_t isyst = 0; isyst < num_systs; ++isyst){
+    uint64_t name_size;
+    if(!ReadBinary(file, name_size)) return false;
+    string name(name_size, '\0');
+    if(!file.read(&name[0], name_size)) return false;
+    cached.emplace_back(name, index);
+    vector<double> &strengths = cached.back().strengths_;
+    if(!file.read(reinterpret_cast<char*>(strengths.data()), strengths.size()*sizeof(double))) return false;
+  }
+  systs.swap(cached);
+  return true;
+}
+
+void FreeSystematic::WriteCache(const string &path,
+                                const string &contents,
+                                const Index &index,
+                                const vector<FreeSystematic> &systs){
+  string description = CacheDescription(contents, index);
+  ostringstream oss;
+  oss << magic << '\n'
+      << description.size() << '\n' << description;
+  WriteBinary(oss, systs.size());
+  for(const auto &syst: systs){
+    WriteBinary(oss, syst.name_.size());
+    oss.write(syst.name_.data(), syst.name_.size());
+    oss.write(reinterpret_cast<const char*>(syst.strengths_.data()), syst.strengths_.size()*sizeof(double));
+  }
+  oss << flush;
+  WriteFileAtomically(path, oss.str());
+}
+
+bool FreeSystematic::FindCell(const Bin &bin, const Process &process, size_t &icell) const{
+  size_t ibin, iprc;
+  if(!index_->FindBin(bin.Name(), ibin) || !index_->FindProcess(process.Name(), iprc)) return false;
+  icell = ibin*index_->NumProcesses()+iprc;
+  return true;
+}
+
+string FreeSystematic::CacheDescription(const string &contents, const Index &index){
+  ostringstream oss;
+  oss << cache_version << '\n'
+      << "file=" << HexString(HashString(contents)) << ' ' << contents.size() << '\n'
+      << index.Description() << flush;
+  return oss.str();
+}
+
 ostream & operator<<(ostream &stream, const FreeSystematic &syst){
   stream << "FreeSystematic::" << syst.Name();
   return stream;
@@ -0,0 +1,109 @@
+#include "hist_cache.hpp"
+
+#include <cstdlib>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+
+#include <sys/stat.h>
+#include <getopt.h>
+
+#include "cut.hpp"
+#include "process.hpp"
+#include "yield_histogram.hpp"
+#include "utilities.hpp"
+
+using namespace std;
+
+namespace{
+  string name = "process";
+  set<string> files;
+  string process_cut = "1";
+  string baseline = "1";
+  vector<string> axis_specs;
+  string hist_cache = "";
+  bool is_data = false;
+}
+
+int main(int argc, char *argv[]){
+  GetOptions(argc, argv);
+  if(files.size() == 0 || hist_cache == ""){
+    cout << "Usage: hist_cache.exe -f <files> [-f <more files>] -o <histogram directory>"
+         << " [-n name] [-c process cut] [-b baseline] [-a variable:low:high:step[:int]]... [-d]" << endl;
+    return 1;
+  }
+  mkdir(hist_cache.c_str(), 0775);
+
+  //Files and process cut must match the Process defined in the workspace maker for the
+  //histogram to be found. A name containing "sig" also fills the met_tru variant.
+  vector<YieldHistogram::Axis> axes;
+  for(const auto &spec: axis_specs){
+    axes.push_back(YieldHistogram::MakeAxis(spec));
+  }
+  if(axes.size() == 0) axes = YieldHistogram::DefaultAxes();
+  Process process(name, files, Cut(process_cut), is_data);
+  Cut hist_baseline(baseline);
+  YieldHistogram::Build(process, hist_baseline, axes, hist_cache);
+
+  YieldHistogram histogram(YieldHistogram::PathFor(hist_cache, process, hist_baseline));
+  if(!histogram.IsValid()) ERROR("Could not read back "+histogram.Path());
+  cout << "Wrote " << histogram.NumCells() << " occupied cells over " << histogram.Axes().size()
+       << " axes to " << histogram.Path() << endl;
+}
+
+void GetOptions(int argc, char *argv[]){
+  while(true){
+    static struct option long_options[] = {
+      {"name", required_argument, 0, 'n'},
+      {"file", required_argument, 0, 'f'},
+      {"cut", required_argument, 0, 'c'},
+      {"baseline", required_argument, 0, 'b'},
+      {"axis", required_argument, 0, 'a'},
+      {"hist_cache", required_argument, 0, 'o'},
+      {"data", no_argument, 0, 'd'},
+      {0, 0, 0, 0}
+    };
+
+    char opt = -1;
+    int option_index;
+    opt = getopt_long(argc, argv, "n:f:c:b:a:o:d", long_options, &option_index);
+    if( opt == -1) break;
+
+    string optname;
+    switch(opt){
+    case 'n':
+      name = optarg;
+      break;
+    case 'f':
+      files.insert(optarg);
+      break;
+    case 'c':
+      process_cut = optarg;
+      break;
+    case 'b':
+      baseline = optarg;
+      break;
+    case 'a':
+      axis_specs.push_back(optarg);
+      break;
+    case 'o':
+      hist_cache = optarg;
+      break;
+    case 'd':
+      is_data = true;
+      break;
+    case 0:
+      optname = long_options[option_index].name;
+      if(false){
+      }else{
+        printf("Bad option! Found option name %s\n", optname.c_str());
+      }
+      break;
+    default:
+      printf("Bad option! getopt_long returned character code 0%o\n", opt);
+      break;
+    }
+  }
+}
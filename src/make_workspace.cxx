@@ -37,7 +37,11 @@ namespace{
   string himet("400");
   string mjthresh("400");
   unsigned n_toys = 0;
+  string toy_seed = "";
+  string toy_stream = "";
+  bool batch_toys = false;
   string identifier = "";
+  bool lumi_scale = false;
 }
 
 int main(int argc, char *argv[]){
@@ -287,6 +291,11 @@ int main(int argc, char *argv[]){
   wgc.SetDoSystematics(do_syst);
   wgc.SetLuminosity(lumi);
   wgc.SetDoDilepton(false); // Applying dilep syst in text file
+  wgc.SetDoLumiScale(lumi_scale);
+  wgc.SetBatchToys(batch_toys);
+  if(toy_seed != "") wgc.SetToySeed(stoull(toy_seed));
+  //Each run gets a pair of streams, one per signal variant, so toys from runs sharing a seed stay independent
+  if(toy_stream != "") wgc.SetToyStream(2*stoull(toy_stream));
   wgc.SetDoSystematics(do_syst);
   wgc.AddToys(n_toys);
   ReplaceAll(outname, "_nc_", "_c_");
@@ -299,6 +308,10 @@ int main(int argc, char *argv[]){
   wgnc.SetDoSystematics(do_syst);
   wgnc.SetLuminosity(lumi);
   wgnc.SetDoDilepton(false); // Applying dilep syst in text file
+  wgnc.SetDoLumiScale(lumi_scale);
+  wgnc.SetBatchToys(batch_toys);
+  if(toy_seed != "") wgnc.SetToySeed(stoull(toy_seed));
+  if(toy_stream != "") wgnc.SetToyStream(2*stoull(toy_stream)+1);
   wgnc.SetDoSystematics(do_syst);
   wgnc.AddToys(n_toys);
   ReplaceAll(outname, "_c_", "_nc_");
@@ -319,8 +332,12 @@ void GetOptions(int argc, char *argv[]){
       {"method", required_argument, 0, 't'},
       {"use_r4", no_argument, 0, '4'},
       {"toys", required_argument, 0, 0},
+      {"seed", required_argument, 0, 0},
+      {"stream", required_argument, 0, 0},
+      {"batch_toys", no_argument, 0, 0},
       {"sig_strength", required_argument, 0, 'g'},
       {"identifier", required_argument, 0, 'i'},
+      {"lumi_scale", no_argument, 0, 0},
       {0, 0, 0, 0}
     };
 
@@ -378,6 +395,14 @@ void GetOptions(int argc, char *argv[]){
         do_syst = false;
       }else if(optname == "toys"){
         n_toys = atoi(optarg);
+      }else if(optname == "seed"){
+        toy_seed = optarg;
+      }else if(optname == "stream"){
+        toy_stream = optarg;
+      }else if(optname == "batch_toys"){
+        batch_toys = true;
+      }else if(optname == "lumi_scale"){
+        lumi_scale = true;
       }else{
         printf("Bad option! Found option name %s\n", optname.c_str());
       }
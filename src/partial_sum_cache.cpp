@@ -0,0 +1,268 @@
+#include "partial_sum_cache.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <cerrno>
+
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "utilities.hpp"
+
+using namespace std;
+
+namespace{
+  //Bump whenever the way sums are filled changes, to invalidate old entries
+  const string cache_version = "partial_sums_v2";
+  const string entries_version = "entries_v1";
+
+  string FileVersion(const string &file){
+    //Path, size and modification time of the ROOT file behind a "file.root/tree" name
+    auto pos = file.rfind(".root");
+    long size, mod_time;
+    GetFileStats(pos == string::npos ? file : file.substr(0, pos+5), size, mod_time);
+    ostringstream oss;
+    oss << file << ' ' << size << ' ' << mod_time << flush;
+    return oss.str();
+  }
+
+  //Oldest cuts are dropped from a record beyond this many
+  const size_t max_cuts = 1 << 12;
+
+  class FileLock{
+  public:
+    //Exclusive lock on path.lock, held against other threads and other processes
+    //sharing the cache directory
+    explicit FileLock(const string &path):
+      fd_(open((path+".lock").c_str(), O_RDWR | O_CREAT, 0664)){
+      if(fd_ < 0) ERROR("Could not open lock file for "+path);
+      while(flock(fd_, LOCK_EX) != 0){
+        if(errno == EINTR) continue;
+        close(fd_);
+        ERROR("Could not lock "+path);
+      }
+    }
+
+    ~FileLock(){
+      flock(fd_, LOCK_UN);
+      close(fd_);
+    }
+
+  private:
+    int fd_;
+
+    FileLock(const FileLock &) = delete;
+    FileLock & operator=(const FileLock &) = delete;
+  };
+}
+
+PartialSumCache::PartialSumCache(const string &directory):
+  directory_(){
+  Directory(directory);
+}
+
+const string & PartialSumCache::Directory() const{
+  return directory_;
+}
+
+PartialSumCache & PartialSumCache::Directory(const string &directory){
+  directory_ = directory;
+  if(directory_ != "" && mkdir(directory_.c_str(), 0775) != 0 && errno != EEXIST){
+    ERROR("Could not create partial sum cache directory "+directory_);
+  }
+  return *this;
+}
+
+bool PartialSumCache::Enabled() const{
+  return directory_ != "";
+}
+
+vector<size_t> PartialSumCache::Load(const string &file,
+                                     const vector<string> &point_branches,
+                                     const vector<Cut> &cuts,
+                                     vector<vector<double> > &points,
+                                     vector<vector<double> > &sumw,
+                                     vector<vector<double> > &sumw2) const{
+  //Fills the sums already stored for this exact file (same path, size and modification
+  //time) and returns the indices of the cuts that still have to be read from it
+  Record record;
+  if(!Enabled() || !Read(Path(file, point_branches), Description(file, point_branches), record)){
+    record = Record();
+  }
+  map<string, size_t> stored;
+  for(size_t icut = 0; icut < record.cuts.size(); ++icut){
+    stored[record.cuts.at(icut)] = icut;
+  }
+
+  points = record.points;
+  sumw.assign(points.size(), vector<double>(cuts.size(), 0.));
+  sumw2.assign(points.size(), vector<double>(cuts.size(), 0.));
+  vector<size_t> missing;
+  for(size_t icut = 0; icut < cuts.size(); ++icut){
+    auto found = Enabled() ? stored.find(static_cast<string>(cuts.at(icut))) : stored.end();
+    if(found == stored.end()){
+      missing.push_back(icut);
+      continue;
+    }
+    for(size_t ipoint = 0; ipoint < points.size(); ++ipoint){
+      sumw.at(ipoint).at(icut) = record.sumw.at(found->second).at(ipoint);
+      sumw2.at(ipoint).at(icut) = record.sumw2.at(found->second).at(ipoint);
+    }
+  }
+  return missing;
+}
+
+void PartialSumCache::Store(const string &file,
+                            const vector<string> &point_branches,
+                            const vector<Cut> &cuts,
+                            const vector<vector<double> > &points,
+                            const vector<vector<double> > &sumw,
+                            const vector<vector<double> > &sumw2) const{
+  //Merged into whatever is already stored for the file, under a lock so concurrent jobs
+  //do not drop each other's cuts. There is one record per path, so a new version of
+  //the file replaces the sums of the old one.
+  if(!Enabled()) return;
+  string path = Path(file, point_branches);
+  string description = Description(file, point_branches);
+  FileLock lock(path);
+  Record record;
+  if(!Read(path, description, record) || record.points != points){
+    record = Record();
+    record.points = points;
+  }
+  map<string, size_t> stored;
+  for(size_t icut = 0; icut < record.cuts.size(); ++icut){
+    stored[record.cuts.at(icut)] = icut;
+  }
+  for(size_t icut = 0; icut < cuts.size(); ++icut){
+    string cut = static_cast<string>(cuts.at(icut));
+    if(stored.find(cut) != stored.end()) continue;
+    stored[cut] = record.cuts.size();
+    record.cuts.push_back(cut);
+    record.sumw.push_back(vector<double>(points.size()));
+    record.sumw2.push_back(vector<double>(points.size()));
+    for(size_t ipoint = 0; ipoint < points.size(); ++ipoint){
+      record.sumw.back().at(ipoint) = sumw.at(ipoint).at(icut);
+      record.sumw2.back().at(ipoint) = sumw2.at(ipoint).at(icut);
+    }
+  }
+
+  if(record.cuts.size() > max_cuts){
+    size_t num_dropped = record.cuts.size()-max_cuts;
+    record.cuts.erase(record.cuts.begin(), record.cuts.begin()+num_dropped);
+    record.sumw.erase(record.sumw.begin(), record.sumw.begin()+num_dropped);
+    record.sumw2.erase(record.sumw2.begin(), record.sumw2.begin()+num_dropped);
+  }
+
+  ostringstream oss;
+  oss << setprecision(numeric_limits<double>::max_digits10)
+      << description.size() << '\n' << description
+      << record.points.size() << ' ' << point_branches.size() << '\n';
+  for(const auto &point: record.points){
+    for(const auto &value: point){
+      oss << value << ' ';
+    }
+    oss << '\n';
+  }
+  oss << record.cuts.size() << '\n';
+  for(size_t icut = 0; icut < record.cuts.size(); ++icut){
+    oss << record.cuts.at(icut);
+    for(size_t ipoint = 0; ipoint < record.points.size(); ++ipoint){
+      oss << ' ' << record.sumw.at(icut).at(ipoint) << ' ' << record.sumw2.at(icut).at(ipoint);
+    }
+    oss << '\n';
+  }
+  oss << flush;
+  WriteFileAtomically(path, oss.str());
+}
+
+bool PartialSumCache::LoadEntries(const string &file, long &entries) const{
+  if(!Enabled()) return false;
+  ifstream stream(EntriesPath(file));
+  if(!stream.is_open()) return false;
+  string description = EntriesDescription(file);
+  size_t description_size;
+  string line;
+  if(!(stream >> description_size) || !getline(stream, line)) return false;
+  string stored(description_size, '\0');
+  if(!stream.read(&stored[0], description_size) || stored != description) return false;
+  return static_cast<bool>(stream >> entries);
+}
+
+void PartialSumCache::StoreEntries(const string &file, long entries) const{
+  //One record per path, so a new version of the file replaces the count of the old one
+  if(!Enabled()) return;
+  string description = EntriesDescription(file);
+  ostringstream oss;
+  oss << description.size() << '\n' << description << entries << '\n' << flush;
+  WriteFileAtomically(EntriesPath(file), oss.str());
+}
+
+bool PartialSumCache::Read(const string &path, const string &description, Record &record) const{
+  ifstream file(path);
+  if(!file.is_open()) return false;
+  //Guard against hash collisions by checking the full description
+  size_t description_size;
+  string line;
+  if(!(file >> description_size) || !getline(file, line)) return false;
+  string stored(description_size, '\0');
+  if(!file.read(&stored[0], description_size) || stored != description) return false;
+
+  size_t num_points, num_branches, num_cuts;
+  if(!(file >> num_points >> num_branches)) return false;
+  record.points.assign(num_points, vector<double>(num_branches));
+  for(auto &point: record.points){
+    for(auto &value: point){
+      if(!(file >> value)) return false;
+    }
+  }
+  if(!(file >> num_cuts)) return false;
+  record.cuts.assign(num_cuts, "");
+  record.sumw.assign(num_cuts, vector<double>(num_points));
+  record.sumw2.assign(num_cuts, vector<double>(num_points));
+  for(size_t icut = 0; icut < num_cuts; ++icut){
+    if(!(file >> record.cuts.at(icut))) return false;
+    for(size_t ipoint = 0; ipoint < num_points; ++ipoint){
+      if(!(file >> record.sumw.at(icut).at(ipoint) >> record.sumw2.at(icut).at(ipoint))) return false;
+    }
+  }
+  return true;
+}
+
+string PartialSumCache::Description(const string &file,
+                                    const vector<string> &point_branches) const{
+  ostringstream oss;
+  oss << cache_version << '\n'
+      << "file=" << FileVersion(file) << '\n'
+      << "points=";
+  for(const auto &branch: point_branches){
+    oss << branch << ';';
+  }
+  oss << '\n' << flush;
+  return oss.str();
+}
+
+string PartialSumCache::Path(const string &file,
+                             const vector<string> &point_branches) const{
+  string location = file+"\npoints=";
+  for(const auto &branch: point_branches){
+    location += branch+';';
+  }
+  return directory_+"/partial_"+HexString(HashString(location))+".txt";
+}
+
+string PartialSumCache::EntriesDescription(const string &file) const{
+  ostringstream oss;
+  oss << entries_version << '\n'
+      << "file=" << FileVersion(file) << '\n' << flush;
+  return oss.str();
+}
+
+string PartialSumCache::EntriesPath(const string &file) const{
+  return directory_+"/entries_"+HexString(HashString(file))+".txt";
+}
@@ -0,0 +1,53 @@
+#include "philox.hpp"
+
+#include <random>
+
+using namespace std;
+
+namespace{
+  const uint32_t mult_0 = 0xD2511F53u, mult_1 = 0xCD9E8D57u;
+  const uint32_t weyl_0 = 0x9E3779B9u, weyl_1 = 0xBB67AE85u;
+  const size_t num_rounds = 10;
+
+  void MultiplyHiLo(uint32_t a, uint32_t b, uint32_t &hi, uint32_t &lo){
+    uint64_t product = static_cast<uint64_t>(a)*b;
+    hi = static_cast<uint32_t>(product >> 32);
+    lo = static_cast<uint32_t>(product);
+  }
+}
+
+Philox::Philox(uint64_t seed, uint64_t stream, uint32_t substream):
+  key_{{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)}},
+  counter_{{0u, substream, static_cast<uint32_t>(stream), static_cast<uint32_t>(stream >> 32)}},
+  block_(),
+  index_(4){
+  //Philox4x32-10 (Salmon et al., SC11). The seed is the key, and the counter holds the
+  //stream, the substream and a block count, so every (seed, stream, substream) is an
+  //independent sequence that can be regenerated on its own
+}
+
+Philox::result_type Philox::operator()(){
+  if(index_ >= block_.size()) NextBlock();
+  return block_.at(index_++);
+}
+
+uint64_t Philox::RandomSeed(){
+  random_device rd;
+  return (static_cast<uint64_t>(rd()) << 32) ^ rd();
+}
+
+void Philox::NextBlock(){
+  array<uint32_t, 4> x = counter_;
+  array<uint32_t, 2> key = key_;
+  for(size_t iround = 0; iround < num_rounds; ++iround){
+    uint32_t hi_0, lo_0, hi_1, lo_1;
+    MultiplyHiLo(mult_0, x.at(0), hi_0, lo_0);
+    MultiplyHiLo(mult_1, x.at(2), hi_1, lo_1);
+    x = {{hi_1^x.at(1)^key.at(0), lo_1, hi_0^x.at(3)^key.at(1), lo_0}};
+    key.at(0) += weyl_0;
+    key.at(1) += weyl_1;
+  }
+  block_ = x;
+  index_ = 0;
+  ++counter_.at(0);
+}
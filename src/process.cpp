@@ -2,15 +2,60 @@
 
 #include <string>
 #include <set>
+#include <vector>
+#include <array>
+#include <map>
+#include <sstream>
 #include <initializer_list>
 #include <algorithm>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <cmath>
 
 #include "TChain.h"
+#include "TROOT.h"
 
 #include "utilities.hpp"
+#include "interner.hpp"
+#include "thread_pool.hpp"
+#include "partial_sum_cache.hpp"
+#include "yield_stats.hpp"
 
 using namespace std;
 
+namespace{
+  long EntriesInFile(const string &file, const PartialSumCache &cache){
+    //Counts are remembered by path, size and modification time, in memory and on disk
+    //next to the partial sums, so each version of a file is opened once to count them
+    static mutex counts_mutex;
+    static map<string, long> counts;
+    auto pos = file.rfind(".root");
+    long size, mod_time;
+    GetFileStats(pos == string::npos ? file : file.substr(0, pos+5), size, mod_time);
+    ostringstream oss;
+    oss << file << ' ' << size << ' ' << mod_time << flush;
+    string key = oss.str();
+    {
+      lock_guard<mutex> lock(counts_mutex);
+      auto found = counts.find(key);
+      if(found != counts.end()) return found->second;
+    }
+    long entries;
+    if(!cache.LoadEntries(file, entries)){
+      TChain chain("tree", "tree");
+      chain.Add(file.c_str());
+      entries = chain.GetEntries();
+      cache.StoreEntries(file, entries);
+    }
+    lock_guard<mutex> lock(counts_mutex);
+    counts[key] = entries;
+    return entries;
+  }
+}
+
+size_t Process::num_threads_ = thread::hardware_concurrency();
+
 Process::Process(const string &name,
                  const set<string> &file_names,
                  const class Cut &cut,
@@ -19,15 +64,15 @@ Process::Process(const string &name,
                  bool count_zeros,
                  const SystCollection &systematics):
   file_names_(file_names),
-  chain_(make_shared<TChain>("tree", "tree")),
+  file_state_(make_shared<FileState>()),
   cut_(cut),
   name_(name),
   is_data_(is_data),
   is_signal_(is_signal),
   count_zeros_(count_zeros),
-  systematics_(systematics){
+  systematics_(systematics),
+  id_(){
   CleanName();
-  AddFiles();
   }
 
 Process::Process(const string &name,
@@ -38,15 +83,15 @@ Process::Process(const string &name,
                  bool count_zeros,
                  const SystCollection &systematics):
   file_names_(file_names),
-  chain_(make_shared<TChain>("tree", "tree")),
+  file_state_(make_shared<FileState>()),
   cut_(cut),
   name_(name),
   is_data_(is_data),
   is_signal_(is_signal),
   count_zeros_(count_zeros),
-  systematics_(systematics){
+  systematics_(systematics),
+  id_(){
   CleanName();
-  AddFiles();
   }
 
 const string & Process::Name() const{
@@ -54,6 +99,7 @@ const string & Process::Name() const{
 }
 
 Process & Process::Name(const string &name){
+  id_ = 0;
   name_ = name;
   CleanName();
   return *this;
@@ -64,6 +110,7 @@ const class Cut & Process::Cut() const{
 }
 
 class Cut & Process::Cut(){
+  id_ = 0;
   return cut_;
 }
 
@@ -71,23 +118,250 @@ const set<string> & Process::FileNames() const{
   return file_names_;
 }
 
+vector<string> Process::Files() const{
+  //Expands wildcards in the file names, keeping any in-file tree path (e.g. "/tree") after ".root".
+  //Only done the first time the files are needed.
+  lock_guard<mutex> lock(file_state_->mutex);
+  if(file_state_->expanded) return file_state_->files;
+  vector<string> &files = file_state_->files;
+  for(const auto &file_name: file_names_){
+    auto pos = file_name.rfind(".root");
+    string pattern = pos == string::npos ? file_name : file_name.substr(0, pos+5);
+    string suffix = pos == string::npos ? "" : file_name.substr(pos+5);
+    vector<string> paths = Glob(pattern);
+    if(paths.size() == 0 && pattern.find_first_of("*?[") == string::npos){
+      paths.push_back(pattern);
+    }
+    for(const auto &path: paths){
+      files.push_back(path+suffix);
+    }
+  }
+  file_state_->expanded = true;
+  return files;
+}
+
+string Process::FileSetHash() const{
+  //Content hash of the file set: any added, removed, resized or touched file changes it.
+  //Computed once per run for each set of file names.
+  static mutex hashes_mutex;
+  static map<set<string>, string> hashes;
+  lock_guard<mutex> lock(hashes_mutex);
+  auto known = hashes.find(file_names_);
+  if(known != hashes.end()) return known->second;
+  ostringstream oss;
+  for(const auto &file: Files()){
+    auto pos = file.rfind(".root");
+    string path = pos == string::npos ? file : file.substr(0, pos+5);
+    long size, mod_time;
+    GetFileStats(path, size, mod_time);
+    oss << file << ' ' << size << ' ' << mod_time << ';';
+  }
+  oss << flush;
+  string hash = HexString(HashString(oss.str()));
+  hashes[file_names_] = hash;
+  return hash;
+}
+
 long Process::GetEntries() const{
-  return chain_->GetEntries();
+  {
+    lock_guard<mutex> lock(file_state_->mutex);
+    if(file_state_->entries >= 0) return file_state_->entries;
+  }
+  long entries = 0;
+  for(const auto &file: Files()){
+    entries += EntriesInFile(file, PartialSums());
+  }
+  lock_guard<mutex> lock(file_state_->mutex);
+  file_state_->entries = entries;
+  return entries;
 }
 
 GammaParams Process::GetYield(const class Cut &cut) const{
   double count, uncertainty;
-  ::GetCountAndUncertainty(*chain_, cut*cut_, count, uncertainty);
+  lock_guard<mutex> lock(ChainMutex());
+  ::GetCountAndUncertainty(Chain(), cut*cut_, count, uncertainty);
   GammaParams gps;
   gps.SetYieldAndUncertainty(count, uncertainty);
   return gps;
 }
 
+vector<GammaParams> Process::GetYields(const vector<class Cut> &cuts) const{
+  vector<vector<double> > points, sumw, sumw2;
+  SumWeights(cuts, vector<string>(), points, sumw, sumw2);
+
+  vector<GammaParams> gps(cuts.size());
+  if(points.size() == 0) return gps;
+  for(size_t icut = 0; icut < cuts.size(); ++icut){
+    gps.at(icut).SetYieldAndUncertainty(sumw.front().at(icut), sqrt(sumw2.front().at(icut)));
+  }
+  return gps;
+}
+
+map<vector<double>, vector<GammaParams> > Process::GetYieldsByPoint(const vector<class Cut> &cuts,
+                                                                    const vector<string> &point_branches) const{
+  //One pass over the files fills every cut separately for each set of values of
+  //point_branches, e.g. for each mass point of a combined signal scan
+  vector<vector<double> > points, sumw, sumw2;
+  SumWeights(cuts, point_branches, points, sumw, sumw2);
+
+  map<vector<double>, vector<GammaParams> > gps;
+  for(size_t ipoint = 0; ipoint < points.size(); ++ipoint){
+    vector<GammaParams> &point_gps = gps[points.at(ipoint)];
+    point_gps.resize(cuts.size());
+    for(size_t icut = 0; icut < cuts.size(); ++icut){
+      point_gps.at(icut).SetYieldAndUncertainty(sumw.at(ipoint).at(icut),
+                                                sqrt(sumw2.at(ipoint).at(icut)));
+    }
+  }
+  return gps;
+}
+
+vector<vector<GammaParams> > Process::GetYields(const vector<class Cut> &cuts,
+                                                const vector<class Cut> &weights) const{
+  //Every weight expression is applied to every cut, and all of them are filled in the
+  //same pass over the files. Results are indexed by weight, then by cut.
+  vector<class Cut> all_cuts;
+  for(const auto &weight: weights){
+    for(const auto &cut: cuts){
+      all_cuts.push_back(weight*cut);
+    }
+  }
+  vector<GammaParams> all_gps = GetYields(all_cuts);
+
+  vector<vector<GammaParams> > gps(weights.size());
+  for(size_t iweight = 0; iweight < weights.size(); ++iweight){
+    gps.at(iweight).assign(all_gps.cbegin()+iweight*cuts.size(),
+                           all_gps.cbegin()+(iweight+1)*cuts.size());
+  }
+  return gps;
+}
+
+void Process::SumWeights(const vector<class Cut> &cuts,
+                         const vector<string> &point_branches,
+                         vector<vector<double> > &points,
+                         vector<vector<double> > &sumw,
+                         vector<vector<double> > &sumw2) const{
+  vector<class Cut> full_cuts(cuts.size());
+  for(size_t icut = 0; icut < cuts.size(); ++icut){
+    full_cuts.at(icut) = cuts.at(icut)*cut_;
+  }
+
+  EnableThreadSafety();
+  vector<string> files = Files();
+  bool use_partial_sums = PartialSums().Enabled();
+  if(!use_partial_sums && (num_threads_ <= 1 || files.size() <= 1)){
+    //A chain of our own, so several threads can fill yields of the same process
+    TChain chain("tree", "tree");
+    for(const auto &file_name: file_names_){
+      chain.Add(file_name.c_str());
+    }
+    ::GetSumsOfWeights(chain, full_cuts, point_branches, points, sumw, sumw2);
+    return;
+  }
+
+  //Each file is read by its own chain, on the thread pool if there is more than one
+  //thread, and the partial sums are merged. Files whose sums are stored are not read.
+  vector<FileSums> partial_sums;
+  if(num_threads_ <= 1 || files.size() <= 1){
+    for(const auto &file: files){
+      partial_sums.push_back(SumFile(file, full_cuts, point_branches));
+    }
+  }else{
+    vector<future<FileSums> > futures;
+    for(const auto &file: files){
+      futures.push_back(FilePool().Push([&full_cuts, &point_branches, file](){
+            return SumFile(file, full_cuts, point_branches);
+          }));
+    }
+    for(auto &partial_sum: futures){
+      partial_sums.push_back(partial_sum.get());
+    }
+  }
+
+  points.clear();
+  sumw.clear();
+  sumw2.clear();
+  map<vector<double>, size_t> point_rows;
+  for(const auto &sums: partial_sums){
+    for(size_t ipoint = 0; ipoint < sums[0].size(); ++ipoint){
+      auto found = point_rows.find(sums[0].at(ipoint));
+      if(found == point_rows.end()){
+        point_rows[sums[0].at(ipoint)] = points.size();
+        points.push_back(sums[0].at(ipoint));
+        sumw.push_back(sums[1].at(ipoint));
+        sumw2.push_back(sums[2].at(ipoint));
+        continue;
+      }
+      for(size_t icut = 0; icut < cuts.size(); ++icut){
+        sumw.at(found->second).at(icut) += sums[1].at(ipoint).at(icut);
+        sumw2.at(found->second).at(icut) += sums[2].at(ipoint).at(icut);
+      }
+    }
+  }
+}
+
+Process::FileSums Process::SumFile(const string &file,
+                                   const vector<class Cut> &cuts,
+                                   const vector<string> &point_branches){
+  //Only the cuts not yet stored for this version of the file are read from it
+  FileSums sums;
+  vector<size_t> missing = PartialSums().Load(file, point_branches, cuts, sums[0], sums[1], sums[2]);
+  if(PartialSums().Enabled()){
+    YieldStats::Get().Add(missing.size() == 0
+                          ? YieldStats::Counter::partial_sum_hits
+                          : YieldStats::Counter::partial_sum_misses);
+  }
+  if(missing.size() == 0) return sums;
+
+  vector<class Cut> missing_cuts;
+  for(const auto &icut: missing){
+    missing_cuts.push_back(cuts.at(icut));
+  }
+  TChain chain("tree", "tree");
+  chain.Add(file.c_str());
+  FileSums read;
+  ::GetSumsOfWeights(chain, missing_cuts, point_branches, read[0], read[1], read[2]);
+
+  map<vector<double>, size_t> point_rows;
+  for(size_t ipoint = 0; ipoint < sums[0].size(); ++ipoint){
+    point_rows[sums[0].at(ipoint)] = ipoint;
+  }
+  for(size_t ipoint = 0; ipoint < read[0].size(); ++ipoint){
+    auto found = point_rows.find(read[0].at(ipoint));
+    if(found == point_rows.end()){
+      found = point_rows.emplace(read[0].at(ipoint), sums[0].size()).first;
+      sums[0].push_back(read[0].at(ipoint));
+      sums[1].push_back(vector<double>(cuts.size(), 0.));
+      sums[2].push_back(vector<double>(cuts.size(), 0.));
+    }
+    for(size_t i = 0; i < missing.size(); ++i){
+      sums[1].at(found->second).at(missing.at(i)) = read[1].at(ipoint).at(i);
+      sums[2].at(found->second).at(missing.at(i)) = read[2].at(ipoint).at(i);
+    }
+  }
+  PartialSums().Store(file, point_branches, cuts, sums[0], sums[1], sums[2]);
+  return sums;
+}
+
+const string & Process::PartialSumDirectory(){
+  return PartialSums().Directory();
+}
+
+void Process::PartialSumDirectory(const string &directory){
+  PartialSums().Directory(directory);
+}
+
+PartialSumCache & Process::PartialSums(){
+  static PartialSumCache partial_sums;
+  return partial_sums;
+}
+
 const bool & Process::IsData() const{
   return is_data_;
 }
 
 bool & Process::IsData(){
+  id_ = 0;
   return is_data_;
 }
 
@@ -96,6 +370,7 @@ const bool & Process::IsSignal() const{
 }
 
 bool & Process::IsSignal(){
+  id_ = 0;
   return is_signal_;
 }
 
@@ -104,6 +379,7 @@ const bool & Process::CountZeros() const{
 }
 
 bool & Process::CountZeros(){
+  id_ = 0;
   return count_zeros_;
 }
 
@@ -112,11 +388,13 @@ const Process::SystCollection & Process::Systematics() const{
 }
 
 Process & Process::Systematics(const SystCollection &systematics){
+  id_ = 0;
   systematics_ = systematics;
   return *this;
 }
 
 Process & Process::AddSystematic(const Systematic &systematic){
+  id_ = 0;
   if(!HasSystematic(systematic)){
     systematics_.insert(systematics_.end(), systematic);
   }
@@ -124,6 +402,7 @@ Process & Process::AddSystematic(const Systematic &systematic){
 }
 
 Process & Process::AddSystematics(const SystCollection &systematics){
+  id_ = 0;
   for(const auto& systematic: systematics){
     AddSystematic(systematic);
   }
@@ -135,6 +414,7 @@ bool Process::HasSystematic(const Systematic &systematic) const{
 }
 
 Process & Process::RemoveSystematic(const Systematic &systematic){
+  id_ = 0;
   try{
     systematics_.erase(find(systematics_.begin(), systematics_.end(), systematic));
   }catch(const out_of_range &e){
@@ -144,11 +424,13 @@ Process & Process::RemoveSystematic(const Systematic &systematic){
 }
 
 Process & Process::RemoveSystematics(){
+  id_ = 0;
   systematics_.clear();
   return *this;
 }
 
 Process & Process::SetSystematicStrength(const std::string &name, double strength){
+  id_ = 0;
   bool found_it = false;
   for(auto systematic = systematics_.cbegin(); systematic != systematics_.cend(); ++systematic){
     if(systematic->Name() == name){
@@ -175,14 +457,65 @@ bool Process::operator==(const Process &p) const{
     == tie(p.cut_, p.file_names_, p.count_zeros_, p.systematics_);
 }
 
+size_t Process::Id() const{
+  //Interned on first use; every non-const member resets it
+  size_t id = id_;
+  if(id == 0){
+    id = Interner<Process, IdentityLess>::Id(*this);
+    id_.Set(id);
+  }
+  return id;
+}
+
+bool Process::IdentityLess::operator()(const Process &a, const Process &b) const{
+  return tie(a.name_, a.is_data_, a.is_signal_, a.cut_, a.file_names_, a.count_zeros_, a.systematics_)
+    < tie(b.name_, b.is_data_, b.is_signal_, b.cut_, b.file_names_, b.count_zeros_, b.systematics_);
+}
+
+size_t Process::NumThreads(){
+  return num_threads_;
+}
+
+void Process::NumThreads(size_t num_threads){
+  //Takes effect for the file pool only if set before the first multi-file read
+  num_threads_ = num_threads;
+}
+
+void Process::EnableThreadSafety(){
+  //Must happen before a second thread touches ROOT. Called when a YieldManager is made
+  //and before any read, whichever thread it comes from.
+  static once_flag thread_safety_flag;
+  call_once(thread_safety_flag, [](){ROOT::EnableThreadSafety();});
+}
+
+mutex & Process::ChainMutex(){
+  //Guards reads through the chain shared by all copies of a process
+  static mutex chain_mutex;
+  return chain_mutex;
+}
+
+ThreadPool & Process::FilePool(){
+  //Shared by all processes, so reads started from several threads at once (e.g. the
+  //prefetches of a signal scan) use num_threads_ threads in total rather than each
+  //starting a pool of their own
+  static ThreadPool pool(max(num_threads_, static_cast<size_t>(1)));
+  return pool;
+}
+
 void Process::CleanName(){
   ReplaceAll(name_, " ", "");
 }
 
-void Process::AddFiles(){
-  for(const auto &file_name: file_names_){
-    chain_->Add(file_name.c_str());
+TChain & Process::Chain() const{
+  //Opened on the first read. Callers hold ChainMutex().
+  lock_guard<mutex> lock(file_state_->mutex);
+  if(!file_state_->chain){
+    file_state_->chain = make_shared<TChain>("tree", "tree");
+    for(const auto &file_name: file_names_){
+      file_state_->chain->Add(file_name.c_str());
+    }
   }
+  return *file_state_->chain;
 }
 
 ostream & operator<<(ostream &stream, const Process &proc){
@@ -146,17 +146,34 @@ int main(int argc, char *argv[]){
 }
 
 double GetSignificance(const string &file_name, double lumi){
-  ModifyLumi(file_name, lumi);
-  string results = execute("combine -M ProfileLikelihood --significance --expectSignal=1 -t -1 "+temp_name);
+  string results = execute("combine -M ProfileLikelihood --significance --expectSignal=1 -t -1 "+LumiArguments(file_name, lumi, true));
   return ExtractNumber(results, "Significance: ");
 }
 
 double GetLimit(const string &file_name, double lumi){
-  ModifyLumi(file_name, lumi);
-  string results = execute("combine -M Asymptotic -t -1 "+temp_name);
+  string results = execute("combine -M Asymptotic -t -1 "+LumiArguments(file_name, lumi, true));
   return ExtractNumber(results, "Median for expected limits: ");
 }
 
+string LumiArguments(const string &file_name, double lumi, bool asimov){
+  //Workspaces made with a lumi_scale parameter are projected by setting it in combine;
+  //older ones are copied and patched. The observed counts do not follow lumi_scale, so
+  //fits to them always go through the patched copy.
+  bool has_lumi_scale = false;
+  if(asimov){
+    TFile file(file_name.c_str(), "read");
+    RooWorkspace *w = static_cast<RooWorkspace*>(file.Get("w"));
+    has_lumi_scale = w != nullptr && w->var("lumi_scale") != nullptr;
+  }
+  if(!has_lumi_scale || lumi < 0.){
+    ModifyLumi(file_name, lumi);
+    return temp_name;
+  }
+  ostringstream oss;
+  oss << "--setPhysicsModelParameters lumi_scale=" << lumi/lumi_in_file << " " << file_name << flush;
+  return oss.str();
+}
+
 void ModifyLumi(const string &file_name, double lumi){
   execute("cp "+file_name+" "+temp_name);
   TFile file(temp_name.c_str(), "read");
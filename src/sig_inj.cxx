@@ -33,6 +33,7 @@
 #include "utilities.hpp"
 #include "styles.hpp"
 #include "thread_pool.hpp"
+#include "philox.hpp"
 
 using namespace std;
 
@@ -43,6 +44,7 @@ namespace{
   bool do_asymmetric_error = false;
   bool do_systematics = false;
   bool draw_only = false;
+  uint64_t toy_seed = Philox::RandomSeed();
 
   mutex global_mutex;
 }
@@ -60,6 +62,7 @@ int main(int argc, char *argv[]){
     << (do_systematics ? "_with_syst" : "")
     << flush;
   string id_string = oss.str();
+  if(!draw_only) cout << "Generating toys with seed " << toy_seed << endl;
 
   ThreadPool thread_pool;
   if(!draw_only){
@@ -128,7 +131,8 @@ void InjectSignal(const string id_string, double inject, size_t index){
   }
   ostringstream oss;
   oss << "./run/make_workspace.exe --method m1bk"
-      << (do_systematics ? "" : " --no_syst") << " --lumi " << lumi << " --use_r4 --toys " << ntoys
+      << (do_systematics ? "" : " --no_syst") << " --lumi " << lumi << " --use_r4 --toys " << ntoys << " --seed " << toy_seed
+      << " --stream " << index
       << " --sig_strength " << inject << " --identifier sig_inj_" << id_string << "_" << index
       << " < /dev/null &> /dev/null" << flush;
   {
@@ -386,12 +390,13 @@ void GetOptions(int argc, char *argv[]){
       {"asym", no_argument, 0, 'a'},
       {"syst", no_argument, 0, 's'},
       {"draw", no_argument, 0, 'd'},
+      {"seed", required_argument, 0, 'r'},
       {0, 0, 0, 0}
     };
 
     char opt = -1;
     int option_index;
-    opt = getopt_long(argc, argv, "t:i:l:asd", long_options, &option_index);
+    opt = getopt_long(argc, argv, "t:i:l:asdr:", long_options, &option_index);
     if( opt == -1) break;
 
     string optname;
@@ -414,6 +419,9 @@ void GetOptions(int argc, char *argv[]){
     case 'd':
       draw_only = true;
       break;
+    case 'r':
+      toy_seed = stoull(optarg);
+      break;
     default:
       printf("Bad option! getopt_long returned character code 0%o\n", opt);
       break;
@@ -0,0 +1,104 @@
+#include "skim_cache.hpp"
+
+#include <cstdlib>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+
+#include <sys/stat.h>
+#include <getopt.h>
+
+#include "cut.hpp"
+#include "process.hpp"
+#include "skim_file.hpp"
+#include "utilities.hpp"
+
+using namespace std;
+
+namespace{
+  string name = "process";
+  set<string> files;
+  string process_cut = "1";
+  string baseline = "1";
+  string branches = "mt,mj14,met,met_tru,met_calo,njets,nbm,nveto,nleps,st,weight,eff_trig,stitch,stitch_met,pass,pass_ra2_badmu,trig_ra4";
+  string skim_cache = "";
+  bool is_data = false;
+}
+
+int main(int argc, char *argv[]){
+  GetOptions(argc, argv);
+  if(files.size() == 0 || skim_cache == ""){
+    cout << "Usage: skim_cache.exe -f <files> [-f <more files>] -o <skim directory>"
+         << " [-n name] [-c process cut] [-b baseline] [-v branch1,branch2,...] [-d]" << endl;
+    return 1;
+  }
+  mkdir(skim_cache.c_str(), 0775);
+
+  //Files and process cut must match the Process defined in the workspace maker for the
+  //skim to be found. A name containing "sig" also keeps events passing the met_tru baseline.
+  Process process(name, files, Cut(process_cut), is_data);
+  Cut skim_baseline(baseline);
+  SkimFile::Build(process, skim_baseline, Tokenize(branches, ","), skim_cache);
+
+  SkimFile skim(SkimFile::PathFor(skim_cache, process, skim_baseline));
+  if(!skim.IsValid()) ERROR("Could not read back "+skim.Path());
+  cout << "Wrote " << skim.Size() << " events with " << skim.Branches().size()
+       << " branches to " << skim.Path() << endl;
+}
+
+void GetOptions(int argc, char *argv[]){
+  while(true){
+    static struct option long_options[] = {
+      {"name", required_argument, 0, 'n'},
+      {"file", required_argument, 0, 'f'},
+      {"cut", required_argument, 0, 'c'},
+      {"baseline", required_argument, 0, 'b'},
+      {"branches", required_argument, 0, 'v'},
+      {"skim_cache", required_argument, 0, 'o'},
+      {"data", no_argument, 0, 'd'},
+      {0, 0, 0, 0}
+    };
+
+    char opt = -1;
+    int option_index;
+    opt = getopt_long(argc, argv, "n:f:c:b:v:o:d", long_options, &option_index);
+    if( opt == -1) break;
+
+    string optname;
+    switch(opt){
+    case 'n':
+      name = optarg;
+      break;
+    case 'f':
+      files.insert(optarg);
+      break;
+    case 'c':
+      process_cut = optarg;
+      break;
+    case 'b':
+      baseline = optarg;
+      break;
+    case 'v':
+      branches = optarg;
+      break;
+    case 'o':
+      skim_cache = optarg;
+      break;
+    case 'd':
+      is_data = true;
+      break;
+    case 0:
+      optname = long_options[option_index].name;
+      if(false){
+      }else{
+        printf("Bad option! Found option name %s\n", optname.c_str());
+      }
+      break;
+    default:
+      printf("Bad option! getopt_long returned character code 0%o\n", opt);
+      break;
+    }
+  }
+}
@@ -0,0 +1,281 @@
+#include "skim_file.hpp"
+
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "TChain.h"
+#include "TLeaf.h"
+
+#include "compiled_cut.hpp"
+#include "cut_classifier.hpp"
+#include "column_reader.hpp"
+#include "yield_manager.hpp"
+#include "yield_stats.hpp"
+#include "utilities.hpp"
+
+using namespace std;
+
+namespace{
+  //File layout (native byte order, every field 8-byte aligned):
+  //  magic | header size | entries | branches | description size | description
+  //  | for each branch: name size, name | padding | one column of doubles per branch
+  const char magic[8] = {'r','a','4','s','k','i','m','1'};
+  const string skim_version = "skim_v1";
+  const size_t chunk_size = 4096;
+
+  size_t Padded(size_t size){
+    return (size+7)/8*8;
+  }
+
+  void AppendWord(string &out, uint64_t word){
+    out.append(reinterpret_cast<const char *>(&word), sizeof(word));
+  }
+
+  void AppendString(string &out, const string &str){
+    AppendWord(out, str.size());
+    out += str;
+    out.append(Padded(str.size())-str.size(), '\0');
+  }
+
+  bool ReadWord(const char *data, size_t length, size_t &pos, uint64_t &word){
+    if(pos+sizeof(word) > length) return false;
+    memcpy(&word, data+pos, sizeof(word));
+    pos += sizeof(word);
+    return true;
+  }
+
+  bool ReadString(const char *data, size_t length, size_t &pos, string &str){
+    uint64_t size;
+    if(!ReadWord(data, length, pos, size) || pos+Padded(size) > length) return false;
+    str.assign(data+pos, size);
+    pos += Padded(size);
+    return true;
+  }
+}
+
+SkimFile::SkimFile(const string &path):
+  path_(path),
+  description_(),
+  branches_(),
+  columns_(),
+  size_(0),
+  data_(nullptr),
+  length_(0){
+  if(!Map()){
+    branches_.clear();
+    columns_.clear();
+    size_ = 0;
+  }
+}
+
+SkimFile::~SkimFile(){
+  if(data_ != nullptr) munmap(data_, length_);
+}
+
+bool SkimFile::IsValid() const{
+  return data_ != nullptr;
+}
+
+const string & SkimFile::Path() const{
+  return path_;
+}
+
+const string & SkimFile::Description() const{
+  return description_;
+}
+
+const vector<string> & SkimFile::Branches() const{
+  return branches_;
+}
+
+size_t SkimFile::Size() const{
+  return size_;
+}
+
+const double * SkimFile::Column(const string &branch) const{
+  auto found = find(branches_.cbegin(), branches_.cend(), branch);
+  if(found == branches_.cend()) return nullptr;
+  return columns_.at(found-branches_.cbegin());
+}
+
+bool SkimFile::GetYields(const Process &process,
+                         const vector<Cut> &cuts,
+                         vector<GammaParams> &gps) const{
+  //Returns false, leaving gps untouched, if any cut needs something the skim does not have
+  if(!IsValid()) return false;
+  vector<Cut> full_cuts;
+  for(const auto &cut: cuts){
+    full_cuts.push_back(cut*process.Cut());
+  }
+  CutClassifier classifier(full_cuts);
+  if(!classifier.IsValid()) return false;
+  vector<string> variables = classifier.Variables();
+  vector<const double *> sources;
+  for(const auto &variable: variables){
+    sources.push_back(Column(variable));
+    if(sources.back() == nullptr) return false;
+  }
+  classifier.MapVariables(variables);
+
+  vector<double> sumw(cuts.size(), 0.), sumw2(cuts.size(), 0.);
+  vector<vector<double> > buffers(variables.size(), vector<double>(chunk_size));
+  for(size_t first = 0; first < size_; first += chunk_size){
+    size_t size = min(chunk_size, size_-first);
+    for(size_t ivar = 0; ivar < sources.size(); ++ivar){
+      copy(sources.at(ivar)+first, sources.at(ivar)+first+size, buffers.at(ivar).begin());
+    }
+    classifier.Fill(buffers, size, sumw, sumw2);
+  }
+  YieldStats &stats = YieldStats::Get();
+  stats.Add(YieldStats::Counter::skim_passes);
+  stats.Add(YieldStats::Counter::events_scanned, size_);
+  stats.Add(YieldStats::Counter::bytes_read, size_*sources.size()*sizeof(double));
+
+  gps.assign(cuts.size(), GammaParams());
+  for(size_t icut = 0; icut < cuts.size(); ++icut){
+    gps.at(icut).SetYieldAndUncertainty(sumw.at(icut), sqrt(sumw2.at(icut)));
+  }
+  return true;
+}
+
+string SkimFile::Description(const Process &process, const Cut &baseline){
+  ostringstream oss;
+  oss << skim_version << '\n'
+      << "files=" << process.FileSetHash() << '\n'
+      << "process_cut=" << process.Cut() << '\n'
+      << "signal_variants=" << YieldManager::SignalVariantsDescription(process) << '\n'
+      << "baseline=" << baseline << '\n' << flush;
+  return oss.str();
+}
+
+string SkimFile::PathFor(const string &directory,
+                         const Process &process,
+                         const Cut &baseline){
+  return directory+"/skim_"+HexString(HashString(Description(process, baseline)))+".skim";
+}
+
+Cut SkimFile::Selection(const Process &process, const Cut &baseline){
+  //Signal events are kept if they pass the baseline or any of its substituted
+  //variants, so the averaged signal yields can be computed from the skim
+  Cut selection = baseline;
+  if(YieldManager::SignalVariantsDescription(process) != ""){
+    for(const auto &variant: YieldManager::SignalVariants()){
+      Cut variant_cut = baseline;
+      for(const auto &substitution: variant){
+        variant_cut.Substitute(substitution.first, substitution.second);
+      }
+      if(!(variant_cut == baseline)) selection = selection || variant_cut;
+    }
+  }
+  return process.Cut() && selection;
+}
+
+void SkimFile::Build(const Process &process,
+                     const Cut &baseline,
+                     const vector<string> &branches,
+                     const string &directory){
+  TChain chain("tree", "tree");
+  for(const auto &file: process.Files()){
+    chain.Add(file.c_str());
+  }
+  if(chain.GetEntries() <= 0 || chain.LoadTree(0) < 0){
+    ERROR("No entries found for "+process.Name());
+  }
+
+  CompiledCut selection(Selection(process, baseline));
+  if(!selection.IsValid()) ERROR(selection.Error());
+
+  //Requested branches missing from the ntuples (e.g. met_tru in data) are skipped.
+  //Everything the selection reads is always stored.
+  vector<string> stored;
+  for(const auto &branch: branches){
+    if(find(stored.cbegin(), stored.cend(), branch) != stored.cend()) continue;
+    if(chain.GetTree()->GetLeaf(branch.c_str()) == nullptr) continue;
+    stored.push_back(branch);
+  }
+  for(const auto &variable: selection.Variables()){
+    if(find(stored.cbegin(), stored.cend(), variable) == stored.cend()) stored.push_back(variable);
+  }
+  selection.MapVariables(stored);
+
+  ColumnReader reader(chain, stored, chunk_size);
+  vector<vector<double> > columns(stored.size());
+  vector<double> pass;
+  while(reader.Next()){
+    selection.Evaluate(reader.Columns(), reader.Size(), pass);
+    for(size_t ibranch = 0; ibranch < stored.size(); ++ibranch){
+      const vector<double> &column = reader.Columns().at(ibranch);
+      for(size_t i = 0; i < reader.Size(); ++i){
+        if(pass.at(i) != 0.) columns.at(ibranch).push_back(column.at(i));
+      }
+    }
+  }
+  size_t num_entries = columns.size() == 0 ? 0 : columns.front().size();
+
+  string header;
+  header.append(magic, sizeof(magic));
+  string body;
+  AppendWord(body, num_entries);
+  AppendWord(body, stored.size());
+  AppendString(body, Description(process, baseline));
+  for(const auto &branch: stored){
+    AppendString(body, branch);
+  }
+  AppendWord(header, sizeof(magic)+sizeof(uint64_t)+body.size());
+  string contents = header+body;
+  for(const auto &column: columns){
+    contents.append(reinterpret_cast<const char *>(column.data()), column.size()*sizeof(double));
+  }
+
+  WriteFileAtomically(PathFor(directory, process, baseline), contents);
+}
+
+bool SkimFile::Map(){
+  int fd = open(path_.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+  struct stat info;
+  if(fstat(fd, &info) != 0 || info.st_size <= 0){
+    close(fd);
+    return false;
+  }
+  length_ = static_cast<size_t>(info.st_size);
+  void *data = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) return false;
+  data_ = data;
+
+  const char *bytes = static_cast<const char *>(data_);
+  size_t pos = sizeof(magic);
+  uint64_t header_size, num_entries, num_branches;
+  bool good = length_ >= sizeof(magic) && memcmp(bytes, magic, sizeof(magic)) == 0
+    && ReadWord(bytes, length_, pos, header_size)
+    && ReadWord(bytes, length_, pos, num_entries)
+    && ReadWord(bytes, length_, pos, num_branches)
+    && ReadString(bytes, length_, pos, description_);
+  for(uint64_t ibranch = 0; good && ibranch < num_branches; ++ibranch){
+    string branch;
+    good = ReadString(bytes, length_, pos, branch);
+    branches_.push_back(branch);
+  }
+  good = good && pos == header_size
+    && header_size+num_entries*num_branches*sizeof(double) == length_;
+  if(!good){
+    munmap(data_, length_);
+    data_ = nullptr;
+    return false;
+  }
+
+  size_ = num_entries;
+  for(uint64_t ibranch = 0; ibranch < num_branches; ++ibranch){
+    columns_.push_back(reinterpret_cast<const double *>(bytes+header_size+ibranch*num_entries*sizeof(double)));
+  }
+  return true;
+}
@@ -12,6 +12,7 @@
 #include <functional>
 #include <array>
 #include <algorithm>
+#include <future>
 
 #include "TMath.h"
 #include "TH1D.h"
@@ -20,6 +21,9 @@
 #include "TLegend.h"
 #include "TLine.h"
 
+#include "thread_pool.hpp"
+#include "philox.hpp"
+
 using namespace std;
 
 namespace{
@@ -30,13 +34,14 @@ namespace{
 }
 
 int main(int argc, char *argv[]){
-  if(argc != 9){
-    cerr << "Must supply 8 rates as arguments: bkg A, bkg B, bkg C, bkg D, sig A, sig B, sig C, sig D" << endl;
+  if(argc != 9 && argc != 10){
+    cerr << "Must supply 8 rates as arguments: bkg A, bkg B, bkg C, bkg D, sig A, sig B, sig C, sig D"
+         << ", optionally followed by a seed for the toys" << endl;
     return EXIT_FAILURE;
   }
 
   //Get a string to record input args
-  string params = GetParamString(argc, argv);
+  string params = GetParamString(min(argc, 9), argv);
 
   //Read background parameters from command line
   double bkg_a = atof(argv[1]);
@@ -76,13 +81,13 @@ int main(int argc, char *argv[]){
   double z = QToZ(q);
   cout << "Z-score: " << setprecision(6) << z << endl;
 
-  //PRNG for toys
-  mt19937 prng;
-  InitializePRNG(prng);
+  //Seed for toys
+  uint64_t seed = argc == 10 ? stoull(argv[9]) : Philox::RandomSeed();
+  cout << "Toy seed: " << seed << endl;
 
   //Generate toys
-  vector<double> b_qs = SampleTestStatistic(prng, num_bkg_toys, bkg_a, bkg_b, bkg_c, bkg_d);
-  vector<double> sb_qs = SampleTestStatistic(prng, num_sig_toys, tot_a, tot_b, tot_c, tot_d);
+  vector<double> b_qs = SampleTestStatistic(seed, 0, num_bkg_toys, bkg_a, bkg_b, bkg_c, bkg_d);
+  vector<double> sb_qs = SampleTestStatistic(seed, 1, num_sig_toys, tot_a, tot_b, tot_c, tot_d);
 
   //Make plots
   PlotQDistributions(params, b_qs, sb_qs);
@@ -167,14 +172,32 @@ double FindFraction(const vector<double> &qs, double q){
   return static_cast<double>(distance(lower_bound(qs.begin(), qs.end(), q), qs.end()))/qs.size();
 }
 
-vector<double> SampleTestStatistic(mt19937 & prng, size_t n, double a, double b, double c, double d){
+vector<double> SampleTestStatistic(uint64_t seed, uint64_t stream, size_t n, double a, double b, double c, double d){
+  //Toy i always draws from the Philox sequence (seed, stream, i), so the sample is the same
+  //however the toys are split between threads
   vector<double> out(n);
-  poisson_distribution<unsigned> pa(a), pb(b), pc(c), pd(d);
-  for(size_t i = 0; i < n; ++i){
-    out.at(i) = GetTestStatistic(a > 0. ? pa(prng) : 0.,
-                                 b > 0. ? pb(prng) : 0.,
-                                 c > 0. ? pc(prng) : 0.,
-                                 d > 0. ? pd(prng) : 0.);
+  ThreadPool pool;
+  size_t num_blocks = min(n, pool.Size());
+  vector<future<void> > blocks;
+  for(size_t iblock = 0; iblock < num_blocks; ++iblock){
+    size_t first = n*iblock/num_blocks;
+    size_t last = n*(iblock+1)/num_blocks;
+    blocks.push_back(pool.Push([&out, seed, stream, first, last, a, b, c, d](){
+          poisson_distribution<unsigned> pa(a > 0. ? a : 1.), pb(b > 0. ? b : 1.),
+            pc(c > 0. ? c : 1.), pd(d > 0. ? d : 1.);
+          for(size_t i = first; i < last; ++i){
+            Philox prng(seed, stream, static_cast<uint32_t>(i));
+            pa.reset(); pb.reset(); pc.reset(); pd.reset();
+            double toy_a = a > 0. ? pa(prng) : 0.;
+            double toy_b = b > 0. ? pb(prng) : 0.;
+            double toy_c = c > 0. ? pc(prng) : 0.;
+            double toy_d = d > 0. ? pd(prng) : 0.;
+            out.at(i) = GetTestStatistic(toy_a, toy_b, toy_c, toy_d);
+          }
+        }));
+  }
+  for(auto &block: blocks){
+    block.get();
   }
   sort(out.begin(), out.end());
   return out;
@@ -205,14 +228,6 @@ void PrintRates(ostream &out, const string &name,
     << endl;
 }
 
-void InitializePRNG(mt19937 &prng){
-  array<int, mt19937::state_size> vals;
-  random_device rd;
-  generate(vals.begin(), vals.end(), ref(rd));
-  seed_seq ss(vals.begin(), vals.end());
-  prng.seed(ss);
-}
-
 void PlotQDistributions(const string &params,
                         const vector<double> &b_qs,
                         const vector<double> &sb_qs){
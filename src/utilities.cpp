@@ -4,18 +4,34 @@
 #include <cstring>
 #include <stdlib.h>
 #include <unistd.h>
+#include <glob.h>
+#include <sys/stat.h>
 
 #include <string>
 #include <vector>
+#include <map>
 #include <memory>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
 
 #include <unistd.h>
 
 #include "TTree.h"
 #include "TH1D.h"
+#include "TTreeFormula.h"
+#include "TLeaf.h"
+#include "TBranch.h"
 
 #include "RooWorkspace.h"
 
+#include "compiled_cut.hpp"
+#include "cut_classifier.hpp"
+#include "yield_stats.hpp"
+#include "column_reader.hpp"
+
 using namespace std;
 
 void parseMasses(const string &prs, int &mglu, int &mlsp){
@@ -84,6 +100,185 @@ void GetCountAndUncertainty(TTree &tree,
   count=temp.IntegralAndError(0,2,uncertainty);
 }
 
+void GetCountsAndUncertainties(TTree &tree,
+                               const vector<Cut> &cuts,
+                               vector<double> &counts,
+                               vector<double> &uncertainties){
+  //Same sums as GetCountAndUncertainty, but all cuts are filled in a single pass over the tree
+  GetSumsOfWeights(tree, cuts, counts, uncertainties);
+  for(auto &uncertainty: uncertainties){
+    uncertainty = sqrt(uncertainty);
+  }
+}
+
+void GetSumsOfWeights(TTree &tree,
+                      const vector<Cut> &cuts,
+                      vector<double> &sumw,
+                      vector<double> &sumw2){
+  vector<vector<double> > points, point_sumw, point_sumw2;
+  GetSumsOfWeights(tree, cuts, vector<string>(), points, point_sumw, point_sumw2);
+  if(points.size() == 0){
+    sumw.assign(cuts.size(), 0.);
+    sumw2.assign(cuts.size(), 0.);
+  }else{
+    sumw = point_sumw.front();
+    sumw2 = point_sumw2.front();
+  }
+}
+
+void GetSumsOfWeights(TTree &tree,
+                      const vector<Cut> &cuts,
+                      const vector<string> &point_branches,
+                      vector<vector<double> > &points,
+                      vector<vector<double> > &sumw,
+                      vector<vector<double> > &sumw2){
+  //Entries are grouped by the values of point_branches (e.g. the masses of a signal
+  //scan), and every cut is filled separately for each group. Groups are listed in
+  //order of first appearance, and only groups with entries are listed.
+  points.clear();
+  sumw.clear();
+  sumw2.clear();
+  if(cuts.size() == 0) return;
+
+  Long64_t num_entries = tree.GetEntries();
+  if(num_entries <= 0 || tree.LoadTree(0) < 0) return;
+
+  auto is_scalar = [&tree](const string &variable){
+    TLeaf *leaf = tree.GetTree()->GetLeaf(variable.c_str());
+    return leaf != nullptr && leaf->GetLeafCount() == nullptr && leaf->GetLen() == 1;
+  };
+  for(const auto &branch: point_branches){
+    if(!is_scalar(branch)) ERROR("Cannot group entries by "+branch);
+  }
+
+  //Cuts on plain scalar branches are compiled and evaluated directly. Anything
+  //else (arrays, aliases, special functions) falls back to TTreeFormula.
+  vector<bool> is_compiled(cuts.size(), false);
+  vector<Cut> compiled_cuts;
+  vector<size_t> compiled_indices;
+  for(size_t icut = 0; icut < cuts.size(); ++icut){
+    CompiledCut cut(cuts.at(icut));
+    if(!cut.IsValid()) continue;
+    if(!all_of(cut.Variables().cbegin(), cut.Variables().cend(), is_scalar)) continue;
+    is_compiled.at(icut) = true;
+    compiled_cuts.push_back(cuts.at(icut));
+    compiled_indices.push_back(icut);
+  }
+
+  //The compiled cuts share their predicates, so each distinct requirement is
+  //evaluated once per event no matter how many bins use it
+  CutClassifier classifier(compiled_cuts);
+  if(!classifier.IsValid()) ERROR(classifier.Error());
+  vector<string> variables = classifier.Variables();
+  vector<size_t> point_columns;
+  for(const auto &branch: point_branches){
+    auto found = find(variables.cbegin(), variables.cend(), branch);
+    point_columns.push_back(found-variables.cbegin());
+    if(found == variables.cend()) variables.push_back(branch);
+  }
+  classifier.MapVariables(variables);
+
+  vector<unique_ptr<TTreeFormula> > formulas(cuts.size());
+  for(size_t icut = 0; icut < cuts.size(); ++icut){
+    if(is_compiled.at(icut)) continue;
+    formulas.at(icut).reset(new TTreeFormula(("cut"+to_string(icut)).c_str(),
+                                             static_cast<const char *>(cuts.at(icut)),
+                                             &tree));
+    if(formulas.at(icut)->GetNdim() == 0){
+      ERROR("Could not compile cut "+static_cast<string>(cuts.at(icut)));
+    }
+  }
+
+  //Only the branches the compiled cuts read are loaded, chunk by chunk
+  ColumnReader reader(tree, variables);
+  bool have_formulas = any_of(formulas.cbegin(), formulas.cend(),
+                              [](const unique_ptr<TTreeFormula> &formula){return formula != nullptr;});
+  //The fallback formulas add only the branches of the leaves they read, and of the
+  //counters sizing those leaves
+  for(const auto &formula: formulas){
+    if(!formula) continue;
+    for(int icode = 0; icode < formula->GetNcodes(); ++icode){
+      for(TLeaf *leaf = formula->GetLeaf(icode); leaf != nullptr; leaf = leaf->GetLeafCount()){
+        if(leaf->GetBranch() != nullptr) tree.AddBranchToCache(leaf->GetBranch()->GetName(), true);
+      }
+    }
+  }
+
+  //One row of sums per point. Entries of the same point usually come together, so
+  //the last point found is checked before the lookup.
+  map<vector<double>, size_t> point_rows;
+  vector<double> point(point_branches.size()), last_point;
+  size_t last_row = 0;
+  vector<size_t> rows;
+  vector<double> compiled_sumw, compiled_sumw2, formula_sumw, formula_sumw2;
+  int tree_number = -1;
+  while(reader.Next()){
+    if(reader.TreeNumber() != tree_number){
+      tree_number = reader.TreeNumber();
+      for(auto &formula: formulas){
+        if(formula) formula->UpdateFormulaLeaves();
+      }
+    }
+
+    rows.resize(reader.Size());
+    for(size_t i = 0; i < reader.Size(); ++i){
+      for(size_t ibranch = 0; ibranch < point.size(); ++ibranch){
+        point[ibranch] = reader.Columns()[point_columns[ibranch]][i];
+      }
+      if(points.size() == 0 || point != last_point){
+        auto found = point_rows.find(point);
+        if(found == point_rows.end()){
+          found = point_rows.emplace(point, points.size()).first;
+          points.push_back(point);
+          compiled_sumw.resize(points.size()*compiled_cuts.size(), 0.);
+          compiled_sumw2.resize(points.size()*compiled_cuts.size(), 0.);
+          formula_sumw.resize(points.size()*cuts.size(), 0.);
+          formula_sumw2.resize(points.size()*cuts.size(), 0.);
+        }
+        last_point = point;
+        last_row = found->second;
+      }
+      rows[i] = last_row;
+    }
+
+    classifier.Fill(reader.Columns(), reader.Size(), rows, compiled_sumw, compiled_sumw2);
+    if(!have_formulas) continue;
+    for(size_t i = 0; i < reader.Size(); ++i){
+      tree.LoadTree(reader.FirstEntry()+i);
+      for(size_t icut = 0; icut < cuts.size(); ++icut){
+        if(!formulas.at(icut)) continue;
+        TTreeFormula &formula = *formulas.at(icut);
+        size_t index = rows[i]*cuts.size()+icut;
+        int num_instances = formula.GetNdata();
+        for(int instance = 0; instance < num_instances; ++instance){
+          double weight = formula.EvalInstance(instance);
+          if(weight == 0.) continue;
+          formula_sumw[index] += weight;
+          formula_sumw2[index] += weight*weight;
+        }
+      }
+    }
+  }
+
+  YieldStats &stats = YieldStats::Get();
+  stats.Add(YieldStats::Counter::chain_passes);
+  stats.Add(YieldStats::Counter::events_scanned, static_cast<uint64_t>(num_entries));
+  stats.Add(YieldStats::Counter::bytes_read, static_cast<uint64_t>(reader.BytesRead()));
+
+  sumw.assign(points.size(), vector<double>());
+  sumw2.assign(points.size(), vector<double>());
+  for(size_t ipoint = 0; ipoint < points.size(); ++ipoint){
+    sumw.at(ipoint).assign(formula_sumw.cbegin()+ipoint*cuts.size(),
+                           formula_sumw.cbegin()+(ipoint+1)*cuts.size());
+    sumw2.at(ipoint).assign(formula_sumw2.cbegin()+ipoint*cuts.size(),
+                            formula_sumw2.cbegin()+(ipoint+1)*cuts.size());
+    for(size_t i = 0; i < compiled_indices.size(); ++i){
+      sumw.at(ipoint).at(compiled_indices.at(i)) = compiled_sumw.at(ipoint*compiled_cuts.size()+i);
+      sumw2.at(ipoint).at(compiled_indices.at(i)) = compiled_sumw2.at(ipoint*compiled_cuts.size()+i);
+    }
+  }
+}
+
 string execute(const string &cmd){
   FILE *pipe = popen(cmd.c_str(), "r");
   if(!pipe) ERROR("Could not open pipe.");
@@ -123,6 +318,68 @@ string ChangeExtension(string path, const string &new_ext){
   return path;
 }
 
+vector<string> Glob(const string &pattern){
+  vector<string> paths;
+  glob_t glob_result;
+  if(glob(pattern.c_str(), 0, nullptr, &glob_result) == 0){
+    for(size_t ipath = 0; ipath < glob_result.gl_pathc; ++ipath){
+      paths.push_back(glob_result.gl_pathv[ipath]);
+    }
+  }
+  globfree(&glob_result);
+  return paths;
+}
+
+bool GetFileStats(const string &path, long &size, long &mod_time){
+  struct stat file_stat;
+  if(stat(path.c_str(), &file_stat) != 0){
+    size = -1;
+    mod_time = -1;
+    return false;
+  }
+  size = static_cast<long>(file_stat.st_size);
+  mod_time = static_cast<long>(file_stat.st_mtime);
+  return true;
+}
+
+uint64_t HashString(const string &str){
+  //64-bit FNV-1a: stable across builds and runs, unlike std::hash
+  uint64_t hash = UINT64_C(14695981039346656037);
+  for(const auto &c: str){
+    hash ^= static_cast<unsigned char>(c);
+    hash *= UINT64_C(1099511628211);
+  }
+  return hash;
+}
+
+string HexString(uint64_t value){
+  ostringstream oss;
+  oss << hex << setw(16) << setfill('0') << value << flush;
+  return oss.str();
+}
+
+void WriteFileAtomically(const string &path, const string &contents){
+  //Write to a temporary file in the same directory and rename it into place, so concurrent
+  //readers see either the old file or the complete new one
+  string temp_path = path+".tmpXXXXXX";
+  vector<char> temp_name(temp_path.cbegin(), temp_path.cend());
+  temp_name.push_back('\0');
+  int fd = mkstemp(&temp_name.at(0));
+  if(fd < 0) ERROR("Could not create temporary file for "+path);
+  FILE *file = fdopen(fd, "w");
+  if(file == nullptr){
+    close(fd);
+    remove(&temp_name.at(0));
+    ERROR("Could not open temporary file for "+path);
+  }
+  bool good = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+  good = (fclose(file) == 0) && good;
+  if(!good || rename(&temp_name.at(0), path.c_str()) != 0){
+    remove(&temp_name.at(0));
+    ERROR("Could not write "+path);
+  }
+}
+
 string MakeDir(string prefix){
   prefix += "XXXXXX";
   char *dir_name = new char[prefix.size()];
@@ -7,22 +7,53 @@
 #include <array>
 #include <algorithm>
 #include <numeric>
+#include <random>
+#include <limits>
+#include <atomic>
 
 #include "TDirectory.h"
 
 #include "RooPoisson.h"
+#include "RooGaussian.h"
+#include "RooProduct.h"
+#include "RooAddition.h"
+#include "RooFormulaVar.h"
+#include "RooProdPdf.h"
 #include "RooDataSet.h"
 #include "RooRealVar.h"
+#include "RooArgList.h"
+#include "RooGlobalFunc.h"
 
 #include "RooStats/ModelConfig.h"
 
 #include "utilities.hpp"
+#include "thread_pool.hpp"
+#include "philox.hpp"
 
 using namespace std;
 
-YieldManager WorkspaceGenerator::yields_ = YieldManager(4.);
-mt19937_64 WorkspaceGenerator::prng_ = WorkspaceGenerator::InitializePRNG();
-poisson_distribution<> WorkspaceGenerator::dist_(1.);
+namespace{
+  //Generators made in the same run share a seed and tell their toys apart by stream
+  uint64_t RunSeed(){
+    static const uint64_t run_seed = Philox::RandomSeed();
+    return run_seed;
+  }
+
+  atomic<uint64_t> next_toy_stream(0);
+
+  double FactoryValue(double value){
+    //Rounded to the six significant digits the model's values had when they were
+    //printed into factory strings, so workspaces are unchanged
+    ostringstream oss;
+    oss << value << flush;
+    return stod(oss.str());
+  }
+
+  double FactoryRMax(double rmax){
+    //The POI range was printed with to_string
+    return stod(to_string(rmax));
+  }
+}
 
 WorkspaceGenerator::WorkspaceGenerator(const Cut &baseline,
                                        const set<Block> &blocks,
@@ -37,9 +68,8 @@ WorkspaceGenerator::WorkspaceGenerator(const Cut &baseline,
   data_(data),
   injection_(),
   inject_other_signal_(false),
+  original_blocks_(blocks),
   blocks_(blocks),
-  obs_vals_(),
-  obs_gens_(),
   systematics_file_(systematics_file),
   use_r4_(use_r4),
   sig_strength_(sig_strength),
@@ -52,20 +82,30 @@ WorkspaceGenerator::WorkspaceGenerator(const Cut &baseline,
   nuisances_(),
   systematics_(),
   free_systematics_(),
+  cache_systematics_(true),
   luminosity_(4.),
   print_level_(PrintLevel::important),
   do_systematics_(true),
   do_dilepton_(false),
+  do_lumi_scale_(false),
   do_mc_kappa_correction_(true),
   num_toys_(0),
+  batch_toys_(false),
+  toy_seed_(RunSeed()),
+  toy_stream_(next_toy_stream++),
   gaus_approx_(true),
-  w_is_valid_(false){
+  w_is_valid_(false),
+  poi_is_valid_(false),
+  mc_weights_are_valid_(false),
+  observables_are_valid_(false),
+  abcd_is_valid_(false),
+  yields_(YieldManager::Shared()){
   w_.cd();
 }
 
 void WorkspaceGenerator::WriteToFile(const string &file_name){
   if(print_level_ >= PrintLevel::everything) DBG(file_name);
-  if(!w_is_valid_) UpdateWorkspace();
+  RefreshWorkspace();
   w_.writeToFile(file_name.c_str());
   if(print_level_ >= PrintLevel::everything){
     DBG("");
@@ -86,7 +126,12 @@ double WorkspaceGenerator::GetLuminosity() const{
 WorkspaceGenerator & WorkspaceGenerator::SetLuminosity(double luminosity){
   if(luminosity != luminosity_){
     luminosity_ = luminosity;
-    w_is_valid_ = false;
+    //MC yields only scale with the luminosity, so the model keeps its structure unless
+    //it has dilepton systematics, whose strengths are set from the yields
+    if(do_dilepton_) w_is_valid_ = false;
+    mc_weights_are_valid_ = false;
+    observables_are_valid_ = false;
+    abcd_is_valid_ = false;
   }
   return *this;
 }
@@ -115,6 +160,27 @@ WorkspaceGenerator & WorkspaceGenerator::SetDoDilepton(bool do_dilepton){
   return *this;
 }
 
+bool WorkspaceGenerator::GetDoLumiScale() const{
+  return do_lumi_scale_;
+}
+
+WorkspaceGenerator & WorkspaceGenerator::SetDoLumiScale(bool do_lumi_scale){
+  if(do_lumi_scale != do_lumi_scale_){
+    do_lumi_scale_ = do_lumi_scale;
+    w_is_valid_ = false;
+  }
+  return *this;
+}
+
+bool WorkspaceGenerator::GetCacheSystematics() const{
+  return cache_systematics_;
+}
+
+WorkspaceGenerator & WorkspaceGenerator::SetCacheSystematics(bool cache_systematics){
+  cache_systematics_ = cache_systematics;
+  return *this;
+}
+
 WorkspaceGenerator::PrintLevel WorkspaceGenerator::GetPrintLevel() const{
   return print_level_;
 }
@@ -143,7 +209,19 @@ double WorkspaceGenerator::GetRMax() const{
 WorkspaceGenerator & WorkspaceGenerator::SetRMax(double rmax){
   if(rmax != rmax_){
     rmax_ = rmax;
-    w_is_valid_ = false;
+    poi_is_valid_ = false;
+  }
+  return *this;
+}
+
+double WorkspaceGenerator::GetSignalXsecFactor() const{
+  return sig_xsec_f_;
+}
+
+WorkspaceGenerator & WorkspaceGenerator::SetSignalXsecFactor(double sig_xsec_f){
+  if(sig_xsec_f != sig_xsec_f_){
+    sig_xsec_f_ = sig_xsec_f;
+    mc_weights_are_valid_ = false;
   }
   return *this;
 }
@@ -157,9 +235,21 @@ WorkspaceGenerator & WorkspaceGenerator::UseGausApprox(bool use_gaus_approx){
   return *this;
 }
 
+const shared_ptr<YieldManager> & WorkspaceGenerator::GetYieldManager() const{
+  return yields_;
+}
+
+WorkspaceGenerator & WorkspaceGenerator::SetYieldManager(const shared_ptr<YieldManager> &yields){
+  if(yields == nullptr) ERROR("Yield manager cannot be null");
+  if(yields != yields_){
+    yields_ = yields;
+    w_is_valid_ = false;
+  }
+  return *this;
+}
+
 GammaParams WorkspaceGenerator::GetYield(const YieldKey &key) const{
-  yields_.Luminosity() = luminosity_;
-  return yields_.GetYield(key);
+  return yields_->GetYield(key, luminosity_);
 }
 
 GammaParams WorkspaceGenerator::GetYield(const Bin &bin,
@@ -175,24 +265,63 @@ GammaParams WorkspaceGenerator::GetYield(const Bin &bin,
 
 size_t WorkspaceGenerator::AddToys(size_t num_toys){
   if(print_level_ >= PrintLevel::everything) DBG(num_toys);
-  if(!w_is_valid_) UpdateWorkspace();
+  RefreshWorkspace();
   if(num_toys == 0) return num_toys_;
+  if(print_level_ >= PrintLevel::important){
+    cout << "Generating toys " << num_toys_ << " to " << num_toys_+num_toys-1
+         << " with seed " << toy_seed_ << " and stream " << toy_stream_ << endl;
+  }
   const RooArgSet *obs_orig = w_.set("observables");
   if(obs_orig == nullptr) ERROR("Could not get observables list for toy generation");
   RooArgSet obs(*obs_orig);
-  SetupToys(obs);
-  for(size_t itoy = num_toys_; itoy < num_toys_+num_toys; ++itoy){
-    GenerateToys(obs);
-    RooDataSet data_new(("data_obs_"+to_string(itoy)).c_str(), ("data_obs_"+to_string(itoy)).c_str(), obs);
-    data_new.add(obs);
-    w_.import(data_new);
-  }
-  ResetToys(obs);
+  vector<RooRealVar*> vars;
+  vector<double> means;
+  SetupToys(obs, vars, means);
+  vector<int> counts = GenerateToys(means, num_toys);
+  if(batch_toys_){
+    ImportBatchedToys(obs, vars, counts, num_toys);
+  }else{
+    for(size_t itoy = 0; itoy < num_toys; ++itoy){
+      for(size_t iobs = 0; iobs < vars.size(); ++iobs){
+        vars.at(iobs)->setVal(counts.at(itoy*vars.size()+iobs));
+      }
+      string name = "data_obs_"+to_string(num_toys_+itoy);
+      RooDataSet data_new(name.c_str(), name.c_str(), obs);
+      data_new.add(obs);
+      w_.import(data_new);
+    }
+  }
+  ResetToys(vars, means);
   num_toys_ += num_toys;
   return num_toys_;
 }
 
+bool WorkspaceGenerator::GetBatchToys() const{
+  return batch_toys_;
+}
+
+WorkspaceGenerator & WorkspaceGenerator::SetBatchToys(bool batch_toys){
+  batch_toys_ = batch_toys;
+  return *this;
+}
+
+uint64_t WorkspaceGenerator::GetToySeed() const{
+  return toy_seed_;
+}
+
+WorkspaceGenerator & WorkspaceGenerator::SetToySeed(uint64_t toy_seed){
+  toy_seed_ = toy_seed;
+  return *this;
+}
+
+uint64_t WorkspaceGenerator::GetToyStream() const{
+  return toy_stream_;
+}
 
+WorkspaceGenerator & WorkspaceGenerator::SetToyStream(uint64_t toy_stream){
+  toy_stream_ = toy_stream;
+  return *this;
+}
 
 const Process & WorkspaceGenerator::GetInjectionModel() const{
   if(inject_other_signal_){
@@ -205,6 +334,7 @@ const Process & WorkspaceGenerator::GetInjectionModel() const{
 WorkspaceGenerator & WorkspaceGenerator::SetInjectionModel(const Process &injection){
   inject_other_signal_ = true;
   injection_ = injection;
+  observables_are_valid_ = false;
   return *this;
 }
 
@@ -213,30 +343,20 @@ bool WorkspaceGenerator::GetDefaultInjectionModel() const{
 }
 
 WorkspaceGenerator & WorkspaceGenerator::SetDefaultInjectionModel(){
-  inject_other_signal_ = false;
-  return *this;
-}
-
-void WorkspaceGenerator::SetupToys(const RooArgSet &obs){
-  if(print_level_ >= PrintLevel::everything) DBG("");
-  obs_vals_.clear();
-  obs_gens_.clear();
-  TIterator *iter_ptr = obs.createIterator();
-  if(iter_ptr == nullptr) ERROR("Could not generator iterator to set up toys");
-  for(; iter_ptr != nullptr && *(*iter_ptr) != nullptr; iter_ptr->Next()){
-    RooAbsReal *arg = static_cast<RooAbsReal*>(*(*iter_ptr));
-    if(arg == nullptr) continue;
-    string name = arg->GetName();
-    if(Contains(name,"nobsmc")) continue;
-    double value = arg->getVal();
-    obs_vals_[name] = value;
-    obs_gens_[name] = poisson_distribution<>(value);
+  if(inject_other_signal_){
+    inject_other_signal_ = false;
+    observables_are_valid_ = false;
   }
-  iter_ptr->Reset();
+  return *this;
 }
 
-void WorkspaceGenerator::GenerateToys(RooArgSet &obs){
+void WorkspaceGenerator::SetupToys(const RooArgSet &obs,
+                                   vector<RooRealVar*> &vars,
+                                   vector<double> &means) const{
+  //Resolves the observables once, so generating and storing toys never goes back to the names
   if(print_level_ >= PrintLevel::everything) DBG("");
+  vars.clear();
+  means.clear();
   TIterator *iter_ptr = obs.createIterator();
   if(iter_ptr == nullptr) ERROR("Could not generator iterator to set up toys");
   for(; iter_ptr != nullptr && *(*iter_ptr) != nullptr; iter_ptr->Next()){
@@ -244,38 +364,81 @@ void WorkspaceGenerator::GenerateToys(RooArgSet &obs){
     if(arg == nullptr) continue;
     string name = arg->GetName();
     if(Contains(name,"nobsmc")) continue;
-    arg->setVal(obs_gens_[name](prng_));
+    vars.push_back(arg);
+    means.push_back(arg->getVal());
   }
   iter_ptr->Reset();
 }
 
-void WorkspaceGenerator::ResetToys(RooArgSet &obs){
-  if(print_level_ >= PrintLevel::everything) DBG("");
-  TIterator *iter_ptr = obs.createIterator();
-  if(iter_ptr == nullptr) ERROR("Could not generator iterator to set up toys");
-  for(; iter_ptr != nullptr && *(*iter_ptr) != nullptr; iter_ptr->Next()){
-    RooRealVar *arg = static_cast<RooRealVar*>(*(*iter_ptr));
-    if(arg == nullptr) continue;
-    string name = arg->GetName();
-    if(Contains(name,"nobsmc")) continue;
-    double value = obs_vals_.at(name);
-    arg->setVal(value);
+vector<int> WorkspaceGenerator::GenerateToys(const vector<double> &means, size_t num_toys) const{
+  //Poisson counts for all toys, toy-major. Each toy draws from its own Philox sequence
+  //keyed by (seed, stream, toy index), so the counts do not depend on how the toys are
+  //split between threads and any toy can be regenerated alone.
+  if(print_level_ >= PrintLevel::everything) DBG(num_toys);
+  if(num_toys_+num_toys > numeric_limits<uint32_t>::max()) ERROR("Too many toys for one stream");
+  vector<int> counts(num_toys*means.size(), 0);
+  ThreadPool pool;
+  size_t num_blocks = min(num_toys, pool.Size());
+  vector<future<void> > blocks;
+  for(size_t iblock = 0; iblock < num_blocks; ++iblock){
+    size_t first = num_toys*iblock/num_blocks;
+    size_t last = num_toys*(iblock+1)/num_blocks;
+    blocks.push_back(pool.Push([this, &counts, &means, first, last](){
+          vector<poisson_distribution<> > dists;
+          for(const auto &mean: means){
+            dists.emplace_back(mean > 0. ? mean : 1.);
+          }
+          for(size_t itoy = first; itoy < last; ++itoy){
+            Philox prng(toy_seed_, toy_stream_, static_cast<uint32_t>(num_toys_+itoy));
+            for(size_t iobs = 0; iobs < means.size(); ++iobs){
+              if(means.at(iobs) <= 0.) continue;
+              dists.at(iobs).reset();
+              counts.at(itoy*means.size()+iobs) = dists.at(iobs)(prng);
+            }
+          }
+        }));
   }
-  iter_ptr->Reset();
+  for(auto &block: blocks){
+    block.get();
+  }
+  return counts;
 }
 
-mt19937_64 WorkspaceGenerator::InitializePRNG(){
-  array<int, 128> sd;
-  random_device r;
-  generate_n(sd.begin(), sd.size(), ref(r));
-  seed_seq ss(begin(sd), end(sd));
-  return mt19937_64(ss);
+void WorkspaceGenerator::ImportBatchedToys(const RooArgSet &obs,
+                                           const vector<RooRealVar*> &vars,
+                                           const vector<int> &counts,
+                                           size_t num_toys){
+  //All toys go in one data_obs_toys dataset with a toy index column, filled in place instead
+  //of importing one single-row dataset per toy
+  if(print_level_ >= PrintLevel::everything) DBG(num_toys);
+  if(w_.data("data_obs_toys") == nullptr){
+    RooRealVar toy_index("toy", "toy", 0.);
+    RooArgSet columns(obs);
+    columns.add(toy_index);
+    RooDataSet toys("data_obs_toys", "data_obs_toys", columns);
+    w_.import(toys);
+  }
+  RooAbsData *toys = w_.data("data_obs_toys");
+  const RooArgSet *columns = toys == nullptr ? nullptr : toys->get();
+  RooRealVar *toy_index = columns == nullptr ? nullptr : static_cast<RooRealVar*>(columns->find("toy"));
+  if(toy_index == nullptr) ERROR("Could not set up the batched toy dataset");
+  RooArgSet row(obs);
+  row.add(*toy_index);
+  for(size_t itoy = 0; itoy < num_toys; ++itoy){
+    for(size_t iobs = 0; iobs < vars.size(); ++iobs){
+      vars.at(iobs)->setVal(counts.at(itoy*vars.size()+iobs));
+    }
+    toy_index->setVal(num_toys_+itoy);
+    toys->add(row);
+  }
 }
 
-int WorkspaceGenerator::GetPoisson(double rate){
-  using param_t = decltype(dist_)::param_type;
-  dist_.param(param_t{rate});
-  return dist_(prng_);
+void WorkspaceGenerator::ResetToys(const vector<RooRealVar*> &vars,
+                                   const vector<double> &means) const{
+  if(print_level_ >= PrintLevel::everything) DBG("");
+  for(size_t iobs = 0; iobs < vars.size(); ++iobs){
+    vars.at(iobs)->setVal(means.at(iobs));
+  }
 }
 
 void WorkspaceGenerator::UpdateWorkspace(){
@@ -287,6 +450,16 @@ void WorkspaceGenerator::UpdateWorkspace(){
   w_ = RooWorkspace("w");
   w_.SetName("w");
   w_.cd();
+  ClearStaged();
+  //A rebuild starts from scratch: the names collected by the last build are dropped,
+  //and the dilepton systematics are added to the blocks as they were given
+  blocks_ = original_blocks_;
+  poi_.clear();
+  observables_.clear();
+  glob_observables_.clear();
+  nuisances_.clear();
+  systematics_.clear();
+  free_systematics_.clear();
 
   if(do_dilepton_){
     AddDileptonSystematic();
@@ -294,7 +467,9 @@ void WorkspaceGenerator::UpdateWorkspace(){
   if(do_systematics_){
     ReadSystematicsFile();
   }
+  PrefetchYields();
   AddPOI();
+  if(do_lumi_scale_) AddLumiScale();
   AddSystematicsGenerators();
 
   for(const auto &block: blocks_){
@@ -314,46 +489,201 @@ void WorkspaceGenerator::UpdateWorkspace(){
 
   // AddDummyNuisance();
   AddFullPdf();
+  ImportStaged();
   AddParameterSets();
   AddModels();
 
   w_is_valid_ = true;
+  poi_is_valid_ = true;
+  mc_weights_are_valid_ = true;
+  observables_are_valid_ = true;
+  abcd_is_valid_ = true;
+}
+
+void WorkspaceGenerator::RefreshWorkspace(){
+  //Settings that only change values are applied to the existing workspace. Anything that
+  //changes the structure of the model, or observables that toys were drawn from, rebuilds it.
+  if(!observables_are_valid_ && num_toys_ > 0) w_is_valid_ = false;
+  if(!w_is_valid_){
+    UpdateWorkspace();
+    return;
+  }
+  if(!poi_is_valid_) UpdatePOI();
+  if(!mc_weights_are_valid_) UpdateMCWeights();
+  if(!abcd_is_valid_) UpdateABCDParameters();
+  if(!observables_are_valid_) UpdateObservables();
+}
+
+void WorkspaceGenerator::UpdatePOI(){
+  if(print_level_ >= PrintLevel::everything) DBG(rmax_);
+  RooRealVar &r = WorkspaceVar("r");
+  r.setRange(0., FactoryRMax(rmax_));
+  r.setVal(1.);
+  poi_is_valid_ = true;
+}
+
+void WorkspaceGenerator::UpdateMCWeights(){
+  if(print_level_ >= PrintLevel::everything) DBG("");
+  auto all_prcs = backgrounds_;
+  Append(all_prcs, signal_);
+  for(const auto &block: blocks_){
+    for(const auto &vbin: block.Bins()){
+      for(const auto &bin: vbin){
+        for(const auto &prc: all_prcs){
+          string bbp_name = "BLK_"+block.Name()+"_BIN_"+bin.Name()+"_PRC_"+prc.Name();
+          WorkspaceVar("wmc_"+bbp_name).setVal(FactoryValue(MCYield(bin, prc).Weight()));
+        }
+      }
+    }
+  }
+  mc_weights_are_valid_ = true;
+}
+
+void WorkspaceGenerator::UpdateABCDParameters(){
+  if(print_level_ >= PrintLevel::everything) DBG("");
+  for(const auto &block: blocks_){
+    BlockYields by(block, backgrounds_, baseline_, *yields_, luminosity_);
+    RooRealVar &norm = WorkspaceVar("norm_BLK_"+block.Name());
+    norm.setRange(0., FactoryValue(max(5.*by.Total().Yield(), 20.)));
+    norm.setVal(FactoryValue(max(1., 0.8*by.Total().Yield())));
+    for(size_t irow = 0; irow < by.RowSums().size(); ++irow){
+      if(irow == by.MaxRow()) continue;
+      ostringstream oss;
+      oss << "ry" << (irow+1) << (by.MaxRow()+1) << "_BLK_" << block.Name() << flush;
+      WorkspaceVar(oss.str()).setVal(FactoryValue(by.RowSums().at(irow).Yield()/by.RowSums().at(by.MaxRow()).Yield()));
+    }
+    for(size_t icol = 0; icol < by.ColSums().size(); ++icol){
+      if(icol == by.MaxCol()) continue;
+      ostringstream oss;
+      oss << "rx" << (icol+1) << (by.MaxCol()+1) << "_BLK_" << block.Name() << flush;
+      WorkspaceVar(oss.str()).setVal(FactoryValue(by.ColSums().at(icol).Yield()/by.ColSums().at(by.MaxCol()).Yield()));
+    }
+  }
+  abcd_is_valid_ = true;
+}
+
+void WorkspaceGenerator::UpdateObservables(){
+  if(print_level_ >= PrintLevel::everything) DBG("");
+  for(const auto &block: blocks_){
+    for(const auto &vbin: block.Bins()){
+      for(const auto &bin: vbin){
+        WorkspaceVar("nobs_BLK_"+block.Name()+"_BIN_"+bin.Name()).setVal(FactoryValue(ObservedYield(bin).Yield()));
+      }
+    }
+  }
+  //data_obs holds a copy of the observed values, so it is refilled from the new ones
+  RooAbsData *data_obs = w_.data("data_obs");
+  const RooArgSet *obs = w_.set("observables");
+  if(data_obs == nullptr || obs == nullptr) ERROR("Could not find observed data in workspace");
+  data_obs->reset();
+  data_obs->add(*obs);
+  observables_are_valid_ = true;
+}
+
+RooRealVar & WorkspaceGenerator::WorkspaceVar(const string &name){
+  RooRealVar *var = w_.var(name.c_str());
+  if(var == nullptr) ERROR("Could not find "+name+" in workspace");
+  return *var;
+}
+
+void WorkspaceGenerator::PrefetchYields() const{
+  if(print_level_ >= PrintLevel::everything) DBG("");
+  vector<YieldKey> keys;
+  for(const auto &block: blocks_){
+    for(const auto &vbin: block.Bins()){
+      for(const auto &bin: vbin){
+        for(const auto &bkg: backgrounds_){
+          keys.push_back(YieldKey(bin, bkg, baseline_));
+        }
+        keys.push_back(YieldKey(bin, signal_, baseline_));
+        if(inject_other_signal_){
+          keys.push_back(YieldKey(bin, injection_, baseline_));
+        }
+        if(!bin.Blind()){
+          keys.push_back(YieldKey(bin, data_, baseline_));
+        }
+      }
+    }
+  }
+  yields_->PrefetchYields(keys);
 }
 
 void WorkspaceGenerator::AddPOI(){
   if(print_level_ >= PrintLevel::everything) DBG("");
-  w_.factory(("r[1.,0.,"+to_string(rmax_)+"]").c_str());
+  Stage(new RooRealVar("r", "r", 1., 0., FactoryRMax(rmax_)));
   Append(poi_, "r");
 }
 
+void WorkspaceGenerator::AddLumiScale(){
+  if(print_level_ >= PrintLevel::everything) DBG("");
+  //Constant unless set explicitly, e.g. with combine's --setPhysicsModelParameters, to project
+  //the MC yields, background normalizations and dilepton uncertainties to another luminosity.
+  //The observed counts and data_obs stay at the generated luminosity, so this only serves
+  //expected (Asimov, -t -1) results.
+  MakeVar("lumi_scale", 1.);
+}
+
 void WorkspaceGenerator::ReadSystematicsFile(){
+  free_systematics_.clear();
   if(systematics_file_ == "") return;
   ifstream file(systematics_file_);
-  vector<string> lines;
-  string one_line;
-  while(getline(file, one_line)){
-    CleanLine(one_line);
-    if(one_line != ""){
-      lines.push_back(one_line);
+  ostringstream contents;
+  if(file.peek() != ifstream::traits_type::eof()) contents << file.rdbuf();
+
+  auto all_prc = backgrounds_;
+  Append(all_prc, signal_);
+  vector<string> bin_names, process_names;
+  for(const auto &block: blocks_){
+    for(const auto &vbin: block.Bins()){
+      for(const auto &bin: vbin){
+        bin_names.push_back(bin.Name());
+      }
     }
   }
-
-  vector<vector<string> > words;
-  for(const auto &line: lines){
-    vector<string> these_words = Tokenize(line);
-    words.push_back(these_words);
+  for(const auto &prc: all_prc){
+    process_names.push_back(prc.Name());
+  }
+  auto index = make_shared<const FreeSystematic::Index>(bin_names, process_names);
+
+  //Parsed tables are kept in the yield cache directory, if any, keyed by the file contents
+  //and the bins and processes they apply to
+  bool use_cache = cache_systematics_ && YieldManager::CacheDirectory() != "";
+  string cache_path = YieldManager::CacheDirectory()+"/systematics_"
+    +HexString(HashString(contents.str()+index->Description()))+".syst";
+  vector<FreeSystematic> systs;
+  if(!use_cache || !FreeSystematic::ReadCache(cache_path, contents.str(), index, systs)){
+    systs = ParseSystematics(contents.str(), index, all_prc);
+    if(use_cache){
+      try{
+        FreeSystematic::WriteCache(cache_path, contents.str(), *index, systs);
+      }catch(const exception &e){
+        DBG("Could not cache systematics in " << cache_path << ": " << e.what());
+      }
+    }
+  }
+  for(const auto &syst: systs){
+    Append(free_systematics_, syst);
   }
+}
 
-  auto all_prc = backgrounds_;
-  Append(all_prc, signal_);
-  string syst_name;
-  auto process_list = all_prc;
-  process_list.clear();
+vector<FreeSystematic> WorkspaceGenerator::ParseSystematics(const string &contents,
+                                                            const shared_ptr<const FreeSystematic::Index> &index,
+                                                            const set<Process> &all_prc) const{
+  vector<const Process*> processes;
+  for(const auto &prc: all_prc){
+    processes.push_back(&prc);
+  }
+  vector<size_t> process_list;
 
-  free_systematics_.clear();
-  FreeSystematic this_systematic("BADBADBADBADBADBADBADBADBAD");
+  vector<FreeSystematic> systs;
+  FreeSystematic this_systematic("BADBADBADBADBADBADBADBADBAD", index);
   bool ready = false;
-  for(const auto &line: words){
+  istringstream stream(contents);
+  string one_line;
+  while(getline(stream, one_line)){
+    CleanLine(one_line);
+    if(one_line == "") continue;
+    vector<string> line = Tokenize(one_line);
     if(line.size() < 2){
       string out;
       for(const auto &word: line) out += word;
@@ -361,9 +691,9 @@ void WorkspaceGenerator::ReadSystematicsFile(){
     }
     if(line.at(0) == "SYSTEMATIC"){
       if(ready){
-        Append(free_systematics_, this_systematic);
+        systs.push_back(this_systematic);
       }
-      this_systematic = FreeSystematic(line.at(1));
+      this_systematic = FreeSystematic(line.at(1), index);
       ready = true;
     }else if(line[0] == "PROCESSES"){
       process_list.clear();
@@ -371,11 +701,10 @@ void WorkspaceGenerator::ReadSystematicsFile(){
         bool found = false;
         vector<string> names = Tokenize(line.at(iword), ", ");
         for(const auto &name: names){
-          for(const auto &prc: all_prc){
-            if(name == prc.Name()){
-              Append(process_list, prc);
-              found = true;
-            }
+          size_t iprc;
+          if(index->FindProcess(name, iprc)){
+            process_list.push_back(iprc);
+            found = true;
           }
           if(!found){
             ERROR("Systematic "+this_systematic.Name()
@@ -384,47 +713,39 @@ void WorkspaceGenerator::ReadSystematicsFile(){
         }
       }
     }else{
-      bool found = false;
       string clean_line(line.at(0));
       ReplaceAll(clean_line, " ", "");
       ReplaceAll(clean_line, "\t", "");
-      for(const auto &block: blocks_){
-        for(const auto &vbin: block.Bins()){
-          for(const auto &bin: vbin){
-            if(bin.Name() != clean_line) continue;
-            for(const auto &prc: process_list){
-              float syst(atof(line.at(1).c_str()));
-              if(isnan(syst)){
-                DBG("Systematic " << this_systematic.Name() << " is NaN for bin "
-                  << bin.Name() << ", process " << prc.Name());
-                syst = 0.;
-              }
-              if(isinf(syst)){
-                DBG("Systematic " << this_systematic.Name() << " is infinite for bin "
-                  << bin.Name() << ", process " << prc.Name());
-                if(syst>0.){
-                  syst = 1.;
-                }else{
-                  syst = -1.;
-                }
-              }
-              if(syst>=0) this_systematic.Strength(bin, prc) = log(1+syst);
-              else this_systematic.Strength(bin, prc) = -log(1+fabs(syst));
-              found = true;
-            }
-
-          }
-        }
-      }
-      if(!found){
+      size_t ibin;
+      if(process_list.size() == 0 || !index->FindBin(clean_line, ibin)){
         ERROR("Systematic "+this_systematic.Name()
                             +" could not be applied to bin "+line.at(0));
       }
+      for(const auto &iprc: process_list){
+        float syst(atof(line.at(1).c_str()));
+        if(isnan(syst)){
+          DBG("Systematic " << this_systematic.Name() << " is NaN for bin "
+              << clean_line << ", process " << processes.at(iprc)->Name());
+          syst = 0.;
+        }
+        if(isinf(syst)){
+          DBG("Systematic " << this_systematic.Name() << " is infinite for bin "
+              << clean_line << ", process " << processes.at(iprc)->Name());
+          if(syst>0.){
+            syst = 1.;
+          }else{
+            syst = -1.;
+          }
+        }
+        if(syst>=0) this_systematic.Strength(ibin, iprc) = log(1+syst);
+        else this_systematic.Strength(ibin, iprc) = -log(1+fabs(syst));
+      }
     }
   }
   if(ready){
-    Append(free_systematics_, this_systematic);
+    systs.push_back(this_systematic);
   }
+  return systs;
 }
 
 void WorkspaceGenerator::CleanLine(string &line){
@@ -445,6 +766,26 @@ void WorkspaceGenerator::CleanLine(string &line){
 void WorkspaceGenerator::AddDileptonSystematic(){
   if(print_level_ >= PrintLevel::everything) DBG("");
 
+  vector<YieldKey> keys;
+  for(const auto &block: blocks_){
+    for(const auto &vbin: block.Bins()){
+      for(const auto &bin: vbin){
+        if(!NeedsDileptonBin(bin)) continue;
+        Bin dilep_bin = bin;
+        Cut dilep_baseline = baseline_;
+        MakeDileptonBin(bin, dilep_bin, dilep_baseline);
+        if(dilep_bin.Blind()){
+          for(const auto &bkg: backgrounds_){
+            keys.push_back(YieldKey(dilep_bin, bkg, dilep_baseline));
+          }
+        }else{
+          keys.push_back(YieldKey(dilep_bin, data_, dilep_baseline));
+        }
+      }
+    }
+  }
+  yields_->PrefetchYields(keys);
+
   set<Block> new_blocks;
   for(const auto &block: blocks_){
     Block new_block = block;
@@ -524,14 +865,8 @@ void WorkspaceGenerator::AddSystematicsGenerators(){
       for(const auto &bin: vbin){
         for(const auto &syst: bin.Systematics()){
           AddSystematicGenerator(syst.Name());
-          string full_name = syst.Name()+"_BLK_"+block.Name()+"_BIN_"+bin.Name();
-          ostringstream oss;
-          oss << "strength_" << full_name << "[" << syst.Strength() << "]" << flush;
-          w_.factory(oss.str().c_str());
-          oss.str("");
-          oss << "expr::" << full_name
-              << "('exp(@0*@1)',strength_" << full_name << "," << syst.Name() << ")" << flush;
-          w_.factory(oss.str().c_str());
+          AddSystematicFactor(syst.Name()+"_BLK_"+block.Name()+"_BIN_"+bin.Name(),
+                              syst.Name(), syst.Strength());
         }
       }
     }
@@ -542,14 +877,7 @@ void WorkspaceGenerator::AddSystematicsGenerators(){
   for(const auto &bkg: all_prcs){
     for(const auto &syst: bkg.Systematics()){
       AddSystematicGenerator(syst.Name());
-      string full_name = syst.Name()+"_PRC_"+bkg.Name();
-      ostringstream oss;
-      oss << "strength_" << full_name << "[" << syst.Strength() << "]" << flush;
-      w_.factory(oss.str().c_str());
-      oss.str("");
-      oss << "expr::" << full_name
-          << "('exp(@0*@1)',strength_" << full_name << "," << syst.Name() << ")" << flush;
-      w_.factory(oss.str().c_str());
+      AddSystematicFactor(syst.Name()+"_PRC_"+bkg.Name(), syst.Name(), syst.Strength());
     }
   }
 
@@ -560,14 +888,8 @@ void WorkspaceGenerator::AddSystematicsGenerators(){
         for(const auto &bin: vbin){
           for(const auto &prc: all_prcs){
             if(!syst.HasEntry(bin, prc)) continue;
-            string full_name = syst.Name()+"_BIN_"+bin.Name()+"_PRC_"+prc.Name();
-            ostringstream oss;
-            oss << "strength_" << full_name << "[" << syst.Strength(bin, prc) << "]" << flush;
-            w_.factory(oss.str().c_str());
-            oss.str("");
-            oss << "expr::" << full_name
-                << "('exp(@0*@1)',strength_" << full_name << "," << syst.Name() << ")" << flush;
-            w_.factory(oss.str().c_str());
+            AddSystematicFactor(syst.Name()+"_BIN_"+bin.Name()+"_PRC_"+prc.Name(),
+                                syst.Name(), syst.Strength(bin, prc));
           }
         }
       }
@@ -575,16 +897,28 @@ void WorkspaceGenerator::AddSystematicsGenerators(){
   }
 }
 
+void WorkspaceGenerator::AddSystematicFactor(const string &full_name,
+                                             const string &name,
+                                             double strength){
+  RooRealVar &strength_var = MakeVar("strength_"+full_name, strength);
+  if(do_lumi_scale_ && Contains(name, "dilep")){
+    //Dilepton uncertainties come from the size of the dilepton sample, so they shrink as
+    //1/sqrt(luminosity)
+    MakeFormula(full_name, "exp(@0*@1/sqrt(@2))",
+                RooArgList(strength_var, Staged(name), Staged("lumi_scale")));
+  }else{
+    MakeFormula(full_name, "exp(@0*@1)", RooArgList(strength_var, Staged(name)));
+  }
+}
+
 void WorkspaceGenerator::AddSystematicGenerator(const string &name){
   if(print_level_ >= PrintLevel::everything) DBG(name);
   if(systematics_.find(name) != systematics_.end()) return;
-  ostringstream oss;
-  oss.str("");
-  oss << name << "_0" << flush;
-  Append(glob_observables_, oss.str());
-  oss << "[0.]" << flush;
-  w_.factory(oss.str().c_str());
-  w_.factory(("RooGaussian::constraint_"+name+"("+name+"[0.,-10.,10.],"+name+"_0,1.)").c_str());
+  Append(glob_observables_, name+"_0");
+  RooRealVar &global = MakeVar(name+"_0", 0.);
+  RooRealVar &nuisance = MakeVar(name, 0., -10., 10.);
+  string pdf_name = "constraint_"+name;
+  Stage(new RooGaussian(pdf_name.c_str(), pdf_name.c_str(), nuisance, global, RooFit::RooConst(1.)));
   Append(nuisances_, name);
   Append(systematics_, name);
 }
@@ -593,42 +927,43 @@ void WorkspaceGenerator::AddData(const Block &block){
   if(print_level_ >= PrintLevel::everything) DBG(block);
   for(const auto &vbin: block.Bins()){
     for(const auto &bin: vbin){
-      GammaParams gps(0., 0.);
-      if(bin.Blind()){
-        for(const auto &bkg: backgrounds_){
-          gps += GetYield(bin, bkg);
-        }
-        // Injecting signal
-        if(inject_other_signal_){
-          gps += sig_strength_*GetYield(bin, injection_);
-        }else{
-          gps += sig_strength_*GetYield(bin, signal_);
-        }
-      }else{
-        gps = GetYield(bin, data_);
-      }
-
-      ostringstream oss;
-      oss << "nobs_BLK_" << block.Name()
-          << "_BIN_" << bin.Name() << flush;
+      GammaParams gps = ObservedYield(bin);
+      string name = "nobs_BLK_"+block.Name()+"_BIN_"+bin.Name();
       if(use_r4_ || !Contains(bin.Name(), "4")){
-        Append(observables_, oss.str());
+        Append(observables_, name);
       } //attn
-      oss << "[" << gps.Yield() << "]" << flush;
-      w_.factory(oss.str().c_str());
+      MakeVar(name, gps.Yield());
+    }
+  }
+}
+
+GammaParams WorkspaceGenerator::ObservedYield(const Bin &bin) const{
+  GammaParams gps(0., 0.);
+  if(bin.Blind()){
+    for(const auto &bkg: backgrounds_){
+      gps += GetYield(bin, bkg);
+    }
+    // Injecting signal
+    if(inject_other_signal_){
+      gps += sig_strength_*GetYield(bin, injection_);
+    }else{
+      gps += sig_strength_*GetYield(bin, signal_);
     }
+  }else{
+    gps = GetYield(bin, data_);
   }
+  return gps;
 }
 
 void WorkspaceGenerator::AddBackgroundFractions(const Block &block){
   if(print_level_ >= PrintLevel::everything) DBG(block);
   for(const auto &vbin: block.Bins()){
     for(const auto &bin: vbin){
+      string bb_name = "BLK_"+block.Name()+"_BIN_"+bin.Name();
       for(const auto &bkg: backgrounds_){
-        string var = "expr::frac_BIN_"+bin.Name()+"_PRC_"+bkg.Name()
-          +"('@0/@1',ymc_BLK_"+block.Name()+"_BIN_"+bin.Name()+"_PRC_"+bkg.Name()
-          +",ymc_BLK_"+block.Name()+"_BIN_"+bin.Name()+")";
-        w_.factory(var.c_str());
+        MakeFormula("frac_BIN_"+bin.Name()+"_PRC_"+bkg.Name(), "@0/@1",
+                    RooArgList(Staged("ymc_"+bb_name+"_PRC_"+bkg.Name()),
+                               Staged("ymc_"+bb_name)));
       }
     }
   }
@@ -636,98 +971,79 @@ void WorkspaceGenerator::AddBackgroundFractions(const Block &block){
 
 void WorkspaceGenerator::AddABCDParameters(const Block &block){
   if(print_level_ >= PrintLevel::everything) DBG(block);
-  BlockYields by(block, backgrounds_, baseline_, yields_);
+  BlockYields by(block, backgrounds_, baseline_, *yields_, luminosity_);
 
-  ostringstream rxss, ryss;
-  rxss << "sum::rxnorm_BLK_" << block.Name() << "(1.,";
-  ryss << "sum::rynorm_BLK_" << block.Name() << "(1.,";
+  RooArgList rx_terms(RooFit::RooConst(1.)), ry_terms(RooFit::RooConst(1.));
+  // Append(nuisances_, "norm_BLK_"+block.Name());
+  RooRealVar &norm = MakeVar("norm_BLK_"+block.Name(), max(1., 0.8*by.Total().Yield()),
+                             0., max(5.*by.Total().Yield(), 20.));
   ostringstream oss;
-  oss << "norm_BLK_" << block.Name() << flush;
-  // Append(nuisances_, oss.str());
-  oss << "[" << max(1., 0.8*by.Total().Yield()) << ",0.,"
-      << max(5.*by.Total().Yield(), 20.) << "]" << flush;
-  w_.factory(oss.str().c_str());
   for(size_t irow = 0; irow < by.RowSums().size(); ++irow){
     if(irow == by.MaxRow()) continue;
     oss.str("");
     oss << "ry" << (irow+1) << (by.MaxRow()+1) << "_BLK_" << block.Name() << flush;
-    ryss << "," << oss.str();
     // Append(nuisances_, oss.str());
-    oss << "[" << by.RowSums().at(irow).Yield()/by.RowSums().at(by.MaxRow()).Yield()
-        << ",0.,10.]" << flush;
-    w_.factory(oss.str().c_str());
+    ry_terms.add(MakeVar(oss.str(),
+                         by.RowSums().at(irow).Yield()/by.RowSums().at(by.MaxRow()).Yield(),
+                         0., 10.));
   }
-  ryss << ")" << flush;
-  w_.factory(ryss.str().c_str());
+  RooAbsReal &rynorm = MakeSum("rynorm_BLK_"+block.Name(), ry_terms);
   for(size_t icol = 0; icol < by.ColSums().size(); ++icol){
     if(icol == by.MaxCol()) continue;
     oss.str("");
     oss << "rx" << (icol+1) << (by.MaxCol()+1) << "_BLK_" << block.Name() << flush;
-    rxss << "," << oss.str();
     // Append(nuisances_, oss.str()); /
-    oss << "[" << by.ColSums().at(icol).Yield()/by.ColSums().at(by.MaxCol()).Yield()
-        << ",0.,10.]" << flush;
-    w_.factory(oss.str().c_str());
-  }
-  rxss << ")" << flush;
-  w_.factory(rxss.str().c_str());
-  oss.str("");
-  oss << "prod::rnorm_BLK_" << block.Name()
-      << "(rxnorm_BLK_" << block.Name()
-      << ",rynorm_BLK_" << block.Name() << ")" << flush;
-  w_.factory(oss.str().c_str());
-  oss.str("");
-  oss << "expr::rscale_BLK_" << block.Name()
-      << "('@0/@1',norm_BLK_" << block.Name()
-      << ",rnorm_BLK_" << block.Name() << ")" << flush;
-  w_.factory(oss.str().c_str());
+    rx_terms.add(MakeVar(oss.str(),
+                         by.ColSums().at(icol).Yield()/by.ColSums().at(by.MaxCol()).Yield(),
+                         0., 10.));
+  }
+  RooAbsReal &rxnorm = MakeSum("rxnorm_BLK_"+block.Name(), rx_terms);
+  RooAbsReal &rnorm = MakeProduct("rnorm_BLK_"+block.Name(), RooArgList(rxnorm, rynorm));
+  if(do_lumi_scale_){
+    MakeFormula("rscale_BLK_"+block.Name(), "(@0*@1)/@2",
+                RooArgList(Staged("lumi_scale"), norm, rnorm));
+  }else{
+    MakeFormula("rscale_BLK_"+block.Name(), "@0/@1", RooArgList(norm, rnorm));
+  }
 }
 
 void WorkspaceGenerator::AddRawBackgroundPredictions(const Block &block){
   if(print_level_ >= PrintLevel::everything) DBG(block);
-  BlockYields by(block, backgrounds_, baseline_, yields_);
+  BlockYields by(block, backgrounds_, baseline_, *yields_, luminosity_);
   size_t max_row = by.MaxRow();
   size_t max_col = by.MaxCol();
+  RooAbsReal &rscale = Staged("rscale_BLK_"+block.Name());
   for(size_t irow = 0; irow < block.Bins().size(); ++irow){
     for(size_t icol = 0; icol < block.Bins().at(irow).size(); ++icol){
       const Bin &bin = block.Bins().at(irow).at(icol);
       string bb_name = "BLK_"+block.Name()+"_BIN_"+bin.Name();
-      vector<string> prod_list;
+      RooArgList rates;
       for(const auto &bkg: backgrounds_){
-        string prod_name = "rate_"+bb_name+"_PRC_"+bkg.Name();
-        Append(prod_list, prod_name);
-        string factory_string = "prod::"+prod_name+"(rscale_BLK_"+block.Name();
+        RooArgList factors(rscale);
         if(icol != max_col){
           ostringstream oss;
-          oss << ",rx" << (icol+1) << (max_col+1) << "_BLK_" << block.Name() << flush;
-          factory_string += oss.str();
+          oss << "rx" << (icol+1) << (max_col+1) << "_BLK_" << block.Name() << flush;
+          factors.add(Staged(oss.str()));
         }
         if(irow != max_row){
           ostringstream oss;
-          oss << ",ry" << (irow+1) << (max_row+1) << "_BLK_" << block.Name() << flush;
-          factory_string += oss.str();
+          oss << "ry" << (irow+1) << (max_row+1) << "_BLK_" << block.Name() << flush;
+          factors.add(Staged(oss.str()));
         }
-        factory_string += (",frac_BIN_"+bin.Name()+"_PRC_"+bkg.Name());
+        factors.add(Staged("frac_BIN_"+bin.Name()+"_PRC_"+bkg.Name()));
         if(do_systematics_){
           for(const auto &syst: bkg.Systematics()){
-            factory_string += (","+syst.Name()+"_PRC_"+bkg.Name());
+            factors.add(Staged(syst.Name()+"_PRC_"+bkg.Name()));
           }
           for(const auto &syst: free_systematics_){
             if(syst.HasEntry(bin, bkg)){
-              factory_string += (","+syst.Name()+"_BIN_"+bin.Name()+"_PRC_"+bkg.Name());
+              factors.add(Staged(syst.Name()+"_BIN_"+bin.Name()+"_PRC_"+bkg.Name()));
             }
           }
         }
-        factory_string += ")";
-        w_.factory(factory_string.c_str());
-      }
-      string factory_string="sum::nbkg_raw_"+bb_name+"(";
-      for(auto prod = prod_list.cbegin(); prod != prod_list.cend(); ++prod){
-        if(prod != prod_list.cbegin()) factory_string += ",";
-        factory_string += *prod;
+        rates.add(MakeProduct("rate_"+bb_name+"_PRC_"+bkg.Name(), factors));
       }
-      factory_string += ")";
-      w_.factory(factory_string.c_str());
+      MakeSum("nbkg_raw_"+bb_name, rates);
     }
   }
 }
@@ -746,77 +1062,59 @@ void WorkspaceGenerator::AddMCYields(const Block & block){
   for(const auto &vbin: block.Bins()){
     for(const auto &bin: vbin){
       string bb_name = "BLK_"+block.Name()+"_BIN_"+bin.Name();
-      ostringstream oss;
       auto all_prcs = backgrounds_;
       Append(all_prcs, signal_);
       for(const auto &bkg: all_prcs){
-        GammaParams gp = GetYield(bin, bkg);
-        if(Contains(bkg.Name(), "sig")) gp *= sig_xsec_f_;
+        GammaParams gp = MCYield(bin, bkg);
         string bbp_name = bb_name + "_PRC_"+bkg.Name();
-        oss.str("");
-        oss << "nobsmc_" << bbp_name << flush;
-        Append(glob_observables_, oss.str());
-        oss << "[" << gp.NEffective() << "]" << flush;
-        w_.factory(oss.str().c_str());
-        oss.str("");
-        oss << "nmc_" << bbp_name << flush;
-        Append(nuisances_, oss.str());
-        oss << "[" << gp.NEffective()
-            << ",0.," << max(5.*gp.NEffective(), 20.) << "]" << flush;
-        w_.factory(oss.str().c_str());
-        oss.str("");
-        oss << "wmc_" << bbp_name << "[" << gp.Weight() << "]" << flush;
-        w_.factory(oss.str().c_str());
-        oss.str("");
-        oss << "prod::ymc_" << bbp_name
-            << "(nmc_" << bbp_name
-            << ",wmc_" << bbp_name << ")" << flush;
-        w_.factory(oss.str().c_str());
+        Append(glob_observables_, "nobsmc_"+bbp_name);
+        MakeVar("nobsmc_"+bbp_name, gp.NEffective());
+        Append(nuisances_, "nmc_"+bbp_name);
+        RooRealVar &nmc = MakeVar("nmc_"+bbp_name, gp.NEffective(),
+                                  0., max(5.*gp.NEffective(), 20.));
+        RooRealVar &wmc = MakeVar("wmc_"+bbp_name, gp.Weight());
+        if(do_lumi_scale_){
+          MakeProduct("ymc_"+bbp_name, RooArgList(nmc, wmc, Staged("lumi_scale")));
+        }else{
+          MakeProduct("ymc_"+bbp_name, RooArgList(nmc, wmc));
+        }
       }
-      oss.str("");
     }
   }
 }
 
+GammaParams WorkspaceGenerator::MCYield(const Bin &bin, const Process &process) const{
+  GammaParams gp = GetYield(bin, process);
+  if(Contains(process.Name(), "sig")) gp *= sig_xsec_f_;
+  return gp;
+}
+
 void WorkspaceGenerator::AddMCPdfs(const Block &block){
   if(print_level_ >= PrintLevel::everything) DBG(block);
-  bool first = true;
-  string factory_string = "PROD::pdf_mc_"+block.Name()+"(";
+  RooArgList pdfs;
   for(const auto &vbin: block.Bins()){
     for(const auto &bin: vbin){
       auto all_prcs = backgrounds_;
       Append(all_prcs, signal_);
       for(const auto &bkg: all_prcs){
         string bbp_name = "BLK_"+block.Name()+"_BIN_"+bin.Name()+"_PRC_"+bkg.Name();
-        AddPoisson("pdf_mc_"+bbp_name, "nobsmc_"+bbp_name, "nmc_"+bbp_name, gaus_approx_);
-        if(first) first = false;
-        else factory_string += ",";
-        factory_string += "pdf_mc_"+bbp_name;
+        pdfs.add(AddPoisson("pdf_mc_"+bbp_name, "nobsmc_"+bbp_name, "nmc_"+bbp_name, gaus_approx_));
       }
     }
   }
-  factory_string += ")";
-  w_.factory(factory_string.c_str());
+  MakeProdPdf("pdf_mc_"+block.Name(), pdfs);
 }
 
 void WorkspaceGenerator::AddMCProcessSums(const Block &block){
   if(print_level_ >= PrintLevel::everything) DBG(block);
   for(const auto &vbin: block.Bins()){
     for(const auto &bin: vbin){
-      ostringstream oss;
       string bb_name = "BLK_"+block.Name()+"_BIN_"+bin.Name();
-      oss << "sum::ymc_" << bb_name << "(";
-      if(backgrounds_.size() > 0){
-        auto bkg = backgrounds_.cbegin();
-        string name = "ymc_"+bb_name+"_PRC_"+bkg->Name();
-        oss << name;
-        for(++bkg; bkg != backgrounds_.cend(); ++bkg){
-          name = "ymc_"+bb_name+"_PRC_"+bkg->Name();
-          oss << "," << name;
-        }
+      RooArgList terms;
+      for(const auto &bkg: backgrounds_){
+        terms.add(Staged("ymc_"+bb_name+"_PRC_"+bkg.Name()));
       }
-      oss << ")" << flush;
-      w_.factory(oss.str().c_str());
+      MakeSum("ymc_"+bb_name, terms);
     }
   }
 }
@@ -824,15 +1122,11 @@ void WorkspaceGenerator::AddMCProcessSums(const Block &block){
 void WorkspaceGenerator::AddMCRowSums(const Block &block){
   if(print_level_ >= PrintLevel::everything) DBG(block);
   for(size_t irow = 0; irow < block.Bins().size(); ++irow){
-    ostringstream oss;
-    oss << "sum::rowmc" << (irow+1) << "_BLK_" << block.Name() << "(";
-    auto bin = block.Bins().at(irow).cbegin();
-    oss << "ymc_BLK_" << block.Name() << "_BIN_" << bin->Name();
-    for(++bin; bin != block.Bins().at(irow).cend(); ++bin){
-      oss << ",ymc_BLK_" << block.Name() << "_BIN_" << bin->Name();
+    RooArgList terms;
+    for(const auto &bin: block.Bins().at(irow)){
+      terms.add(Staged("ymc_BLK_"+block.Name()+"_BIN_"+bin.Name()));
     }
-    oss << ")" << flush;
-    w_.factory(oss.str().c_str());
+    MakeSum("rowmc"+to_string(irow+1)+"_BLK_"+block.Name(), terms);
   }
 }
 
@@ -840,46 +1134,35 @@ void WorkspaceGenerator::AddMCColSums(const Block &block){
   if(print_level_ >= PrintLevel::everything) DBG(block);
   if(block.Bins().size() > 0 && block.Bins().at(0).size() > 0){
     for(size_t icol = 0; icol < block.Bins().at(0).size(); ++icol){
-      ostringstream oss;
-      oss << "sum::colmc" << (icol+1) << "_BLK_" << block.Name() << "(";
-      size_t irow = 0;
-      oss << "ymc_BLK_" << block.Name() << "_BIN_" << block.Bins().at(irow).at(icol).Name();
-      for(irow = 1; irow < block.Bins().size(); ++irow){
+      RooArgList terms;
+      for(size_t irow = 0; irow < block.Bins().size(); ++irow){
         if(icol < block.Bins().at(irow).size()){
-          oss << ",ymc_BLK_" << block.Name() << "_BIN_" << block.Bins().at(irow).at(icol).Name();
+          terms.add(Staged("ymc_BLK_"+block.Name()+"_BIN_"+block.Bins().at(irow).at(icol).Name()));
         }
       }
-      oss << ")" << flush;;
-      w_.factory(oss.str().c_str());
+      MakeSum("colmc"+to_string(icol+1)+"_BLK_"+block.Name(), terms);
     }
   }
 }
 
 void WorkspaceGenerator::AddMCTotal(const Block &block){
   if(print_level_ >= PrintLevel::everything) DBG(block);
-  ostringstream oss;
-  oss << "sum::totmc_BLK_" << block.Name() << "(";
-  if(block.Bins().size() > 0){
-    oss << "rowmc1_BLK_" << block.Name();
-    for(size_t irow = 1; irow < block.Bins().size(); ++irow){
-      oss << ",rowmc" << (irow+1) << "_BLK_" << block.Name();
-    }
+  RooArgList terms;
+  for(size_t irow = 0; irow < block.Bins().size(); ++irow){
+    terms.add(Staged("rowmc"+to_string(irow+1)+"_BLK_"+block.Name()));
   }
-  oss << ")" << flush;
-  w_.factory(oss.str().c_str());
+  MakeSum("totmc_BLK_"+block.Name(), terms);
 }
 
 void WorkspaceGenerator::AddMCPrediction(const Block &block){
   if(print_level_ >= PrintLevel::everything) DBG(block);
+  RooAbsReal &total = Staged("totmc_BLK_"+block.Name());
   for(size_t irow = 0; irow < block.Bins().size(); ++irow){
+    RooAbsReal &row = Staged("rowmc"+to_string(irow+1)+"_BLK_"+block.Name());
     for(size_t icol = 0; icol < block.Bins().at(irow).size(); ++icol){
       const Bin &bin = block.Bins().at(irow).at(icol);
-      ostringstream oss;
-      oss << "expr::predmc_BLK_" << block.Name() << "_BIN_" << bin.Name() << "("
-          << "'(@0*@1)/@2',rowmc" << (irow+1) << "_BLK_" << block.Name()
-          << ",colmc" << (icol+1) << "_BLK_" << block.Name()
-          << ",totmc_BLK_" << block.Name() << ")" << flush;
-      w_.factory(oss.str().c_str());
+      MakeFormula("predmc_BLK_"+block.Name()+"_BIN_"+bin.Name(), "(@0*@1)/@2",
+                  RooArgList(row, Staged("colmc"+to_string(icol+1)+"_BLK_"+block.Name()), total));
     }
   }
 }
@@ -890,12 +1173,8 @@ void WorkspaceGenerator::AddMCKappa(const Block &block){
     for(size_t icol = 0; icol < block.Bins().at(irow).size(); ++icol){
       const Bin &bin = block.Bins().at(irow).at(icol);
       string bb_name = "BLK_"+block.Name()+"_BIN_"+bin.Name();
-      ostringstream oss;
-      oss << "expr::kappamc_" << bb_name << "("
-          << "'@0/@1',ymc_" << bb_name
-          << ",predmc_" << bb_name
-          << ")" << flush;
-      w_.factory(oss.str().c_str());
+      MakeFormula("kappamc_"+bb_name, "@0/@1",
+                  RooArgList(Staged("ymc_"+bb_name), Staged("predmc_"+bb_name)));
     }
   }
 }
@@ -905,82 +1184,63 @@ void WorkspaceGenerator::AddFullBackgroundPredictions(const Block &block){
   for(const auto &vbin: block.Bins()){
     for(const auto &bin: vbin){
       string bb_name = "BLK_"+block.Name()+"_BIN_"+bin.Name();
-      ostringstream oss;
-      oss << "prod::nbkg_" << bb_name << "("
-          << "nbkg_raw_" << bb_name;
+      RooArgList factors(Staged("nbkg_raw_"+bb_name));
       for(const auto &syst: bin.Systematics()){
         if(do_systematics_ && syst.Name().substr(0,6) != "dilep_"){
-          oss << "," << syst.Name() << "_" << bb_name;
+          factors.add(Staged(syst.Name()+"_"+bb_name));
         }
       }
       if(do_systematics_){
         for(const auto &prc: backgrounds_){
           for(const auto &syst: prc.Systematics()){
-            oss << "," << syst.Name() << "_BIN_" << bin.Name() << "_PRC_" << prc.Name();
+            factors.add(Staged(syst.Name()+"_BIN_"+bin.Name()+"_PRC_"+prc.Name()));
           }
         }
       }
       if(do_mc_kappa_correction_){
-        oss << ",kappamc_" << bb_name;
+        factors.add(Staged("kappamc_"+bb_name));
       }
-      oss << ")" << flush;
-      w_.factory(oss.str().c_str());
+      MakeProduct("nbkg_"+bb_name, factors);
     }
   }
 }
 
 void WorkspaceGenerator::AddSignalPredictions(const Block &block){
   if(print_level_ >= PrintLevel::everything) DBG(block);
+  RooAbsReal &r = Staged("r");
   for(const auto &vbin: block.Bins()){
     for(const auto &bin: vbin){
-      ostringstream oss;
-      oss.str("");
-      oss << "prod::nsig_BLK_" << block.Name()
-          << "_BIN_" << bin.Name()
-          << "(r,"
-          << "ymc_BLK_" << block.Name()
-          << "_BIN_" << bin.Name()
-          << "_PRC_" << signal_.Name();
+      string bb_name = "BLK_"+block.Name()+"_BIN_"+bin.Name();
+      RooArgList factors(r, Staged("ymc_"+bb_name+"_PRC_"+signal_.Name()));
       if(do_systematics_){
         for(const auto &syst: signal_.Systematics()){
-          oss << "," << syst.Name() << "_BIN_" << bin.Name() << "_PRC_" << signal_.Name();
+          factors.add(Staged(syst.Name()+"_BIN_"+bin.Name()+"_PRC_"+signal_.Name()));
         }
         for(const auto &syst: free_systematics_){
           if(!syst.HasEntry(bin, signal_)) continue;
-          oss << "," << syst.Name() << "_BIN_" << bin.Name() << "_PRC_" << signal_.Name();
+          factors.add(Staged(syst.Name()+"_BIN_"+bin.Name()+"_PRC_"+signal_.Name()));
         }
       }
-      oss << ")" << flush;
-      w_.factory(oss.str().c_str());
+      MakeProduct("nsig_"+bb_name, factors);
     }
   }
 }
 
 void WorkspaceGenerator::AddPdfs(const Block &block){
   if(print_level_ >= PrintLevel::everything) DBG(block);
-  string null_list = "", alt_list = "";
-  bool is_first = true;
+  RooArgList null_pdfs, alt_pdfs;
   for(const auto &vbin: block.Bins()){
     for(const auto &bin: vbin){
-      if(!is_first){
-        null_list += ",";
-        alt_list += ",";
-      }
       string bb_name = "_BLK_"+block.Name() +"_BIN_"+bin.Name();
-      string null_name = "pdf_null"+bb_name;
-      string alt_name = "pdf_alt"+bb_name;
-      w_.factory(("sum::nexp"+bb_name+"(nbkg"+bb_name+",nsig"+bb_name+")").c_str());
+      MakeSum("nexp"+bb_name, RooArgList(Staged("nbkg"+bb_name), Staged("nsig"+bb_name)));
       if(use_r4_ || !Contains(bb_name, "4")){
-        null_list += null_name;
-        alt_list += alt_name;
-        AddPoisson("pdf_null"+bb_name, "nobs"+bb_name, "nbkg"+bb_name, false);
-        AddPoisson("pdf_alt"+bb_name, "nobs"+bb_name, "nexp"+bb_name, false);
-        is_first = false;
+        null_pdfs.add(AddPoisson("pdf_null"+bb_name, "nobs"+bb_name, "nbkg"+bb_name, false));
+        alt_pdfs.add(AddPoisson("pdf_alt"+bb_name, "nobs"+bb_name, "nexp"+bb_name, false));
       }
     }
   }
-  w_.factory(("PROD:pdf_null_BLK_"+block.Name()+"("+null_list+")").c_str());
-  w_.factory(("PROD:pdf_alt_BLK_"+block.Name()+"("+alt_list+")").c_str());
+  MakeProdPdf("pdf_null_BLK_"+block.Name(), null_pdfs);
+  MakeProdPdf("pdf_alt_BLK_"+block.Name(), alt_pdfs);
 }
 
 void WorkspaceGenerator::AddDebug(const Block &block){
@@ -992,39 +1252,42 @@ void WorkspaceGenerator::AddDebug(const Block &block){
       const auto &r2 = "BLK_"+block.Name()+"_BIN_"+bins.at(0).at(ix).Name();
       const auto &r3 = "BLK_"+block.Name()+"_BIN_"+bins.at(iy).at(0).Name();
       const auto &r4 = "BLK_"+block.Name()+"_BIN_"+bins.at(iy).at(ix).Name();
-      w_.factory(("expr::syskappa_"+r4+"('(@0*@1)/(@2*@3)',nbkg_"+r4+",nbkg_"+r1+",nbkg_"+r2+",nbkg_"+r3+")").c_str());
-      w_.factory(("expr::nosyskappa_"+r4+"('(@0*@1)/(@2*@3)',ymc_"+r4+",ymc_"+r1+",ymc_"+r2+",ymc_"+r3+")").c_str());
+      MakeFormula("syskappa_"+r4, "(@0*@1)/(@2*@3)",
+                  RooArgList(Staged("nbkg_"+r4), Staged("nbkg_"+r1),
+                             Staged("nbkg_"+r2), Staged("nbkg_"+r3)));
+      MakeFormula("nosyskappa_"+r4, "(@0*@1)/(@2*@3)",
+                  RooArgList(Staged("ymc_"+r4), Staged("ymc_"+r1),
+                             Staged("ymc_"+r2), Staged("ymc_"+r3)));
     }
   }
 }
 
 void WorkspaceGenerator::AddDummyNuisance(){
-  w_.factory("RooGaussian::pdf_dummy_nuisance(dummy_nuisance[0.,-10.,10.],0.,1.)");
+  RooRealVar &nuisance = MakeVar("dummy_nuisance", 0., -10., 10.);
+  Stage(new RooGaussian("pdf_dummy_nuisance", "pdf_dummy_nuisance", nuisance,
+                        RooFit::RooConst(0.), RooFit::RooConst(1.)));
   Append(nuisances_, "dummy_nuisance");
 }
 
 void WorkspaceGenerator::AddFullPdf(){
   if(print_level_ >= PrintLevel::everything) DBG("");
-  string null_list = "";//"pdf_dummy_nuisance";
-  string alt_list = "";//"pdf_dummy_nuisance";
-  bool is_first = true;
+  RooArgList null_pdfs, alt_pdfs;
   for(const auto &block: blocks_){
-    null_list += (is_first ? "pdf_null_BLK_" : ",pdf_null_BLK_") +block.Name();
-    alt_list += (is_first ? "pdf_alt_BLK_" : ",pdf_alt_BLK_" ) +block.Name();
-    is_first = false;
+    null_pdfs.add(Staged("pdf_null_BLK_"+block.Name()));
+    alt_pdfs.add(Staged("pdf_alt_BLK_"+block.Name()));
   }
   if(do_systematics_ || do_dilepton_){
     for(const auto &syst: systematics_){
-      null_list += (",constraint_"+syst);
-      alt_list += (",constraint_"+syst);
+      null_pdfs.add(Staged("constraint_"+syst));
+      alt_pdfs.add(Staged("constraint_"+syst));
     }
   }
   for(const auto & block: blocks_){
-    null_list += (",pdf_mc_"+block.Name());
-    alt_list += (",pdf_mc_"+block.Name());
+    null_pdfs.add(Staged("pdf_mc_"+block.Name()));
+    alt_pdfs.add(Staged("pdf_mc_"+block.Name()));
   }
-  w_.factory(("PROD::model_b("+null_list+")").c_str());
-  w_.factory(("PROD::model_s("+alt_list+")").c_str());
+  MakeProdPdf("model_b", null_pdfs);
+  MakeProdPdf("model_s", alt_pdfs);
 }
 
 void WorkspaceGenerator::AddParameterSets(){
@@ -1074,23 +1337,88 @@ void WorkspaceGenerator::AddModels(){
   w_.import(model_config_bonly);
 }
 
-void WorkspaceGenerator::AddPoisson(const string &pdf_name,
-                                    const string &n_name,
-                                    const string &mu_name,
-                                    bool allow_approx){
-  RooAbsReal *v_mu = w_.var(mu_name.c_str());
-  if(!v_mu) v_mu = w_.function(mu_name.c_str());
-  if(!v_mu) v_mu = w_.var(n_name.c_str());
-  if(!v_mu) v_mu = w_.function(n_name.c_str());
-  double mu = v_mu->getVal();
-  if(mu <= 50. || !allow_approx){
-    w_.factory(("RooPoisson::"+pdf_name+"("+n_name+","+mu_name+")").c_str());
-    (static_cast<RooPoisson*>(w_.pdf(pdf_name.c_str())))->setNoRounding();
-    (static_cast<RooPoisson*>(w_.pdf(pdf_name.c_str())))->protectNegativeMean();
+RooAbsPdf & WorkspaceGenerator::AddPoisson(const string &pdf_name,
+                                           const string &n_name,
+                                           const string &mu_name,
+                                           bool allow_approx){
+  RooAbsReal &n = Staged(n_name);
+  RooAbsReal &mu = Staged(mu_name);
+  if(mu.getVal() <= 50. || !allow_approx){
+    RooPoisson *pdf = new RooPoisson(pdf_name.c_str(), pdf_name.c_str(), n, mu);
+    pdf->setNoRounding();
+    pdf->protectNegativeMean();
+    return Stage(pdf);
   }else{
-    w_.factory(("expr::sqrt_"+mu_name+"('sqrt(@0)',"+mu_name+")").c_str());
-    w_.factory(("RooGaussian::"+pdf_name+"("+n_name+","+mu_name+",sqrt_"+mu_name+")").c_str());
+    RooAbsReal &sigma = MakeFormula("sqrt_"+mu_name, "sqrt(@0)", RooArgList(mu));
+    return Stage(new RooGaussian(pdf_name.c_str(), pdf_name.c_str(), n, mu, sigma));
+  }
+}
+
+template<typename T>
+T & WorkspaceGenerator::Stage(T *node){
+  //Takes ownership of a node until ImportStaged hands the finished model to the workspace
+  string name = node->GetName();
+  if(!staged_index_.emplace(name, node).second){
+    delete node;
+    ERROR("Workspace node "+name+" was created twice");
+  }
+  staged_.emplace_back(node);
+  return *node;
+}
+
+RooAbsReal & WorkspaceGenerator::Staged(const string &name) const{
+  auto node = staged_index_.find(name);
+  if(node == staged_index_.end()){
+    ERROR("Workspace node "+name+" has not been created");
+  }
+  return *node->second;
+}
+
+RooRealVar & WorkspaceGenerator::MakeVar(const string &name, double value){
+  //Single value constructor gives a constant, like name[value] in the factory
+  return Stage(new RooRealVar(name.c_str(), name.c_str(), FactoryValue(value)));
+}
+
+RooRealVar & WorkspaceGenerator::MakeVar(const string &name, double value, double low, double high){
+  return Stage(new RooRealVar(name.c_str(), name.c_str(), FactoryValue(value),
+                              FactoryValue(low), FactoryValue(high)));
+}
+
+RooAbsReal & WorkspaceGenerator::MakeProduct(const string &name, const RooArgList &factors){
+  return Stage(new RooProduct(name.c_str(), name.c_str(), factors));
+}
+
+RooAbsReal & WorkspaceGenerator::MakeSum(const string &name, const RooArgList &terms){
+  return Stage(new RooAddition(name.c_str(), name.c_str(), terms));
+}
+
+RooAbsReal & WorkspaceGenerator::MakeFormula(const string &name, const string &formula,
+                                             const RooArgList &args){
+  //The factory's expr:: titles the function with its formula
+  return Stage(new RooFormulaVar(name.c_str(), formula.c_str(), formula.c_str(), args));
+}
+
+RooAbsPdf & WorkspaceGenerator::MakeProdPdf(const string &name, const RooArgList &pdfs){
+  return Stage(new RooProdPdf(name.c_str(), name.c_str(), pdfs));
+}
+
+void WorkspaceGenerator::ImportStaged(){
+  if(print_level_ >= PrintLevel::everything) DBG(staged_.size());
+  //Importing a node brings in everything it depends on, so only the nodes nothing else
+  //uses are passed to the workspace, letting it share the common parts of the tree
+  RooArgSet roots;
+  for(const auto &node: staged_){
+    if(!node->hasClients()) roots.add(*node);
   }
+  w_.import(roots, RooFit::RecycleConflictNodes(), RooFit::Silence());
+  ClearStaged();
+}
+
+void WorkspaceGenerator::ClearStaged(){
+  staged_index_.clear();
+  //Every node is staged after its servers, so deleting from the back never leaves a
+  //client pointing at a deleted server
+  while(!staged_.empty()) staged_.pop_back();
 }
 
 ostream & operator<<(ostream& stream, const WorkspaceGenerator &wg){
@@ -6,8 +6,12 @@
 #include <initializer_list>
 #include <vector>
 #include <string>
+#include <utility>
+#include <memory>
+#include <future>
 #include <stdlib.h>
 #include <ctime>
+#include <cmath>
 #include <sys/stat.h>
 
 #include <unistd.h>
@@ -25,6 +29,10 @@
 #include "cross_sections.hpp"
 
 #include "workspace_generator.hpp"
+#include "yield_manager.hpp"
+#include "yield_key.hpp"
+#include "yield_stats.hpp"
+#include "thread_pool.hpp"
 
 using namespace std;
 
@@ -46,7 +54,11 @@ namespace{
   string lowmjthresh("250");
   string mjthresh("400");
   unsigned n_toys = 0;
-  string sigfile = "";
+  string toy_seed = "";
+  bool batch_toys = false;
+  vector<string> sigfiles;
+  string scan_dir = "";
+  string scan_ntuple = "";
   string injfile = "";
   bool inject_other_model = false;
   bool dummy_syst = false;
@@ -54,6 +66,19 @@ namespace{
   string outfolder = "out/";
   bool nom_only = false;
   bool use_pois = false;
+  string yield_cache = "";
+  string skim_cache = "";
+  string hist_cache = "";
+  string yield_stats = "";
+  int num_threads = -1;
+
+  struct SignalPoint{
+    string sigfile, sysfile;
+    int mglu, mlsp;
+    Process signal;
+    double rmax;
+    vector<pair<double, string> > variants;
+  };
 }
 //nbm = Sum$(jets_csv>CSVM&&jets_pt>30&&!jets_islep)
 int main(int argc, char *argv[]){
@@ -61,8 +86,17 @@ int main(int argc, char *argv[]){
   time(&begtime);
   cout << fixed << setprecision(2);
   GetOptions(argc, argv);
-  if(sigfile==""){
-    cout<<endl<<"You need to specify the input file with -f. Exiting"<<endl<<endl;
+  YieldManager::CacheDirectory(yield_cache);
+  YieldManager::SkimDirectory(skim_cache);
+  YieldManager::HistogramDirectory(hist_cache);
+  YieldStats::Get().ReportPath(yield_stats);
+  if(num_threads >= 0) Process::NumThreads(num_threads);
+  if(scan_dir != ""){
+    vector<string> scan_files = Glob(scan_dir+"/*SMS*");
+    sigfiles.insert(sigfiles.end(), scan_files.cbegin(), scan_files.cend());
+  }
+  if(sigfiles.size()==0 && scan_ntuple==""){
+    cout<<endl<<"You need to specify the input file with -f, --scan_dir or --scan_ntuple. Exiting"<<endl<<endl;
     return 1;
   }
   string midjets = to_string(atoi(hijets.c_str())-1);
@@ -107,9 +141,6 @@ int main(int argc, char *argv[]){
 	  foldermc+"/*QCD_HT*0_Tune*.root/tree",
 	  foldermc+"/*QCD_HT*Inf_Tune*.root/tree"}
     },stitch_cuts};
-  Process signal{"signal", {
-      {sigfile+"/tree"}
-    },"stitch", false, true};
   Process injection{"injection", {
       {injfile+"/tree"}
     },"stitch", false, true};
@@ -322,109 +353,155 @@ int main(int argc, char *argv[]){
   }
 
 
-  //// Parsing the gluino and LSP masses
-  int mglu, mlsp;
-  parseMasses(sigfile, mglu, mlsp);
-  string glu_lsp("mGluino-"+to_string(mglu)+"_mLSP-"+to_string(mlsp));
-  
   //// Creating workspaces for the Nominal, uncert Up, and uncert Down signal cross sections
   Cut *pbaseline(&baseline1b);
   set<Block> *pblocks(&blocks_1bk);
-  string model = "T1tttt";
-  
-  string sysfolder = "/net/cms2/cms2r0/babymaker/sys/2017_02_22/T1tttt_fakePU/";
-  //Protect default
-  if(binning=="nominal" && lumi < 3) sysfolder = "/net/cms2/cms2r0/babymaker/sys/2016_01_11/scan/";
-  
-  if(Contains(hostname, "lxplus")) sysfolder = "txt/systematics/";
-  if(Contains(sigfile, "T5tttt")) {
-    sysfolder = "/net/cms2/cms2r0/babymaker/sys/2017_02_22/T5tttt_fakePU/";
-    model = "T5tttt";
-  }
-  if(Contains(sigfile, "T2tt")) {
-    sysfolder = "/net/cms2/cms2r0/babymaker/sys/2016_02_09/T2tt/";
-    model = "T2tt";
+  vector<SignalPoint> points;
+  for(const auto &sigfile: sigfiles){
+    SignalPoint point;
+    point.sigfile = sigfile;
+    //// Parsing the gluino and LSP masses
+    parseMasses(sigfile, point.mglu, point.mlsp);
+    point.signal = Process{"signal", {
+        {sigfile+"/tree"}
+      },"stitch", false, true};
+    points.push_back(point);
   }
-  if(Contains(sigfile, "T6ttWW")) {
-    sysfolder = "/net/cms2/cms2r0/babymaker/sys/2016_02_09/T6ttWW/";
-    model = "T6ttWW";
-  }
-  cout<<"sysfolder is "<<sysfolder<<endl;
-  
-  //  string sysfile(sysfolder+"sys_SMS-"+model+"_"+glu_lsp+"_"+to_string(lumi)+"ifb");
-  string sysfile(sysfolder+"sys_SMS-"+model+"_"+glu_lsp+"_35.9ifb");
-  if(binning!="alternate") sysfile+="_nominal.txt";
-  
-  if(binning=="nominal" && lumi < 3) sysfile = sysfolder+"sys_SMS-"+model+"_"+glu_lsp+".txt";
-  if(dummy_syst) sysfile = dummy_syst_file;
-  cout<<"sysfile is "<<sysfile<<endl;
-  // If systematic file does not exist, use m1bk_nc for tests
-  struct stat buffer;   
-  if(stat (sysfile.c_str(), &buffer) != 0) {
-    cout<<endl<<"WARNING: "<<sysfile<<" does not exist. Using ";
-    sysfile = "txt/systematics/m1bk_nc.txt";
-    cout<<sysfile<<" instead"<<endl<<endl;
+  if(scan_ntuple != ""){
+    //A combined scan ntuple is read once for the yields of all its mass points
+    Process scan{"signal", {
+        {scan_ntuple+"/tree"}
+      },"stitch", false, true};
+    vector<string> point_branches = {"mgluino", "mlsp"};
+    vector<YieldKey> keys;
+    for(const auto &block: *pblocks){
+      for(const auto &vbin: block.Bins()){
+        for(const auto &bin: vbin){
+          keys.push_back(YieldKey(bin, scan, *pbaseline));
+        }
+      }
+    }
+    for(const auto &mass_point: YieldManager::Shared()->PrefetchScanYields(keys, point_branches)){
+      SignalPoint point;
+      point.mglu = static_cast<int>(lround(mass_point.at(0)));
+      point.mlsp = static_cast<int>(lround(mass_point.at(1)));
+      point.sigfile = scan_ntuple+"/mGluino-"+to_string(point.mglu)+"_mLSP-"+to_string(point.mlsp);
+      point.signal = YieldManager::ScanPointProcess(scan, point_branches, mass_point);
+      points.push_back(point);
+    }
   }
-  
-  // Cross sections
-  float xsec, xsec_unc;
-  if(model=="T1tttt" || model=="T5tttt") xsec::signalCrossSection(mglu, xsec, xsec_unc);
-  else xsec::stopCrossSection(mglu, xsec, xsec_unc);
-  double rmax = 20.;
-  if(mglu <= 1500 && mlsp <= 800){
-    rmax = 5.;
-    if(mglu <= 1200 && mlsp <= 550){
-      rmax = 1.25;
-      if(mglu <= 900 && mlsp <= 350){
-	rmax = 0.5;
+
+  for(auto &point: points){
+    const string &sigfile = point.sigfile;
+    int mglu = point.mglu, mlsp = point.mlsp;
+    string glu_lsp("mGluino-"+to_string(mglu)+"_mLSP-"+to_string(mlsp));
+
+    string model = "T1tttt";
+    string sysfolder = "/net/cms2/cms2r0/babymaker/sys/2017_02_22/T1tttt_fakePU/";
+    //Protect default
+    if(binning=="nominal" && lumi < 3) sysfolder = "/net/cms2/cms2r0/babymaker/sys/2016_01_11/scan/";
+
+    if(Contains(hostname, "lxplus")) sysfolder = "txt/systematics/";
+    if(Contains(sigfile, "T5tttt")) {
+      sysfolder = "/net/cms2/cms2r0/babymaker/sys/2017_02_22/T5tttt_fakePU/";
+      model = "T5tttt";
+    }
+    if(Contains(sigfile, "T2tt")) {
+      sysfolder = "/net/cms2/cms2r0/babymaker/sys/2016_02_09/T2tt/";
+      model = "T2tt";
+    }
+    if(Contains(sigfile, "T6ttWW")) {
+      sysfolder = "/net/cms2/cms2r0/babymaker/sys/2016_02_09/T6ttWW/";
+      model = "T6ttWW";
+    }
+    cout<<"sysfolder is "<<sysfolder<<endl;
+
+    //  string sysfile(sysfolder+"sys_SMS-"+model+"_"+glu_lsp+"_"+to_string(lumi)+"ifb");
+    point.sysfile = sysfolder+"sys_SMS-"+model+"_"+glu_lsp+"_35.9ifb";
+    if(binning!="alternate") point.sysfile+="_nominal.txt";
+
+    if(binning=="nominal" && lumi < 3) point.sysfile = sysfolder+"sys_SMS-"+model+"_"+glu_lsp+".txt";
+    if(dummy_syst) point.sysfile = dummy_syst_file;
+    cout<<"sysfile is "<<point.sysfile<<endl;
+    // If systematic file does not exist, use m1bk_nc for tests
+    struct stat buffer;
+    if(stat (point.sysfile.c_str(), &buffer) != 0) {
+      cout<<endl<<"WARNING: "<<point.sysfile<<" does not exist. Using ";
+      point.sysfile = "txt/systematics/m1bk_nc.txt";
+      cout<<point.sysfile<<" instead"<<endl<<endl;
+    }
+
+    // Cross sections
+    float xsec, xsec_unc;
+    if(model=="T1tttt" || model=="T5tttt") xsec::signalCrossSection(mglu, xsec, xsec_unc);
+    else xsec::stopCrossSection(mglu, xsec, xsec_unc);
+    point.rmax = 20.;
+    if(mglu <= 1500 && mlsp <= 800){
+      point.rmax = 5.;
+      if(mglu <= 1200 && mlsp <= 550){
+        point.rmax = 1.25;
+        if(mglu <= 900 && mlsp <= 350){
+          point.rmax = 0.5;
+        }
       }
     }
+
+    string outname(outfolder+"/wspace_"+model+"_"+glu_lsp+"_xsecNom.root");
+    if(!use_r4) ReplaceAll(outname, "wspace_","wspace_nor4_");
+    if(no_kappa) ReplaceAll(outname, "wspace_","wspace_nokappa_");
+    if(!do_syst) ReplaceAll(outname, "wspace_","wspace_nosyst_");
+
+    //The variants differ only in the signal cross section, which enters the model through the
+    //signal MC weights. The workspace is built once and those weights are reset before each
+    //variant is written.
+    point.variants = {{1., outname}};
+    if(!nom_only){
+      string outname_up = outname, outname_down = outname;
+      ReplaceAll(outname_up, "Nom", "Up");
+      ReplaceAll(outname_down, "Nom", "Down");
+      point.variants.push_back({1+xsec_unc, outname_up});
+      point.variants.push_back({1-xsec_unc, outname_down});
+    }
   }
-  
   gSystem->mkdir(outfolder.c_str(), kTRUE);
-  string outname(outfolder+"/wspace_"+model+"_"+glu_lsp+"_xsecNom.root");
-  if(!use_r4) ReplaceAll(outname, "wspace_","wspace_nor4_");
-  if(no_kappa) ReplaceAll(outname, "wspace_","wspace_nokappa_");
-  if(!do_syst) ReplaceAll(outname, "wspace_","wspace_nosyst_");
-
-  WorkspaceGenerator wgNom(*pbaseline, *pblocks, backgrounds, signal, data, sysfile, use_r4, sig_strength, 1.);
-  wgNom.UseGausApprox(!use_pois);
-  wgNom.SetRMax(rmax);
-  wgNom.SetKappaCorrected(!no_kappa);
-  wgNom.SetLuminosity(lumi);
-  wgNom.SetDoSystematics(do_syst);
-  if(inject_other_model){
-    wgNom.SetInjectionModel(injection);
-  }
-  wgNom.AddToys(n_toys);
-  wgNom.WriteToFile(outname);
-
-  if(!nom_only){
-    ReplaceAll(outname, "Nom", "Up");
-    WorkspaceGenerator wgUp(*pbaseline, *pblocks, backgrounds, signal, data, sysfile, use_r4, sig_strength, 1+xsec_unc);
-    wgUp.UseGausApprox(!use_pois);
-    wgUp.SetRMax(rmax);
-    wgUp.SetKappaCorrected(!no_kappa);
-    wgUp.SetLuminosity(lumi);
-    wgUp.SetDoSystematics(do_syst);
+
+  //All points share one yield manager, so background and data yields are only computed
+  //once. The signal yields of every point are read concurrently on a thread pool, while
+  //the RooFit workspaces are built and written one after another in the main thread.
+  vector<unique_ptr<WorkspaceGenerator> > generators;
+  for(const auto &point: points){
+    generators.emplace_back(new WorkspaceGenerator(*pbaseline, *pblocks, backgrounds, point.signal, data, point.sysfile, use_r4, sig_strength, point.variants.front().first));
+    WorkspaceGenerator &wg = *generators.back();
+    wg.SetYieldManager(YieldManager::Shared());
+    wg.UseGausApprox(!use_pois);
+    wg.SetRMax(point.rmax);
+    wg.SetKappaCorrected(!no_kappa);
+    wg.SetLuminosity(lumi);
+    wg.SetDoSystematics(do_syst);
+    wg.SetBatchToys(batch_toys);
+    if(toy_seed != "") wg.SetToySeed(stoull(toy_seed));
+    wg.SetToyStream(HashString(point.sigfile));
     if(inject_other_model){
-      wgUp.SetInjectionModel(injection);
+      wg.SetInjectionModel(injection);
     }
-    wgUp.AddToys(n_toys);
-    wgUp.WriteToFile(outname);
-
-    ReplaceAll(outname, "Up", "Down");
-    WorkspaceGenerator wgDown(*pbaseline, *pblocks, backgrounds, signal, data, sysfile, use_r4, sig_strength, 1-xsec_unc);
-    wgDown.UseGausApprox(!use_pois);
-    wgDown.SetRMax(rmax);
-    wgDown.SetKappaCorrected(!no_kappa);
-    wgDown.SetLuminosity(lumi);
-    wgDown.SetDoSystematics(do_syst);
-    if(inject_other_model){
-      wgDown.SetInjectionModel(injection);
+  }
+  Process::EnableThreadSafety();
+  ThreadPool pool;
+  vector<future<void> > prefetches;
+  for(const auto &wg: generators){
+    const WorkspaceGenerator *pwg = wg.get();
+    prefetches.push_back(pool.Push([pwg](){pwg->PrefetchYields();}));
+  }
+  for(size_t ipoint = 0; ipoint < points.size(); ++ipoint){
+    prefetches.at(ipoint).get();
+    WorkspaceGenerator &wg = *generators.at(ipoint);
+    wg.AddToys(n_toys);
+    for(const auto &variant: points.at(ipoint).variants){
+      wg.SetSignalXsecFactor(variant.first);
+      wg.WriteToFile(variant.second);
     }
-    wgDown.AddToys(n_toys);
-    wgDown.WriteToFile(outname);
+    //Done with this point, so free its workspace before building the next
+    generators.at(ipoint).reset();
   }
 
   time(&endtime); 
@@ -451,12 +528,21 @@ void GetOptions(int argc, char *argv[]){
       {"useVeto", required_argument, 0, 'v'},
       {"alt_binning", required_argument, 0, 'b'},
       {"toys", required_argument, 0, 0},
+      {"seed", required_argument, 0, 0},
+      {"batch_toys", no_argument, 0, 0},
       {"sig_strength", required_argument, 0, 'g'},
       {"dummy_syst", required_argument, 0, 0},
       {"outfolder", required_argument, 0, 'o'},
       {"inject", required_argument, 0, 'i'},
       {"nominal", no_argument, 0, 'n'},
       {"poisson", no_argument, 0, 'p'},
+      {"yield_cache", required_argument, 0, 0},
+      {"skim_cache", required_argument, 0, 0},
+      {"hist_cache", required_argument, 0, 0},
+      {"yield_stats", required_argument, 0, 0},
+      {"threads", required_argument, 0, 0},
+      {"scan_dir", required_argument, 0, 0},
+      {"scan_ntuple", required_argument, 0, 0},
       {0, 0, 0, 0}
     };
 
@@ -489,7 +575,7 @@ void GetOptions(int argc, char *argv[]){
       outfolder = optarg;
       break;
     case 'f':
-      sigfile = optarg;
+      sigfiles.push_back(optarg);
       break;
     case 'j':
       minjets = optarg;
@@ -537,9 +623,27 @@ void GetOptions(int argc, char *argv[]){
         do_syst = false;
       }else if(optname == "toys"){
         n_toys = atoi(optarg);
+      }else if(optname == "seed"){
+        toy_seed = optarg;
+      }else if(optname == "batch_toys"){
+        batch_toys = true;
       }else if(optname == "dummy_syst"){
 	dummy_syst = true;
 	dummy_syst_file = optarg;
+      }else if(optname == "yield_cache"){
+        yield_cache = optarg;
+      }else if(optname == "skim_cache"){
+        skim_cache = optarg;
+      }else if(optname == "hist_cache"){
+        hist_cache = optarg;
+      }else if(optname == "yield_stats"){
+        yield_stats = optarg;
+      }else if(optname == "threads"){
+        num_threads = atoi(optarg);
+      }else if(optname == "scan_dir"){
+        scan_dir = optarg;
+      }else if(optname == "scan_ntuple"){
+        scan_ntuple = optarg;
       }else{
         printf("Bad option! Found option name %s\n", optname.c_str());
       }
@@ -0,0 +1,85 @@
+#include "yield_cache.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <cerrno>
+
+#include <sys/stat.h>
+
+#include "utilities.hpp"
+#include "yield_manager.hpp"
+
+using namespace std;
+
+namespace{
+  //Bump whenever the way yields are computed changes, to invalidate old entries
+  const string cache_version = "yield_cache_v2:weight*eff_trig";
+}
+
+YieldCache::YieldCache(const string &directory):
+  directory_(){
+  Directory(directory);
+}
+
+const string & YieldCache::Directory() const{
+  return directory_;
+}
+
+YieldCache & YieldCache::Directory(const string &directory){
+  directory_ = directory;
+  if(directory_ != "" && mkdir(directory_.c_str(), 0775) != 0 && errno != EEXIST){
+    ERROR("Could not create yield cache directory "+directory_);
+  }
+  return *this;
+}
+
+bool YieldCache::Enabled() const{
+  return directory_ != "";
+}
+
+bool YieldCache::Load(const YieldKey &key, GammaParams &gps) const{
+  if(!Enabled()) return false;
+  string description = Description(key);
+  ifstream file(Path(description));
+  if(!file.is_open()) return false;
+  double n_effective, weight;
+  if(!(file >> n_effective >> weight)) return false;
+  file.ignore(numeric_limits<streamsize>::max(), '\n');
+  //Guard against hash collisions by checking the full description
+  ostringstream stored;
+  stored << file.rdbuf();
+  if(stored.str() != description) return false;
+  gps.SetNEffectiveAndWeight(n_effective, weight);
+  return true;
+}
+
+void YieldCache::Store(const YieldKey &key, const GammaParams &gps) const{
+  if(!Enabled()) return;
+  string description = Description(key);
+  ostringstream oss;
+  oss << setprecision(numeric_limits<double>::max_digits10)
+      << gps.NEffective() << ' ' << gps.Weight() << '\n'
+      << description << flush;
+  WriteFileAtomically(Path(description), oss.str());
+}
+
+string YieldCache::Description(const YieldKey &key) const{
+  const Bin &bin = GetBin(key);
+  const Process &process = GetProcess(key);
+  ostringstream oss;
+  oss << cache_version << '\n'
+      << "files=" << process.FileSetHash() << '\n'
+      << "process_cut=" << process.Cut() << '\n'
+      << "is_data=" << process.IsData()
+      << ",count_zeros=" << process.CountZeros()
+      << ",signal_variants=" << YieldManager::SignalVariantsDescription(process) << '\n'
+      << "bin_cut=" << bin.Cut() << '\n'
+      << "baseline=" << GetCut(key) << '\n' << flush;
+  return oss.str();
+}
+
+string YieldCache::Path(const string &description) const{
+  return directory_+"/yield_"+HexString(HashString(description))+".txt";
+}
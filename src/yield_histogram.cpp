@@ -0,0 +1,458 @@
+#include "yield_histogram.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <utility>
+
+#include "TChain.h"
+
+#include "compiled_cut.hpp"
+#include "column_reader.hpp"
+#include "yield_manager.hpp"
+#include "yield_stats.hpp"
+#include "utilities.hpp"
+
+using namespace std;
+
+namespace{
+  //Text file: magic, description, baseline, axes, then for each variant the occupied
+  //cells as one line each of axis bin indices, sum of weights and sum of squared weights
+  const string magic = "ra4hist1";
+  const string histogram_version = "histogram_v1";
+  const size_t chunk_size = 4096;
+
+  using Node = CompiledCut::Node;
+  using Op = CompiledCut::Op;
+
+  //Bin k of an axis holds values in (edges[k-1], edges[k]], with the first and last
+  //bins open-ended
+  size_t FindBin(const vector<double> &edges, double value){
+    return lower_bound(edges.cbegin(), edges.cend(), value) - edges.cbegin();
+  }
+
+  bool FindEdge(const vector<double> &edges, double value, size_t &edge){
+    auto found = find(edges.cbegin(), edges.cend(), value);
+    edge = found - edges.cbegin();
+    return found != edges.cend();
+  }
+
+  //Narrows the bin range [low, high] of an axis to the values passing "x op value".
+  //Only thresholds lying on bin edges can be answered exactly.
+  bool Restrict(const YieldHistogram::Axis &axis, Op op, double value,
+                size_t &low, size_t &high){
+    if(axis.is_integer && value == floor(value)){
+      //On integer axes x>=c means x>c-1 and x<c means x<=c-1
+      if(op == Op::greater_equal){
+        op = Op::greater;
+        value -= 1.;
+      }else if(op == Op::less){
+        op = Op::less_equal;
+        value -= 1.;
+      }else if(op == Op::equal){
+        return Restrict(axis, Op::greater, value-1., low, high)
+          && Restrict(axis, Op::less_equal, value, low, high);
+      }
+    }
+    size_t edge;
+    if(!FindEdge(axis.edges, value, edge)) return false;
+    if(op == Op::greater){
+      low = max(low, edge+1);
+    }else if(op == Op::less_equal){
+      high = min(high, edge);
+    }else{
+      return false;
+    }
+    return true;
+  }
+
+  Op Flipped(Op op){
+    if(op == Op::less) return Op::greater;
+    if(op == Op::less_equal) return Op::greater_equal;
+    if(op == Op::greater) return Op::less;
+    if(op == Op::greater_equal) return Op::less_equal;
+    return op;
+  }
+
+  bool IsComparison(Op op){
+    return op == Op::less || op == Op::less_equal
+      || op == Op::greater || op == Op::greater_equal
+      || op == Op::equal;
+  }
+
+  bool Decompose(const Cut &cut, set<string> &predicates, vector<string> &factors,
+                 vector<const Node*> *nodes = nullptr, unique_ptr<Node> *root = nullptr){
+    string error;
+    unique_ptr<Node> parsed = CompiledCut::Parse(cut, error);
+    if(!parsed) return false;
+    vector<const Node*> predicate_nodes, factor_nodes;
+    CompiledCut::Decompose(*parsed, predicate_nodes, factor_nodes);
+    for(const auto &node: predicate_nodes){
+      predicates.insert(CompiledCut::Describe(*node));
+    }
+    for(const auto &node: factor_nodes){
+      factors.push_back(CompiledCut::Describe(*node));
+    }
+    if(nodes != nullptr) *nodes = predicate_nodes;
+    if(root != nullptr) *root = move(parsed);
+    return true;
+  }
+}
+
+YieldHistogram::YieldHistogram(const string &path):
+  path_(path),
+  description_(),
+  baseline_(),
+  axes_(),
+  variants_(),
+  is_valid_(false){
+  is_valid_ = Load();
+  if(!is_valid_){
+    axes_.clear();
+    variants_.clear();
+  }
+}
+
+bool YieldHistogram::IsValid() const{
+  return is_valid_;
+}
+
+const string & YieldHistogram::Path() const{
+  return path_;
+}
+
+const string & YieldHistogram::Description() const{
+  return description_;
+}
+
+const vector<YieldHistogram::Axis> & YieldHistogram::Axes() const{
+  return axes_;
+}
+
+size_t YieldHistogram::NumCells() const{
+  size_t num_cells = 0;
+  for(const auto &cells: variants_){
+    num_cells += cells.sumw.size();
+  }
+  return num_cells;
+}
+
+bool YieldHistogram::GetYields(const Process &process,
+                               const vector<Cut> &cuts,
+                               vector<GammaParams> &gps) const{
+  //A cut can be answered if it has the weight the histogram was filled with, keeps
+  //every requirement of the filled selection, and otherwise only compares axis
+  //variables to bin edges. Returns false, leaving gps untouched, if any cut cannot.
+  if(!IsValid() || variants_.size() != NumVariants(process)) return false;
+  size_t num_axes = axes_.size();
+  vector<set<string> > selections(variants_.size());
+  vector<vector<string> > weights(variants_.size());
+  vector<vector<string> > axis_names(variants_.size());
+  for(size_t variant = 0; variant < variants_.size(); ++variant){
+    vector<string> selection_factors;
+    if(!Decompose(Selection(process, Cut(baseline_), variant), selections.at(variant), selection_factors)
+       || !Decompose(Weight(process, variant), selections.at(variant), weights.at(variant))){
+      return false;
+    }
+    for(const auto &axis: axes_){
+      axis_names.at(variant).push_back(static_cast<string>(Variant(Cut(axis.variable), variant)));
+    }
+  }
+
+  vector<GammaParams> these_gps(cuts.size());
+  for(size_t icut = 0; icut < cuts.size(); ++icut){
+    set<string> predicates;
+    vector<string> factors;
+    vector<const Node*> nodes;
+    unique_ptr<Node> root;
+    if(!Decompose(cuts.at(icut)*process.Cut(), predicates, factors, &nodes, &root)) return false;
+
+    bool found = false;
+    for(size_t variant = 0; variant < variants_.size() && !found; ++variant){
+      if(factors != weights.at(variant)) continue;
+      const set<string> &selection = selections.at(variant);
+      if(!includes(predicates.cbegin(), predicates.cend(), selection.cbegin(), selection.cend())) continue;
+
+      vector<size_t> low(num_axes, 0), high(num_axes);
+      for(size_t iaxis = 0; iaxis < num_axes; ++iaxis){
+        high.at(iaxis) = axes_.at(iaxis).edges.size();
+      }
+      bool good = true, empty = false;
+      for(const auto &node: nodes){
+        if(selection.find(CompiledCut::Describe(*node)) != selection.end()) continue;
+        if(node->op == Op::constant){
+          if(node->value == 0.) empty = true;
+          continue;
+        }
+        good = IsComparison(node->op) && node->args.size() == 2;
+        if(!good) break;
+        const Node &lhs = *node->args.at(0);
+        const Node &rhs = *node->args.at(1);
+        Op op = node->op;
+        const Node *var = &lhs, *value = &rhs;
+        if(lhs.op == Op::constant && rhs.op == Op::variable){
+          op = Flipped(op);
+          var = &rhs;
+          value = &lhs;
+        }
+        good = var->op == Op::variable && value->op == Op::constant;
+        if(!good) break;
+        const vector<string> &names = axis_names.at(variant);
+        auto axis = find(names.cbegin(), names.cend(), var->name);
+        good = axis != names.cend();
+        if(!good) break;
+        size_t iaxis = axis - names.cbegin();
+        good = Restrict(axes_.at(iaxis), op, value->value, low.at(iaxis), high.at(iaxis));
+        if(!good) break;
+      }
+      if(!good) continue;
+
+      found = true;
+      double sumw = 0., sumw2 = 0.;
+      const Cells &cells = variants_.at(variant);
+      for(size_t icell = 0; icell < cells.sumw.size() && !empty; ++icell){
+        const uint16_t *bins = &cells.bins[icell*num_axes];
+        bool pass = true;
+        for(size_t iaxis = 0; iaxis < num_axes && pass; ++iaxis){
+          pass = bins[iaxis] >= low[iaxis] && bins[iaxis] <= high[iaxis];
+        }
+        if(!pass) continue;
+        sumw += cells.sumw[icell];
+        sumw2 += cells.sumw2[icell];
+      }
+      these_gps.at(icut).SetYieldAndUncertainty(sumw, sqrt(sumw2));
+    }
+    if(!found) return false;
+  }
+  gps = these_gps;
+  YieldStats::Get().Add(YieldStats::Counter::histogram_passes);
+  return true;
+}
+
+string YieldHistogram::Description(const Process &process, const Cut &baseline){
+  ostringstream oss;
+  oss << histogram_version << '\n'
+      << "files=" << process.FileSetHash() << '\n'
+      << "process_cut=" << process.Cut() << '\n'
+      << "weight=" << YieldManager::LumiWeight(process) << '\n'
+      << "signal_variants=" << YieldManager::SignalVariantsDescription(process) << '\n'
+      << "baseline=" << baseline << '\n' << flush;
+  return oss.str();
+}
+
+string YieldHistogram::PathFor(const string &directory,
+                               const Process &process,
+                               const Cut &baseline){
+  return directory+"/hist_"+HexString(HashString(Description(process, baseline)))+".hist";
+}
+
+YieldHistogram::Axis YieldHistogram::MakeAxis(const string &spec){
+  //"variable:low:high:step", with ":int" appended for integer variables
+  vector<string> fields = Tokenize(spec, ":");
+  if(fields.size() != 4 && !(fields.size() == 5 && fields.at(4) == "int")){
+    ERROR("Bad axis specification "+spec);
+  }
+  Axis axis;
+  axis.variable = fields.at(0);
+  axis.is_integer = fields.size() == 5;
+  double low = stod(fields.at(1)), high = stod(fields.at(2)), step = stod(fields.at(3));
+  if(step <= 0. || high < low) ERROR("Bad axis range in "+spec);
+  for(size_t i = 0; low+i*step <= high; ++i){
+    axis.edges.push_back(low+i*step);
+  }
+  if(axis.edges.size() >= numeric_limits<uint16_t>::max()) ERROR("Too many bins in "+spec);
+  return axis;
+}
+
+vector<YieldHistogram::Axis> YieldHistogram::DefaultAxes(){
+  return {MakeAxis("mt:0:700:10"),
+      MakeAxis("mj14:0:1500:25"),
+      MakeAxis("met:0:1500:25"),
+      MakeAxis("njets:-1:20:1:int"),
+      MakeAxis("nbm:-1:8:1:int"),
+      MakeAxis("nveto:-1:5:1:int")};
+}
+
+void YieldHistogram::Build(const Process &process,
+                           const Cut &baseline,
+                           const vector<Axis> &axes,
+                           const string &directory){
+  TChain chain("tree", "tree");
+  for(const auto &file: process.Files()){
+    chain.Add(file.c_str());
+  }
+  if(chain.GetEntries() <= 0 || chain.LoadTree(0) < 0){
+    ERROR("No entries found for "+process.Name());
+  }
+
+  //Signal events are filled once per met/met_tru variant, with the axes and the
+  //selection substituted accordingly
+  size_t num_variants = NumVariants(process);
+  vector<unique_ptr<CompiledCut> > selections, weights;
+  vector<vector<string> > axis_names(num_variants);
+  vector<string> variables;
+  auto add_variable = [&variables](const string &variable){
+    if(find(variables.cbegin(), variables.cend(), variable) == variables.cend()){
+      variables.push_back(variable);
+    }
+  };
+  for(size_t variant = 0; variant < num_variants; ++variant){
+    selections.emplace_back(new CompiledCut(Selection(process, baseline, variant)));
+    weights.emplace_back(new CompiledCut(Weight(process, variant)));
+    for(const auto &compiled: {selections.back().get(), weights.back().get()}){
+      if(!compiled->IsValid()) ERROR(compiled->Error());
+      for(const auto &variable: compiled->Variables()) add_variable(variable);
+    }
+    for(const auto &axis: axes){
+      axis_names.at(variant).push_back(static_cast<string>(Variant(Cut(axis.variable), variant)));
+      add_variable(axis_names.at(variant).back());
+    }
+  }
+  for(size_t variant = 0; variant < num_variants; ++variant){
+    selections.at(variant)->MapVariables(variables);
+    weights.at(variant)->MapVariables(variables);
+  }
+  vector<vector<size_t> > axis_columns(num_variants);
+  for(size_t variant = 0; variant < num_variants; ++variant){
+    for(const auto &name: axis_names.at(variant)){
+      axis_columns.at(variant).push_back(find(variables.cbegin(), variables.cend(), name) - variables.cbegin());
+    }
+  }
+
+  //Occupied cells are keyed by their mixed-radix index over all axes
+  vector<uint64_t> strides(axes.size(), 1);
+  double num_cells = 1.;
+  for(size_t iaxis = axes.size(); iaxis-- > 0; ){
+    strides.at(iaxis) = static_cast<uint64_t>(num_cells);
+    num_cells *= axes.at(iaxis).edges.size()+1.;
+  }
+  if(num_cells > 1.e18) ERROR("Too many cells in histogram for "+process.Name());
+
+  vector<unordered_map<uint64_t, pair<double, double> > > cells(num_variants);
+  ColumnReader reader(chain, variables, chunk_size);
+  vector<double> pass, weight;
+  while(reader.Next()){
+    const vector<vector<double> > &columns = reader.Columns();
+    for(size_t variant = 0; variant < num_variants; ++variant){
+      selections.at(variant)->Evaluate(columns, reader.Size(), pass);
+      weights.at(variant)->Evaluate(columns, reader.Size(), weight);
+      const vector<size_t> &these_columns = axis_columns.at(variant);
+      for(size_t i = 0; i < reader.Size(); ++i){
+        if(pass[i] == 0. || weight[i] == 0.) continue;
+        uint64_t code = 0;
+        for(size_t iaxis = 0; iaxis < axes.size(); ++iaxis){
+          code += strides[iaxis]*FindBin(axes[iaxis].edges, columns[these_columns[iaxis]][i]);
+        }
+        pair<double, double> &sums = cells.at(variant)[code];
+        sums.first += weight[i];
+        sums.second += weight[i]*weight[i];
+      }
+    }
+  }
+
+  ostringstream oss;
+  oss << setprecision(numeric_limits<double>::max_digits10);
+  string description = Description(process, baseline);
+  oss << magic << '\n'
+      << description.size() << '\n' << description
+      << static_cast<string>(baseline) << '\n'
+      << axes.size() << '\n';
+  for(const auto &axis: axes){
+    oss << axis.variable << ' ' << axis.is_integer << ' ' << axis.edges.size();
+    for(const auto &edge: axis.edges){
+      oss << ' ' << edge;
+    }
+    oss << '\n';
+  }
+  oss << num_variants << '\n';
+  for(const auto &variant_cells: cells){
+    vector<uint64_t> codes;
+    for(const auto &cell: variant_cells){
+      codes.push_back(cell.first);
+    }
+    sort(codes.begin(), codes.end());
+    oss << codes.size() << '\n';
+    for(const auto &code: codes){
+      for(size_t iaxis = 0; iaxis < axes.size(); ++iaxis){
+        oss << (code/strides.at(iaxis))%(axes.at(iaxis).edges.size()+1) << ' ';
+      }
+      const pair<double, double> &sums = variant_cells.at(code);
+      oss << sums.first << ' ' << sums.second << '\n';
+    }
+  }
+  oss << flush;
+
+  WriteFileAtomically(PathFor(directory, process, baseline), oss.str());
+}
+
+bool YieldHistogram::Load(){
+  ifstream file(path_);
+  if(!file.is_open()) return false;
+  string line;
+  if(!getline(file, line) || line != magic) return false;
+  size_t description_size;
+  if(!(file >> description_size) || !getline(file, line)) return false;
+  description_.assign(description_size, '\0');
+  if(!file.read(&description_[0], description_size)) return false;
+  if(!getline(file, baseline_)) return false;
+
+  size_t num_axes;
+  if(!(file >> num_axes)) return false;
+  axes_.assign(num_axes, Axis());
+  for(auto &axis: axes_){
+    size_t num_edges;
+    if(!(file >> axis.variable >> axis.is_integer >> num_edges)) return false;
+    axis.edges.assign(num_edges, 0.);
+    for(auto &edge: axis.edges){
+      if(!(file >> edge)) return false;
+    }
+  }
+
+  size_t num_variants;
+  if(!(file >> num_variants)) return false;
+  variants_.assign(num_variants, Cells());
+  for(auto &cells: variants_){
+    size_t num_cells;
+    if(!(file >> num_cells)) return false;
+    cells.bins.assign(num_cells*num_axes, 0);
+    cells.sumw.assign(num_cells, 0.);
+    cells.sumw2.assign(num_cells, 0.);
+    for(size_t icell = 0; icell < num_cells; ++icell){
+      for(size_t iaxis = 0; iaxis < num_axes; ++iaxis){
+        if(!(file >> cells.bins.at(icell*num_axes+iaxis))) return false;
+      }
+      if(!(file >> cells.sumw.at(icell) >> cells.sumw2.at(icell))) return false;
+    }
+  }
+  return true;
+}
+
+size_t YieldHistogram::NumVariants(const Process &process){
+  if(YieldManager::SignalVariantsDescription(process) == "") return 1;
+  return YieldManager::SignalVariants().size()+1;
+}
+
+Cut YieldHistogram::Variant(const Cut &cut, size_t variant){
+  //Variant 0 is the nominal; the others follow YieldManager::SignalVariants()
+  Cut variant_cut = cut;
+  if(variant == 0) return variant_cut;
+  for(const auto &substitution: YieldManager::SignalVariants().at(variant-1)){
+    variant_cut.Substitute(substitution.first, substitution.second);
+  }
+  return variant_cut;
+}
+
+Cut YieldHistogram::Selection(const Process &process, const Cut &baseline, size_t variant){
+  return Variant(baseline && process.Cut(), variant);
+}
+
+Cut YieldHistogram::Weight(const Process &process, size_t variant){
+  //Matches the cuts YieldManager fills, which end up as LumiWeight*(...)*process.Cut()
+  return Variant(YieldManager::LumiWeight(process)*process.Cut(), variant);
+}
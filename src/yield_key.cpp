@@ -1,17 +1,42 @@
 #include "yield_key.hpp"
 
+#include <tuple>
+
+#include "interner.hpp"
+
 using namespace std;
 
+YieldKey::YieldKey(const Bin &bin, const Process &process, const Cut &cut):
+  bin_id(bin.Id()),
+  process_id(process.Id()),
+  cut_id(cut.Id()){
+}
+
+bool YieldKey::operator<(const YieldKey &key) const{
+  return tie(bin_id, process_id, cut_id) < tie(key.bin_id, key.process_id, key.cut_id);
+}
+
+bool YieldKey::operator==(const YieldKey &key) const{
+  return bin_id == key.bin_id && process_id == key.process_id && cut_id == key.cut_id;
+}
+
+size_t YieldKeyHash::operator()(const YieldKey &key) const{
+  size_t h = key.bin_id;
+  h = 1000003*h ^ key.process_id;
+  h = 1000003*h ^ key.cut_id;
+  return h;
+}
+
 const Bin & GetBin(const YieldKey &yk){
-  return get<0>(yk);
+  return Interner<Bin>::Get(yk.bin_id);
 }
 
 const Process & GetProcess(const YieldKey &yk){
-  return get<1>(yk);
+  return Interner<Process, Process::IdentityLess>::Get(yk.process_id);
 }
 
 const Cut & GetCut(const YieldKey &yk){
-  return get<2>(yk);
+  return Interner<Cut>::Get(yk.cut_id);
 }
 
 ostream & operator<<(ostream &stream, const YieldKey &key){
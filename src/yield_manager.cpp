@@ -2,30 +2,56 @@
 
 #include <iostream>
 #include <sstream>
+#include <iomanip>
+#include <limits>
 #include <array>
+#include <set>
+#include <algorithm>
 
 #include "bin.hpp"
 #include "process.hpp"
 #include "cut.hpp"
 #include "utilities.hpp"
+#include "skim_file.hpp"
+#include "yield_histogram.hpp"
+#include "yield_stats.hpp"
 
 using namespace std;
 
-map<YieldKey, GammaParams> YieldManager::yields_ = map<YieldKey, GammaParams>();
+YieldCache YieldManager::cache_ = YieldCache();
+string YieldManager::skim_directory_ = "";
+string YieldManager::histogram_directory_ = "";
+//// Averaging signal yields cutting on met and met_tru, as prescripted by SUSY group
+//// https://twiki.cern.ch/twiki/bin/viewauth/CMS/SUSRecommendationsICHEP16#Special_treatment_of_MET_uncerta
+vector<YieldManager::Substitutions> YieldManager::signal_variants_ = {{{"met", "met_tru"}}};
 const double YieldManager::store_lumi_ = 4.;
 
 YieldManager::YieldManager(double lumi):
+  shards_(),
   local_lumi_(lumi),
   verbose_(false){
+  //A manager may be shared between threads, so ROOT has to be ready for them before any
+  //yield is read
+  Process::EnableThreadSafety();
 }
 
 GammaParams YieldManager::GetYield(const YieldKey &key) const{
-  if(!HaveYield(key)) ComputeYield(key);
+  return GetYield(key, local_lumi_);
+}
+
+GammaParams YieldManager::GetYield(const YieldKey &key, double lumi) const{
+  //Yields are stored at store_lumi_, so the luminosity is only a scale applied on
+  //the way out and one manager can serve generators at different luminosities
+  shared_future<GammaParams> yield = FindYield(key);
+  if(!yield.valid()){
+    PrefetchYields(vector<YieldKey>{key});
+    yield = FindYield(key);
+  }
 
-  double factor = local_lumi_/store_lumi_;
+  double factor = lumi/store_lumi_;
   if(GetProcess(key).IsData()) factor = 1.;
 
-  return factor*yields_.at(key);
+  return factor*yield.get();
 }
 
 GammaParams YieldManager::GetYield(const Bin &bin,
@@ -34,6 +60,129 @@ GammaParams YieldManager::GetYield(const Bin &bin,
   return GetYield(YieldKey(bin, process, cut));
 }
 
+vector<vector<GammaParams> > YieldManager::GetYields(const vector<YieldKey> &keys,
+                                                    const vector<Cut> &weights) const{
+  return GetYields(keys, weights, local_lumi_);
+}
+
+vector<vector<GammaParams> > YieldManager::GetYields(const vector<YieldKey> &keys,
+                                                    const vector<Cut> &weights,
+                                                    double lumi) const{
+  //Each weight expression (e.g. the nominal weight and its up/down scale factor
+  //variations) replaces NominalWeight(), and every key of a process is filled for all
+  //of them in one pass. These are the raw yields, without the zero-yield fallbacks, and
+  //are not cached. Results are indexed by weight, then by key.
+  vector<vector<GammaParams> > gps(weights.size(), vector<GammaParams>(keys.size()));
+  map<size_t, vector<size_t> > keys_by_process;
+  for(size_t ikey = 0; ikey < keys.size(); ++ikey){
+    keys_by_process[keys.at(ikey).process_id].push_back(ikey);
+  }
+
+  for(const auto &process_keys: keys_by_process){
+    const Process &process = GetProcess(keys.at(process_keys.second.front()));
+
+    vector<Cut> cuts;
+    map<Cut, size_t> cut_indices;
+    vector<vector<size_t> > indices(weights.size());
+    map<Cut, set<size_t> > cuts_by_baseline;
+    for(size_t iweight = 0; iweight < weights.size(); ++iweight){
+      Cut lumi_weight = LumiWeight(process, weights.at(iweight));
+      for(const auto &ikey: process_keys.second){
+        const YieldKey &key = keys.at(ikey);
+        Cut cut = lumi_weight*(GetCut(key) && GetBin(key).Cut() && process.Cut());
+        auto found = cut_indices.find(cut);
+        if(found == cut_indices.end()){
+          found = cut_indices.emplace(cut, cuts.size()).first;
+          cuts.push_back(cut);
+        }
+        indices.at(iweight).push_back(found->second);
+        cuts_by_baseline[GetCut(key)].insert(found->second);
+      }
+    }
+
+    vector<GammaParams> all_gps(cuts.size());
+    vector<bool> filled(cuts.size(), false);
+    FillFromSkims(process, cuts_by_baseline, cuts, all_gps, filled);
+    vector<size_t> to_fill;
+    for(size_t icut = 0; icut < cuts.size(); ++icut){
+      if(!filled.at(icut)) to_fill.push_back(icut);
+    }
+    FillFromChain(process, cuts, to_fill, all_gps, filled);
+
+    double factor = process.IsData() ? 1. : lumi/store_lumi_;
+    for(size_t iweight = 0; iweight < weights.size(); ++iweight){
+      for(size_t i = 0; i < process_keys.second.size(); ++i){
+        gps.at(iweight).at(process_keys.second.at(i)) = factor*all_gps.at(indices.at(iweight).at(i));
+      }
+    }
+  }
+  return gps;
+}
+
+map<vector<double>, vector<GammaParams> >
+YieldManager::GetScanYields(const vector<YieldKey> &keys,
+                            const vector<string> &point_branches) const{
+  return GetScanYields(keys, point_branches, local_lumi_);
+}
+
+map<vector<double>, vector<GammaParams> >
+YieldManager::GetScanYields(const vector<YieldKey> &keys,
+                            const vector<string> &point_branches,
+                            double lumi) const{
+  //For a process holding a whole signal scan (e.g. point_branches {"mgluino", "mlsp"}),
+  //the yields of every key are found for every mass point in a single pass. Per-point
+  //yields are not stored, and the skims are not used.
+  map<vector<double>, vector<GammaParams> > gps;
+  if(keys.size() == 0) return gps;
+  for(const auto &key: keys){
+    if(key.process_id != keys.front().process_id){
+      ERROR("All keys of a scan must share the scan process");
+    }
+  }
+  const Process &process = GetProcess(keys.front());
+
+  vector<Cut> cuts;
+  vector<size_t> primary;
+  vector<Fallbacks> fallbacks;
+  map<Cut, set<size_t> > cuts_by_baseline;
+  BuildCuts(process, keys, cuts, primary, fallbacks, cuts_by_baseline);
+
+  double factor = process.IsData() ? 1. : lumi/store_lumi_;
+  for(const auto &point: process.GetYieldsByPoint(SignalVariantCuts(process, cuts), point_branches)){
+    vector<GammaParams> all_gps = AverageSignalVariants(process, cuts, point.second);
+    vector<GammaParams> &point_gps = gps[point.first];
+    for(size_t ikey = 0; ikey < keys.size(); ++ikey){
+      point_gps.push_back(factor*PickYield(process, cuts, all_gps, primary.at(ikey), fallbacks.at(ikey)));
+    }
+  }
+  return gps;
+}
+
+vector<vector<double> > YieldManager::PrefetchScanYields(const vector<YieldKey> &keys,
+                                                        const vector<string> &point_branches) const{
+  //The scan is read once, and every point's yields are stored under the keys of its own
+  //process (see ScanPointProcess), so generators using those processes find them ready
+  vector<vector<double> > points;
+  for(const auto &point: GetScanYields(keys, point_branches, store_lumi_)){
+    points.push_back(point.first);
+    Process process = ScanPointProcess(GetProcess(keys.front()), point_branches, point.first);
+    for(size_t ikey = 0; ikey < keys.size(); ++ikey){
+      YieldKey key(GetBin(keys.at(ikey)), process, GetCut(keys.at(ikey)));
+      const GammaParams &gp = point.second.at(ikey);
+      {
+        Shard &shard = GetShard(key);
+        lock_guard<mutex> lock(shard.mutex);
+        if(shard.yields.find(key) != shard.yields.end()) continue;
+        promise<GammaParams> yield;
+        yield.set_value(gp);
+        shard.yields[key] = yield.get_future().share();
+      }
+      cache_.Store(key, gp);
+    }
+  }
+  return points;
+}
+
 const double & YieldManager::Luminosity() const{
   return local_lumi_;
 }
@@ -42,76 +191,437 @@ double & YieldManager::Luminosity(){
   return local_lumi_;
 }
 
-bool YieldManager::HaveYield(const YieldKey &key) const{
-  return yields_.find(key) != yields_.end();
+const shared_ptr<YieldManager> & YieldManager::Shared(){
+  static const shared_ptr<YieldManager> shared = make_shared<YieldManager>(store_lumi_);
+  return shared;
+}
+
+const string & YieldManager::CacheDirectory(){
+  return cache_.Directory();
+}
+
+void YieldManager::CacheDirectory(const string &directory){
+  //Per-file partial sums are kept next to the yields, so changing a few files only
+  //rereads those
+  cache_.Directory(directory);
+  Process::PartialSumDirectory(directory);
+}
+
+const string & YieldManager::SkimDirectory(){
+  return skim_directory_;
+}
+
+void YieldManager::SkimDirectory(const string &directory){
+  skim_directory_ = directory;
+}
+
+const string & YieldManager::HistogramDirectory(){
+  return histogram_directory_;
+}
+
+void YieldManager::HistogramDirectory(const string &directory){
+  histogram_directory_ = directory;
+}
+
+const vector<YieldManager::Substitutions> & YieldManager::SignalVariants(){
+  return signal_variants_;
+}
+
+void YieldManager::SignalVariants(const vector<Substitutions> &variants){
+  signal_variants_ = variants;
+}
+
+string YieldManager::SignalVariantsDescription(const Process &process){
+  if(!Contains(process.Name(), "sig")) return "";
+  ostringstream oss;
+  for(const auto &variant: signal_variants_){
+    oss << '{';
+    for(const auto &substitution: variant){
+      oss << substitution.first << "->" << substitution.second << ';';
+    }
+    oss << '}';
+  }
+  oss << flush;
+  return oss.str();
+}
+
+Process YieldManager::ScanPointProcess(const Process &scan,
+                                      const vector<string> &point_branches,
+                                      const vector<double> &point){
+  //The scan process restricted to one mass point
+  if(point.size() != point_branches.size()) ERROR("Mass point does not match the point branches");
+  Process process = scan;
+  for(size_t ibranch = 0; ibranch < point_branches.size(); ++ibranch){
+    ostringstream oss;
+    oss << setprecision(numeric_limits<double>::max_digits10)
+        << point_branches.at(ibranch) << "==" << point.at(ibranch) << flush;
+    process.Cut() = process.Cut() && Cut(oss.str());
+  }
+  return process;
+}
+
+const Cut & YieldManager::NominalWeight(){
+  static const Cut nominal("weight*eff_trig");
+  return nominal;
+}
+
+YieldManager::Shard & YieldManager::GetShard(const YieldKey &key) const{
+  return shards_.at(YieldKeyHash()(key) % num_shards_);
+}
+
+shared_future<GammaParams> YieldManager::FindYield(const YieldKey &key) const{
+  Shard &shard = GetShard(key);
+  lock_guard<mutex> lock(shard.mutex);
+  auto found = shard.yields.find(key);
+  if(found == shard.yields.end()) return shared_future<GammaParams>();
+  return found->second;
+}
+
+void YieldManager::PrefetchYields(const vector<YieldKey> &keys) const{
+  //Each missing key gets a future as soon as it is claimed, so other threads asking for
+  //it wait for this computation instead of starting their own
+  unordered_map<YieldKey, promise<GammaParams>, YieldKeyHash> promises;
+  map<size_t, vector<YieldKey> > keys_by_process;
+  for(const auto &key: keys){
+    Shard &shard = GetShard(key);
+    lock_guard<mutex> lock(shard.mutex);
+    if(shard.yields.find(key) != shard.yields.end()) continue;
+    shard.yields[key] = promises[key].get_future().share();
+    keys_by_process[key.process_id].push_back(key);
+  }
+
+  try{
+    for(const auto &process_keys: keys_by_process){
+      //Yields stored on disk by earlier runs are reused; only the rest are computed
+      vector<YieldKey> missing_keys;
+      YieldStats &stats = YieldStats::Get();
+      const Process &process = GetProcess(process_keys.second.front());
+      for(const auto &key: process_keys.second){
+        GammaParams gps;
+        YieldStats::Stopwatch stopwatch;
+        bool cached = cache_.Load(key, gps);
+        if(cache_.Enabled()){
+          stats.Add(cached ? YieldStats::Counter::yield_cache_hits : YieldStats::Counter::yield_cache_misses);
+        }
+        if(cached){
+          if(verbose_){
+            cout << "Using cached yield for " << key << endl;
+          }
+          stats.AddKeyTime(GetBin(key).Name(), process.Name(), static_cast<string>(GetCut(key)),
+                           "yield_cache", stopwatch.Seconds(), false);
+          promises.at(key).set_value(gps);
+          promises.erase(key);
+        }else{
+          missing_keys.push_back(key);
+        }
+      }
+      if(missing_keys.size() == 0) continue;
+      //Keys of a process are computed together, so the batch is timed as a whole and
+      //each key is only given an even share of it
+      YieldStats::Stopwatch stopwatch;
+      vector<GammaParams> gps = ComputeYields(process, missing_keys);
+      double seconds = stopwatch.Seconds();
+      stats.AddProcessTime(process.Name(), seconds, missing_keys.size());
+      for(size_t ikey = 0; ikey < missing_keys.size(); ++ikey){
+        const YieldKey &key = missing_keys.at(ikey);
+        stats.AddKeyTime(GetBin(key).Name(), process.Name(), static_cast<string>(GetCut(key)),
+                         "computed", seconds/missing_keys.size(), true);
+        cache_.Store(key, gps.at(ikey));
+        promises.at(key).set_value(gps.at(ikey));
+        promises.erase(key);
+      }
+    }
+  }catch(...){
+    //Threads already waiting on the failed keys get the exception, but the keys are
+    //dropped from the shards so a later request computes them again
+    for(auto &key_promise: promises){
+      {
+        Shard &shard = GetShard(key_promise.first);
+        lock_guard<mutex> lock(shard.mutex);
+        shard.yields.erase(key_promise.first);
+      }
+      key_promise.second.set_exception(current_exception());
+    }
+    throw;
+  }
+}
+
+vector<GammaParams> YieldManager::ComputeYields(const Process &process, const vector<YieldKey> &keys) const{
+  vector<GammaParams> gps(keys.size());
+  vector<Cut> cuts;
+  vector<size_t> primary;
+  vector<Fallbacks> fallbacks;
+  map<Cut, set<size_t> > cuts_by_baseline;
+  BuildCuts(process, keys, cuts, primary, fallbacks, cuts_by_baseline);
+  vector<GammaParams> all_gps(cuts.size());
+  vector<bool> filled(cuts.size(), false);
+  vector<bool> strict(cuts.size(), false);
+  for(const auto &baseline_cuts: cuts_by_baseline){
+    for(const auto &icut: baseline_cuts.second){
+      strict.at(icut) = true;
+    }
+  }
+  bool used_histograms = FillFromHistograms(process, cuts_by_baseline, cuts, all_gps, filled);
+  bool used_skims = FillFromSkims(process, cuts_by_baseline, cuts, all_gps, filled) || used_histograms;
+
+  //Without skims or histograms everything is filled in one pass. With them, the chain
+  //is only read for cuts they could not handle and for the looser cuts of empty bins.
+  vector<size_t> to_fill;
+  for(size_t icut = 0; icut < cuts.size(); ++icut){
+    if(filled.at(icut)) continue;
+    if(!used_skims || strict.at(icut)) to_fill.push_back(icut);
+  }
+  FillFromChain(process, cuts, to_fill, all_gps, filled);
+  if(used_skims && process.CountZeros()){
+    to_fill.clear();
+    for(size_t ikey = 0; ikey < keys.size(); ++ikey){
+      if(all_gps.at(primary.at(ikey)).Weight() > 0.) continue;
+      for(const auto &icut: fallbacks.at(ikey)){
+        if(!filled.at(icut) && find(to_fill.cbegin(), to_fill.cend(), icut) == to_fill.cend()){
+          to_fill.push_back(icut);
+        }
+      }
+    }
+    FillFromChain(process, cuts, to_fill, all_gps, filled);
+  }
+
+  for(size_t ikey = 0; ikey < keys.size(); ++ikey){
+    gps.at(ikey) = PickYield(process, cuts, all_gps, primary.at(ikey), fallbacks.at(ikey));
+  }
+
+  if(verbose_){
+    for(size_t ikey = 0; ikey < keys.size(); ++ikey){
+      cout << "Found yield=" << gps.at(ikey) << " for " << keys.at(ikey) << '\n' << endl;
+    }
+  }
+  return gps;
 }
 
-void YieldManager::ComputeYield(const YieldKey &key) const{
-  const Bin &bin = GetBin(key);
-  const Process &process = GetProcess(key);
-  const Cut &cut = GetCut(key);
+void YieldManager::BuildCuts(const Process &process,
+                             const vector<YieldKey> &keys,
+                             vector<Cut> &cuts,
+                             vector<size_t> &primary,
+                             vector<Fallbacks> &fallbacks,
+                             map<Cut, set<size_t> > &cuts_by_baseline) const{
+  //All keys share the process, so their primary cuts and, for processes that count
+  //zeros, the looser cuts used to estimate the weight of empty bins are filled
+  //together. Identical cuts are only listed once.
+  Cut lumi_weight = LumiWeight(process);
+  map<Cut, size_t> cut_indices;
+  auto add_cut = [&cuts, &cut_indices](const Cut &cut){
+    auto found = cut_indices.find(cut);
+    if(found != cut_indices.end()) return found->second;
+    cut_indices[cut] = cuts.size();
+    cuts.push_back(cut);
+    return cuts.size()-1;
+  };
 
-  GammaParams gps;
+  cuts.clear();
+  primary.assign(keys.size(), 0);
+  fallbacks.assign(keys.size(), Fallbacks());
+  cuts_by_baseline.clear();
+  for(size_t ikey = 0; ikey < keys.size(); ++ikey){
+    const YieldKey &key = keys.at(ikey);
+    if(verbose_){
+      cout << "Computing yield for " << key << endl;
+    }
+    primary.at(ikey) = add_cut(lumi_weight*(GetCut(key) && GetBin(key).Cut() && process.Cut()));
+    cuts_by_baseline[GetCut(key)].insert(primary.at(ikey));
+    if(!process.CountZeros()) continue;
+    fallbacks.at(ikey).at(0) = add_cut(lumi_weight*(GetCut(key) && process.Cut()));
+    cuts_by_baseline[GetCut(key)].insert(fallbacks.at(ikey).at(0));
+    fallbacks.at(ikey).at(1) = add_cut(lumi_weight*(process.Cut()));
+    fallbacks.at(ikey).at(2) = add_cut(lumi_weight);
+    fallbacks.at(ikey).at(3) = add_cut(Cut());
+  }
+}
 
-  if(HaveYield(key)){
+GammaParams YieldManager::PickYield(const Process &process,
+                                    const vector<Cut> &cuts,
+                                    const vector<GammaParams> &all_gps,
+                                    size_t primary,
+                                    const Fallbacks &fallbacks) const{
+  GammaParams gp = all_gps.at(primary);
+  if(gp.Weight() > 0.) return gp;
+
+  //Zero yield: fall back on progressively looser cuts to estimate the weight
+  if(!process.CountZeros()){
+    gp.SetNEffectiveAndWeight(0., 0.);
+    return gp;
+  }
+  for(size_t level = 0; level < fallbacks.size() && gp.Weight()<=0.; ++level){
+    size_t icut = fallbacks.at(level);
     if(verbose_){
-      cout << "Using known yield for " << key << endl;
+      cout << "Trying cut " << cuts.at(icut) << endl;
+    }
+    gp.SetNEffectiveAndWeight(0., all_gps.at(icut).Weight());
+  }
+  return gp;
+}
+
+bool YieldManager::FillFromHistograms(const Process &process,
+                                      const map<Cut, set<size_t> > &cuts_by_baseline,
+                                      const vector<Cut> &cuts,
+                                      vector<GammaParams> &gps,
+                                      vector<bool> &filled) const{
+  //Pre-aggregated histograms answer the cuts that only add bin-edge thresholds on
+  //their axes to the baseline, without touching any events
+  if(histogram_directory_ == "") return false;
+  bool used_histograms = false;
+  for(const auto &baseline_cuts: cuts_by_baseline){
+    YieldHistogram histogram(YieldHistogram::PathFor(histogram_directory_, process, baseline_cuts.first));
+    if(!histogram.IsValid()
+       || histogram.Description() != YieldHistogram::Description(process, baseline_cuts.first)){
+      continue;
     }
-    gps = GetYield(key);
-  }else if(process.GetEntries() == 0){
+    vector<size_t> indices(baseline_cuts.second.cbegin(), baseline_cuts.second.cend());
+    vector<Cut> histogram_cuts;
+    for(const auto &icut: indices){
+      histogram_cuts.push_back(cuts.at(icut));
+    }
+    vector<GammaParams> histogram_gps;
+    if(!ProjectYields(process, histogram_cuts, histogram_gps, nullptr, &histogram)) continue;
     if(verbose_){
-      cout << "No entries found for " << key << endl;
+      cout << "Using histogram " << histogram.Path() << " for " << process << endl;
     }
-    gps.SetNEffectiveAndWeight(0., 0.);
-  }else{
+    for(size_t i = 0; i < indices.size(); ++i){
+      gps.at(indices.at(i)) = histogram_gps.at(i);
+      filled.at(indices.at(i)) = true;
+    }
+    used_histograms = true;
+  }
+  return used_histograms;
+}
+
+bool YieldManager::FillFromSkims(const Process &process,
+                                 const map<Cut, set<size_t> > &cuts_by_baseline,
+                                 const vector<Cut> &cuts,
+                                 vector<GammaParams> &gps,
+                                 vector<bool> &filled) const{
+  if(skim_directory_ == "") return false;
+  bool used_skims = false;
+  for(const auto &baseline_cuts: cuts_by_baseline){
+    vector<size_t> indices;
+    for(const auto &icut: baseline_cuts.second){
+      if(!filled.at(icut)) indices.push_back(icut);
+    }
+    if(indices.size() == 0) continue;
+    SkimFile skim(SkimFile::PathFor(skim_directory_, process, baseline_cuts.first));
+    if(!skim.IsValid() || skim.Description() != SkimFile::Description(process, baseline_cuts.first)){
+      continue;
+    }
+    vector<Cut> skim_cuts;
+    for(const auto &icut: indices){
+      skim_cuts.push_back(cuts.at(icut));
+    }
+    vector<GammaParams> skim_gps;
+    if(!ProjectYields(process, skim_cuts, skim_gps, &skim)) continue;
     if(verbose_){
-      cout << "Computing yield for " << key << endl;
+      cout << "Using skim " << skim.Path() << " for " << process << endl;
     }
-    ostringstream oss;
-    oss << local_lumi_ << flush;
-    Cut lumi_weight = process.IsData() ? Cut() : 
-      (Contains(process.Name(), "sig")?Cut(oss.str()+"*weight*eff_trig"):Cut(oss.str()+"*weight*eff_trig"));
-
-    array<Cut, 5> cuts;
-    cuts.at(0) = lumi_weight*(cut && bin.Cut() && process.Cut());
-    cuts.at(1) = lumi_weight*(cut && process.Cut());
-    cuts.at(2) = lumi_weight*(process.Cut());
-    cuts.at(3) = lumi_weight;
-    cuts.at(4) = Cut();
-
-    for(size_t icut = 0; icut < cuts.size() && gps.Weight()<=0.; ++icut){
-      if(icut > 0 && !process.CountZeros()){
-        gps.SetNEffectiveAndWeight(0., 0.);
-        break;
-      }
-      Cut &this_cut = cuts.at(icut);
-      if(verbose_){
-        cout << "Trying cut " << this_cut << endl;
+    for(size_t i = 0; i < indices.size(); ++i){
+      gps.at(indices.at(i)) = skim_gps.at(i);
+      filled.at(indices.at(i)) = true;
+    }
+    used_skims = true;
+  }
+  return used_skims;
+}
+
+void YieldManager::FillFromChain(const Process &process,
+                                 const vector<Cut> &cuts,
+                                 const vector<size_t> &indices,
+                                 vector<GammaParams> &gps,
+                                 vector<bool> &filled) const{
+  if(indices.size() == 0) return;
+  //Only reading the chain needs the files, so emptiness is checked here rather than
+  //before the histograms and skims are tried
+  if(process.GetEntries() == 0){
+    if(verbose_){
+      cout << "No entries found for " << process << endl;
+    }
+    for(const auto &icut: indices){
+      gps.at(icut).SetNEffectiveAndWeight(0., 0.);
+      filled.at(icut) = true;
+    }
+    return;
+  }
+  vector<Cut> chain_cuts;
+  for(const auto &icut: indices){
+    chain_cuts.push_back(cuts.at(icut));
+  }
+  vector<GammaParams> chain_gps;
+  ProjectYields(process, chain_cuts, chain_gps);
+  for(size_t i = 0; i < indices.size(); ++i){
+    gps.at(indices.at(i)) = chain_gps.at(i);
+    filled.at(indices.at(i)) = true;
+  }
+}
+
+bool YieldManager::ProjectYields(const Process &process,
+                                 const vector<Cut> &cuts,
+                                 vector<GammaParams> &gps,
+                                 const SkimFile *skim,
+                                 const YieldHistogram *histogram) const{
+  //Reads the skim or histogram if one is given, the process chain otherwise. Returns
+  //false if the skim or histogram cannot provide all the cuts.
+  vector<Cut> all_cuts = SignalVariantCuts(process, cuts);
+  vector<GammaParams> all_gps;
+  if(skim != nullptr){
+    if(!skim->GetYields(process, all_cuts, all_gps)) return false;
+  }else if(histogram != nullptr){
+    if(!histogram->GetYields(process, all_cuts, all_gps)) return false;
+  }else{
+    all_gps = process.GetYields(all_cuts);
+  }
+  gps = AverageSignalVariants(process, cuts, all_gps);
+  return true;
+}
+
+vector<Cut> YieldManager::SignalVariantCuts(const Process &process, const vector<Cut> &cuts){
+  //Signal yields are averaged over the nominal and the substituted selections, all
+  //filled in the same pass. The variants follow the nominal cuts.
+  vector<Cut> all_cuts(cuts);
+  if(!Contains(process.Name(), "sig")) return all_cuts;
+  for(const auto &variant: signal_variants_){
+    for(const auto &cut: cuts){
+      Cut variant_cut = cut;
+      for(const auto &substitution: variant){
+        variant_cut.Substitute(substitution.first, substitution.second);
       }
-      GammaParams temp_gps = process.GetYield(this_cut);
-      //// Averaging signal yields cutting on met and met_tru, as prescripted by SUSY group
-      //// https://twiki.cern.ch/twiki/bin/viewauth/CMS/SUSRecommendationsICHEP16#Special_treatment_of_MET_uncerta
-      if(Contains(process.Name(), "sig")){
-	string mettru_s = this_cut.GetCut(); 
-	ReplaceAll(mettru_s, "met_calo", "XXXYYYZZZ_calo");
-	ReplaceAll(mettru_s, "met", "met_tru");
-	ReplaceAll(mettru_s, "XXXYYYZZZ_calo", "met_calo");
-	Cut mettru_cut(mettru_s); 
-	GammaParams mettru_gps = process.GetYield(mettru_cut);
-	if(verbose_) cout<<"Yields: met "<<temp_gps.Yield()<<", met_tru "<<mettru_gps.Yield();
-	temp_gps.SetYieldAndUncertainty(0.5*(temp_gps.Yield()+mettru_gps.Yield()),
-					max(temp_gps.Uncertainty(), mettru_gps.Uncertainty()));
-	if(verbose_) cout<<", average "<<temp_gps.Yield()<<" for bin "<<bin.Name()<<endl;
-      } // If it is signal
-      if(icut == 0) gps = temp_gps;
-      else gps.SetNEffectiveAndWeight(0., temp_gps.Weight());
+      all_cuts.push_back(variant_cut);
     }
   }
+  return all_cuts;
+}
 
-  if(verbose_){
-    cout << "Found yield=" << gps << '\n' << endl;
+vector<GammaParams> YieldManager::AverageSignalVariants(const Process &process,
+                                                        const vector<Cut> &cuts,
+                                                        const vector<GammaParams> &all_gps) const{
+  if(!Contains(process.Name(), "sig") || signal_variants_.size() == 0){
+    return vector<GammaParams>(all_gps.cbegin(), all_gps.cbegin()+cuts.size());
+  }
+
+  size_t num_variants = signal_variants_.size()+1;
+  vector<GammaParams> gps(cuts.size());
+  for(size_t icut = 0; icut < cuts.size(); ++icut){
+    double yield = 0., uncertainty = 0.;
+    if(verbose_) cout << "Yields:";
+    for(size_t ivariant = 0; ivariant < num_variants; ++ivariant){
+      const GammaParams &gp = all_gps.at(icut+ivariant*cuts.size());
+      if(verbose_) cout << ' ' << gp.Yield();
+      yield += gp.Yield();
+      uncertainty = max(uncertainty, gp.Uncertainty());
+    }
+    gps.at(icut).SetYieldAndUncertainty(yield/num_variants, uncertainty);
+    if(verbose_) cout << ", average " << gps.at(icut).Yield() << " for cut " << cuts.at(icut) << endl;
   }
-  double factor = store_lumi_/local_lumi_;
-  if(process.IsData()) factor = 1.;
-  yields_[key] = factor*gps;
+  return gps;
+}
+
+Cut YieldManager::LumiWeight(const Process &process, const Cut &weight){
+  if(process.IsData()) return Cut();
+  ostringstream oss;
+  oss << store_lumi_ << flush;
+  return Cut(oss.str())*weight;
 }
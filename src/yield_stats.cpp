@@ -0,0 +1,148 @@
+#include "yield_stats.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+
+#include "utilities.hpp"
+
+using namespace std;
+
+namespace{
+  const array<string, static_cast<size_t>(YieldStats::Counter::num_counters)> counter_names = {{
+      "chain_passes", "skim_passes", "histogram_passes",
+      "events_scanned", "bytes_read",
+      "yield_cache_hits", "yield_cache_misses",
+      "partial_sum_hits", "partial_sum_misses"}};
+
+  string Quoted(const string &str){
+    //JSON string with the characters that need it escaped
+    ostringstream oss;
+    oss << '"';
+    for(const auto &c: str){
+      if(c == '"' || c == '\\'){
+        oss << '\\' << c;
+      }else if(static_cast<unsigned char>(c) < 0x20){
+        oss << "\\u" << hex << setw(4) << setfill('0') << static_cast<int>(c) << dec << setfill(' ');
+      }else{
+        oss << c;
+      }
+    }
+    oss << '"' << flush;
+    return oss.str();
+  }
+}
+
+YieldStats::Stopwatch::Stopwatch():
+  start_(chrono::steady_clock::now()){
+}
+
+double YieldStats::Stopwatch::Seconds() const{
+  return chrono::duration<double>(chrono::steady_clock::now()-start_).count();
+}
+
+YieldStats & YieldStats::Get(){
+  static YieldStats stats;
+  return stats;
+}
+
+void YieldStats::Add(Counter counter, uint64_t amount){
+  counters_.at(static_cast<size_t>(counter)) += amount;
+}
+
+uint64_t YieldStats::Count(Counter counter) const{
+  return counters_.at(static_cast<size_t>(counter));
+}
+
+void YieldStats::AddProcessTime(const string &process, double seconds, size_t num_keys){
+  lock_guard<mutex> lock(mutex_);
+  ProcessTime &time = process_times_[process];
+  time.seconds += seconds;
+  time.num_keys += num_keys;
+  ++time.num_batches;
+}
+
+void YieldStats::AddKeyTime(const string &bin, const string &process, const string &cut,
+                            const string &source, double seconds, bool amortized){
+  //Cuts are long, so keys refer to them by their index in the report's list of cuts
+  lock_guard<mutex> lock(mutex_);
+  auto found = cut_indices_.find(cut);
+  if(found == cut_indices_.end()){
+    found = cut_indices_.emplace(cut, cuts_.size()).first;
+    cuts_.push_back(cut);
+  }
+  key_times_.push_back(KeyTime{bin, process, found->second, source, seconds, amortized});
+}
+
+const string & YieldStats::ReportPath() const{
+  return report_path_;
+}
+
+void YieldStats::ReportPath(const string &path){
+  report_path_ = path;
+}
+
+void YieldStats::WriteReport(ostream &stream) const{
+  lock_guard<mutex> lock(mutex_);
+  ostringstream oss;
+  oss << setprecision(numeric_limits<double>::max_digits10)
+      << "{\n  \"counters\": {";
+  for(size_t icounter = 0; icounter < num_counters_; ++icounter){
+    oss << (icounter == 0 ? "\n" : ",\n")
+        << "    " << Quoted(counter_names.at(icounter)) << ": " << counters_.at(icounter);
+  }
+  oss << "\n  },\n  \"processes\": {";
+  bool first = true;
+  for(const auto &process_time: process_times_){
+    oss << (first ? "\n" : ",\n")
+        << "    " << Quoted(process_time.first) << ": {"
+        << "\"seconds\": " << process_time.second.seconds
+        << ", \"keys\": " << process_time.second.num_keys
+        << ", \"batches\": " << process_time.second.num_batches << '}';
+    first = false;
+  }
+  oss << "\n  },\n  \"cuts\": [";
+  for(size_t icut = 0; icut < cuts_.size(); ++icut){
+    oss << (icut == 0 ? "\n" : ",\n") << "    " << Quoted(cuts_.at(icut));
+  }
+  oss << "\n  ],\n  \"keys\": [";
+  first = true;
+  for(const auto &key_time: key_times_){
+    oss << (first ? "\n" : ",\n")
+        << "    {\"bin\": " << Quoted(key_time.bin)
+        << ", \"process\": " << Quoted(key_time.process)
+        << ", \"cut\": " << key_time.cut
+        << ", \"source\": " << Quoted(key_time.source)
+        << ", \"seconds\": " << key_time.seconds
+        << ", \"amortized\": " << (key_time.amortized ? "true" : "false") << '}';
+    first = false;
+  }
+  oss << "\n  ]\n}\n" << flush;
+  stream << oss.str() << flush;
+}
+
+YieldStats::~YieldStats(){
+  //The report is written when the program exits
+  if(report_path_ == "") return;
+  try{
+    ostringstream oss;
+    WriteReport(oss);
+    WriteFileAtomically(report_path_, oss.str());
+  }catch(const exception &e){
+    DBG("Could not write yield statistics to " << report_path_ << ": " << e.what());
+  }
+}
+
+YieldStats::YieldStats():
+  counters_(),
+  mutex_(),
+  process_times_(),
+  key_times_(),
+  cuts_(),
+  cut_indices_(),
+  report_path_(){
+  for(auto &counter: counters_){
+    counter = 0;
+  }
+}